@@ -1,119 +1,235 @@
 #include "bplustree.h"
+#include "bplustree_thread.h"
+#include "bplustree_snapshot.h"
+#include "bplustree_key.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <algorithm>
+#ifdef BPTREE_OS_WINDOWS
+#include <malloc.h>
+#endif
+
+#ifndef BPTREE_NO_SIMD
+#   if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#       define BPTREE_SIMD_X86
+#       define BPTREE_SIMD_TARGET(x) __attribute__((target(x)))
+#       include <immintrin.h>
+#   elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#       define BPTREE_SIMD_X86
+#       define BPTREE_SIMD_TARGET(x)
+#       include <intrin.h>
+#       include <immintrin.h>
+#   endif
+#endif
+
+/* Kernels counting the integer keys less than or
+ * equal to key among n sorted keys, which is the
+ * index of the first key greater than key.  The
+ * vector kernels compare the whole range without
+ * branching on the keys and sum the compare masks.
+ */
+static int count_keys_le_scalar( const int64_t * keys, int n, int64_t key )
+{
+    int i, count = 0;
+    for (i = 0; i < n; i++)
+        count += keys[i] <= key;
+    return count;
+}
 
-BPlusTree::BPlusTree( int nOrder/* = BPTREE_DEFAULT_ORDER*/, int nKeyLength/* = BPTREE_DEFAULT_KEY_LENGTH*/ )
+#ifdef BPTREE_SIMD_X86
+BPTREE_SIMD_TARGET("sse4.2")
+static int count_keys_le_sse42( const int64_t * keys, int n, int64_t key )
+{
+    __m128i k = _mm_set1_epi64x(key);
+    __m128i greater = _mm_setzero_si128();
+    int64_t sums[2];
+    int i, count;
+    for (i = 0; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+        greater = _mm_sub_epi64(greater, _mm_cmpgt_epi64(v, k));
+    }
+    _mm_storeu_si128((__m128i *)sums, greater);
+    count = i - (int)(sums[0] + sums[1]);
+    for (; i < n; i++)
+        count += keys[i] <= key;
+    return count;
+}
+
+BPTREE_SIMD_TARGET("avx2")
+static int count_keys_le_avx2( const int64_t * keys, int n, int64_t key )
+{
+    __m256i k = _mm256_set1_epi64x(key);
+    __m256i greater = _mm256_setzero_si256();
+    int64_t sums[4];
+    int i, count;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+        greater = _mm256_sub_epi64(greater, _mm256_cmpgt_epi64(v, k));
+    }
+    _mm256_storeu_si256((__m256i *)sums, greater);
+    count = i - (int)(sums[0] + sums[1] + sums[2] + sums[3]);
+    for (; i < n; i++)
+        count += keys[i] <= key;
+    return count;
+}
+
+#ifdef _MSC_VER
+static bool cpu_has_avx2( void )
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    /* OSXSAVE and AVX, and the OS saves the YMM state. */
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0
+            || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static bool cpu_has_sse42( void )
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+}
+#else
+static bool cpu_has_avx2( void )
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool cpu_has_sse42( void )
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#endif
+#endif
+
+/* Picks the fastest kernel the CPU supports.
+ */
+static int (*select_count_keys_le( void ))( const int64_t *, int, int64_t )
+{
+#ifdef BPTREE_SIMD_X86
+    if (cpu_has_avx2())
+        return count_keys_le_avx2;
+    if (cpu_has_sse42())
+        return count_keys_le_sse42;
+#endif
+    return count_keys_le_scalar;
+}
+
+BPlusTree::BPlusTree( int nOrder/* = BPTREE_DEFAULT_ORDER*/, int nKeyLength/* = BPTREE_DEFAULT_KEY_LENGTH*/, int nKeyType/* = BPTREE_KEY_TYPE_STRING*/, int nNodeSize/* = BPTREE_DEFAULT_NODE_SIZE*/ )
 {
-    order = nOrder;
-    if(order < BPTREE_MIN_ORDER)
-        order = BPTREE_MIN_ORDER;
-    if(order > BPTREE_MAX_ORDER)
-        order = BPTREE_MAX_ORDER;
     key_length = nKeyLength + 1;
     if(key_length < 0)
         key_length = BPTREE_DEFAULT_KEY_LENGTH + 1;
+    key_type = nKeyType;
+    if(key_type != BPTREE_KEY_TYPE_INTEGER)
+        key_type = BPTREE_KEY_TYPE_STRING;
+    key_size = key_type == BPTREE_KEY_TYPE_INTEGER ? (int)sizeof(int64_t) : key_length;
+    if(nNodeSize <= 0 || nNodeSize > BPTREE_MAX_NODE_SIZE)
+        nNodeSize = BPTREE_DEFAULT_NODE_SIZE;
+    order = nOrder;
+    if(order == BPTREE_ORDER_AUTO)
+    {
+        order = BPTREE_MIN_ORDER;
+        while(node_layout(order + 1, NULL) <= nNodeSize)
+            order++;
+    }
+    if(order < BPTREE_MIN_ORDER)
+        order = BPTREE_MIN_ORDER;
+    while(order > BPTREE_MIN_ORDER && node_layout(order, NULL) > BPTREE_MAX_NODE_SIZE)
+        order--;
+    node_size = node_layout(order, &pointers_offset);
+    node_alignment = node_size < BPTREE_PAGE_SIZE ? BPTREE_CACHE_LINE_SIZE : BPTREE_PAGE_SIZE;
+    count_keys_le = select_count_keys_le();
     verbose_output = false;
-    queue = NULL;
+    allocator = NULL;
     root_node = NULL;
+    concurrency = BPTREE_CONCURRENCY_NONE;
+    bpt_latch_init(&root_latch);
+    retired = NULL;
+    num_retired = 0;
+    retired_capacity = 0;
+    reclaim_at = BPTREE_RECLAIM_THRESHOLD;
+    bpt_latch_init(&retired_latch);
+    bpt_epoch_init(&epochs);
 }
 
 BPlusTree::~BPlusTree()
 {
     DestroyBPTree();
+    free(retired);
 }
 
 node * BPlusTree::Insert( char * key, int value )
 {
-    root_node = Insert(root_node, key, value);
-    return root_node;
+    int64_t num;
+    return insert_key(make_key(key, &num), value);
 }
 
 node * BPlusTree::Delete( char * key )
 {
-    root_node = Delete(root_node, key);
-    return root_node;
+    int64_t num;
+    return delete_key(make_key(key, &num));
 }
 
 record * BPlusTree::Find( char * key, bool verbose )
 {
-    record * r = Find(root_node, key, verbose);
-    return r;
+    int64_t num;
+    return find_key(make_key(key, &num), verbose);
 }
 
 node * BPlusTree::Insert( int key, int value )
 {
-    char * key_str = (char *)malloc(key_length);
-    memset(key_str, 0, key_length);
-    char * bak_str = (char *)malloc(key_length);
-    memset(bak_str, 0, key_length);
-    sprintf(bak_str, "%d", key);
-    int i = 0;
-    for(i = 0; i < key_length; i++)
-    {
-        key_str[i] = '0';
-    }
-    key_str[key_length-1] = '\0';
-    for(i = 0; i < strlen(bak_str); i++)
-    {
-        key_str[key_length-2-i] = bak_str[strlen(bak_str)-1-i];
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return insert_key((char *)&num, value);
     }
+    char * key_str = format_key(key);
     node * p = Insert(key_str, value);
     free(key_str);
-    free(bak_str);
     return p;
 }
 
 node * BPlusTree::Delete( int key )
 {
-    char * key_str = (char *)malloc(key_length);
-    memset(key_str, 0, key_length);
-    char * bak_str = (char *)malloc(key_length);
-    memset(bak_str, 0, key_length);
-    sprintf(bak_str, "%d", key);
-    int i = 0;
-    for(i = 0; i < key_length; i++)
-    {
-        key_str[i] = '0';
-    }
-    key_str[key_length-1] = '\0';
-    for(i = 0; i < strlen(bak_str); i++)
-    {
-        key_str[key_length-2-i] = bak_str[strlen(bak_str)-1-i];
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return delete_key((char *)&num);
     }
+    char * key_str = format_key(key);
     node * p = Delete(key_str);
     free(key_str);
-    free(bak_str);
     return p;
 }
 
 record * BPlusTree::Find( int key, bool verbose )
 {
-    char * key_str = (char *)malloc(key_length);
-    memset(key_str, 0, key_length);
-    char * bak_str = (char *)malloc(key_length);
-    memset(bak_str, 0, key_length);
-    sprintf(bak_str, "%d", key);
-    int i = 0;
-    for(i = 0; i < key_length; i++)
-    {
-        key_str[i] = '0';
-    }
-    key_str[key_length-1] = '\0';
-    for(i = 0; i < strlen(bak_str); i++)
-    {
-        key_str[key_length-2-i] = bak_str[strlen(bak_str)-1-i];
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return find_key((char *)&num, verbose);
     }
+    char * key_str = format_key(key);
     record * p = Find(key_str, verbose);
     free(key_str);
-    free(bak_str);
     return p;
 }
 
 void BPlusTree::DestroyBPTree()
 {
+    if (root_node != NULL && allocator != NULL && allocator->ReleaseAll()) {
+        root_node = NULL;
+        num_retired = 0;
+        return;
+    }
     root_node = destroy_tree(root_node);
+    free_retired();
 }
 
 void BPlusTree::PrintBPTree()
@@ -128,29 +244,25 @@ void BPlusTree::PrintBPTreeLeaves()
 
 void BPlusTree::FindAndPrint( char * key, bool verbose )
 {
-    find_and_print(root_node, key, verbose);
+    int64_t num;
+    find_and_print(root_node, make_key(key, &num), verbose);
 }
 
 void BPlusTree::FindAndPrint( int key, bool verbose )
 {
-    char * key_str = (char *)malloc(key_length);
-    memset(key_str, 0, key_length);
-    char * bak_str = (char *)malloc(key_length);
-    memset(bak_str, 0, key_length);
-    sprintf(bak_str, "%d", key);
-    int i = 0;
-    for(i = 0; i < key_length; i++)
-    {
-        key_str[i] = '0';
-    }
-    key_str[key_length-1] = '\0';
-    for(i = 0; i < strlen(bak_str); i++)
-    {
-        key_str[key_length-2-i] = bak_str[strlen(bak_str)-1-i];
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        find_and_print(root_node, (char *)&num, verbose);
+        return;
     }
+    char * key_str = format_key(key);
     find_and_print(root_node, key_str, verbose);
     free(key_str);
-    free(bak_str);
+}
+
+int BPlusTree::GetOrder()
+{
+    return order;
 }
 
 void BPlusTree::SetVerbose( bool verbose )
@@ -158,6 +270,445 @@ void BPlusTree::SetVerbose( bool verbose )
     verbose_output = verbose;
 }
 
+bool BPlusTree::SetAllocator( BPTreeAllocator * pAllocator )
+{
+    if (root_node != NULL)
+        return false;
+    allocator = pAllocator;
+    return true;
+}
+
+bool BPlusTree::FindValue( char * key, int * value )
+{
+    int64_t num;
+    return find_value(make_key(key, &num), value);
+}
+
+bool BPlusTree::FindValue( int key, int * value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return find_value((char *)&num, value);
+    }
+    char * key_str = format_key(key);
+    bool found = find_value(key_str, value);
+    free(key_str);
+    return found;
+}
+
+void BPlusTree::SetThreadSafe( bool bThreadSafe )
+{
+    SetConcurrency(bThreadSafe ? BPTREE_CONCURRENCY_LATCH : BPTREE_CONCURRENCY_NONE);
+}
+
+void BPlusTree::SetConcurrency( int nMode )
+{
+    if (nMode != BPTREE_CONCURRENCY_LATCH && nMode != BPTREE_CONCURRENCY_OPTIMISTIC
+            && nMode != BPTREE_CONCURRENCY_COPY_ON_WRITE)
+        nMode = BPTREE_CONCURRENCY_NONE;
+    free_retired();
+    concurrency = nMode;
+}
+
+tree_snapshot BPlusTree::TakeSnapshot()
+{
+    tree_snapshot snapshot;
+
+    snapshot.root = NULL;
+    snapshot.epoch = 0;
+    snapshot.slot = -1;
+    if (concurrency != BPTREE_CONCURRENCY_COPY_ON_WRITE)
+        return snapshot;
+    snapshot.slot = bpt_epoch_enter(&epochs);
+    snapshot.epoch = bpt_epoch_load(&epochs.slots[snapshot.slot].epoch);
+    snapshot.root = published_root();
+    return snapshot;
+}
+
+void BPlusTree::ReleaseSnapshot( tree_snapshot * snapshot )
+{
+    if (snapshot->slot >= 0)
+        bpt_epoch_exit(&epochs, snapshot->slot);
+    snapshot->root = NULL;
+    snapshot->slot = -1;
+}
+
+bool BPlusTree::FindValue( const tree_snapshot * snapshot, char * key, int * value )
+{
+    int64_t num;
+    record * r = Find(snapshot->root, make_key(key, &num), false);
+    if (r != NULL)
+        *value = r->value;
+    return r != NULL;
+}
+
+bool BPlusTree::FindValue( const tree_snapshot * snapshot, int key, int * value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        record * r = Find(snapshot->root, (char *)&num, false);
+        if (r != NULL)
+            *value = r->value;
+        return r != NULL;
+    }
+    char * key_str = format_key(key);
+    bool found = FindValue(snapshot, key_str, value);
+    free(key_str);
+    return found;
+}
+
+scan_result BPlusTree::Scan( const tree_snapshot * snapshot, char * lo, char * hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    int64_t lo_num, hi_num;
+    return snapshot_scan(snapshot->root, make_key(lo, &lo_num), make_key(hi, &hi_num), fn, arg);
+}
+
+scan_result BPlusTree::Scan( const tree_snapshot * snapshot, int lo, int hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t lo_num = lo, hi_num = hi;
+        return snapshot_scan(snapshot->root, (char *)&lo_num, (char *)&hi_num, fn, arg);
+    }
+    char * lo_str = format_key(lo);
+    char * hi_str = format_key(hi);
+    scan_result result = snapshot_scan(snapshot->root, lo_str, hi_str, fn, arg);
+    free(lo_str);
+    free(hi_str);
+    return result;
+}
+
+BPlusTree::iterator BPlusTree::Begin()
+{
+    node * c = root_node;
+    if (c == NULL)
+        return End();
+    while (!c->is_leaf)
+        c = (node *)c->pointers[0];
+    return iterator(c, 0, order, key_size);
+}
+
+BPlusTree::iterator BPlusTree::End()
+{
+    return iterator(NULL, 0, order, key_size);
+}
+
+BPlusTree::iterator BPlusTree::LowerBound( char * key )
+{
+    int64_t num;
+    return lower_bound_iterator(make_key(key, &num));
+}
+
+BPlusTree::iterator BPlusTree::LowerBound( int key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return lower_bound_iterator((char *)&num);
+    }
+    char * key_str = format_key(key);
+    iterator it = lower_bound_iterator(key_str);
+    free(key_str);
+    return it;
+}
+
+BPlusTree::iterator BPlusTree::UpperBound( char * key )
+{
+    int64_t num;
+    return upper_bound_iterator(make_key(key, &num));
+}
+
+BPlusTree::iterator BPlusTree::UpperBound( int key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return upper_bound_iterator((char *)&num);
+    }
+    char * key_str = format_key(key);
+    iterator it = upper_bound_iterator(key_str);
+    free(key_str);
+    return it;
+}
+
+BPlusTree::range BPlusTree::Range( char * lo, char * hi )
+{
+    int64_t lo_num, hi_num;
+    return make_range(make_key(lo, &lo_num), make_key(hi, &hi_num));
+}
+
+BPlusTree::range BPlusTree::Range( int lo, int hi )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t lo_num = lo, hi_num = hi;
+        return make_range((char *)&lo_num, (char *)&hi_num);
+    }
+    char * lo_str = format_key(lo);
+    char * hi_str = format_key(hi);
+    range r = make_range(lo_str, hi_str);
+    free(lo_str);
+    free(hi_str);
+    return r;
+}
+
+scan_result BPlusTree::ParallelScan( char * lo, char * hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/, int num_threads/* = 0*/ )
+{
+    int64_t lo_num, hi_num;
+    return parallel_scan(make_key(lo, &lo_num), make_key(hi, &hi_num), fn, arg, num_threads);
+}
+
+scan_result BPlusTree::ParallelScan( int lo, int hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/, int num_threads/* = 0*/ )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t lo_num = lo, hi_num = hi;
+        return parallel_scan((char *)&lo_num, (char *)&hi_num, fn, arg, num_threads);
+    }
+    char * lo_str = format_key(lo);
+    char * hi_str = format_key(hi);
+    scan_result result = parallel_scan(lo_str, hi_str, fn, arg, num_threads);
+    free(lo_str);
+    free(hi_str);
+    return result;
+}
+
+BPlusTree::reverse_iterator BPlusTree::RBegin()
+{
+    node * c = root_node;
+    if (c == NULL)
+        return REnd();
+    while (!c->is_leaf)
+        c = (node *)c->pointers[c->num_keys];
+    return reverse_iterator(c, c->num_keys - 1, key_size);
+}
+
+BPlusTree::reverse_iterator BPlusTree::REnd()
+{
+    return reverse_iterator(NULL, 0, key_size);
+}
+
+BPlusTree::reverse_range BPlusTree::RangeDescending( char * hi, char * lo, int limit/* = 0*/ )
+{
+    int64_t hi_num, lo_num;
+    return make_reverse_range(make_key(hi, &hi_num), make_key(lo, &lo_num), limit);
+}
+
+BPlusTree::reverse_range BPlusTree::RangeDescending( int hi, int lo, int limit/* = 0*/ )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t hi_num = hi, lo_num = lo;
+        return make_reverse_range((char *)&hi_num, (char *)&lo_num, limit);
+    }
+    char * hi_str = format_key(hi);
+    char * lo_str = format_key(lo);
+    reverse_range r = make_reverse_range(hi_str, lo_str, limit);
+    free(hi_str);
+    free(lo_str);
+    return r;
+}
+
+/* Converts an integer key to its string
+ * form in string key mode, by bpt_key_format.
+ * The caller frees the returned string.
+ */
+char * BPlusTree::format_key( int key )
+{
+    return bpt_key_format(key, key_length);
+}
+
+/* Returns a key given as a string in the
+ * form used inside the tree, by bpt_key_make.
+ */
+char * BPlusTree::make_key( char * key, int64_t * num )
+{
+    return bpt_key_make(key, num, key_type);
+}
+
+/* Returns the key slot at index in a node.
+ */
+char * BPlusTree::key_at( node * n, int index )
+{
+    return n->keys + index * key_size;
+}
+
+/* Compares two keys, by bpt_key_compare.
+ */
+int BPlusTree::compare_keys( const char * a, const char * b )
+{
+    return bpt_key_compare(a, b, key_type, key_length);
+}
+
+/* Stores a key into a key slot, by bpt_key_store.
+ */
+void BPlusTree::store_key( char * dest, const char * src )
+{
+    bpt_key_store(dest, src, key_type, key_length);
+}
+
+/* Stores the separator of two neighboring
+ * leaves into a key slot, by bpt_key_separator.
+ */
+void BPlusTree::store_separator( char * dest, const char * left, const char * right )
+{
+    bpt_key_separator(dest, left, right, key_type, key_length);
+}
+
+/* Binary search within a node.  Returns the
+ * index of the first key not less than key,
+ * which is num_keys if all keys are less.
+ * Used for the leaf probe and to find the
+ * insertion point in a leaf.
+ * Integer keys are searched down to a window of
+ * BPTREE_SIMD_SEARCH_WINDOW keys which is then
+ * counted by the SIMD kernel; for integers the
+ * keys less than key are the keys less than or
+ * equal to key - 1.
+ */
+int BPlusTree::lower_bound( node * n, const char * key )
+{
+    int low = 0, high = n->num_keys, mid;
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        const int64_t * keys = (const int64_t *)n->keys;
+        int64_t k = *(const int64_t *)key;
+        if (k == INT64_MIN)
+            return 0;
+        while (high - low > BPTREE_SIMD_SEARCH_WINDOW) {
+            mid = (low + high) / 2;
+            if (keys[mid] < k)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low + count_keys_le(keys + low, high - low, k - 1);
+    }
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (compare_keys(key_at(n, mid), key) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Binary search within a node.  Returns the
+ * index of the first key greater than key,
+ * which is the index of the pointer to follow
+ * in an internal node.
+ */
+int BPlusTree::upper_bound( node * n, const char * key )
+{
+    int low = 0, high = n->num_keys, mid;
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        const int64_t * keys = (const int64_t *)n->keys;
+        int64_t k = *(const int64_t *)key;
+        while (high - low > BPTREE_SIMD_SEARCH_WINDOW) {
+            mid = (low + high) / 2;
+            if (keys[mid] <= k)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low + count_keys_le(keys + low, high - low, k);
+    }
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (compare_keys(key_at(n, mid), key) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Returns an iterator to the first key not
+ * less than key.  The leaf find_leaf reaches
+ * holds it, unless all keys of the leaf are
+ * less, and then it is the first key of the
+ * next leaf.
+ */
+BPlusTree::iterator BPlusTree::lower_bound_iterator( char * key )
+{
+    node * leaf = find_leaf(root_node, key, false);
+    if (leaf == NULL)
+        return End();
+    return iterator(leaf, lower_bound(leaf, key), order, key_size);
+}
+
+/* Returns an iterator to the first key
+ * greater than key.
+ */
+BPlusTree::iterator BPlusTree::upper_bound_iterator( char * key )
+{
+    node * leaf = find_leaf(root_node, key, false);
+    if (leaf == NULL)
+        return End();
+    return iterator(leaf, upper_bound(leaf, key), order, key_size);
+}
+
+/* Returns the range of keys from lo to hi,
+ * inclusive, empty if lo is greater than hi.
+ */
+BPlusTree::range BPlusTree::make_range( char * lo, char * hi )
+{
+    if (compare_keys(lo, hi) > 0)
+        return range(End(), End());
+    return range(lower_bound_iterator(lo), upper_bound_iterator(hi));
+}
+
+/* Returns a reverse iterator to the last key
+ * not greater than key.  The leaf find_leaf
+ * reaches holds it, unless all keys of the
+ * leaf are greater, and then it is the last
+ * key of the previous leaf.
+ */
+BPlusTree::reverse_iterator BPlusTree::last_at_most( char * key )
+{
+    node * leaf = find_leaf(root_node, key, false);
+    if (leaf == NULL)
+        return REnd();
+    return reverse_iterator(leaf, upper_bound(leaf, key) - 1, key_size);
+}
+
+/* Returns a reverse iterator to the last key
+ * less than key.
+ */
+BPlusTree::reverse_iterator BPlusTree::last_less_than( char * key )
+{
+    node * leaf = find_leaf(root_node, key, false);
+    if (leaf == NULL)
+        return REnd();
+    return reverse_iterator(leaf, lower_bound(leaf, key) - 1, key_size);
+}
+
+/* Returns the range of keys from hi down to lo,
+ * inclusive, empty if lo is greater than hi.
+ * With a limit the range ends after at most
+ * limit keys, found by stepping from hi, so
+ * it costs one descent plus the keys returned.
+ */
+BPlusTree::reverse_range BPlusTree::make_reverse_range( char * hi, char * lo, int limit )
+{
+    reverse_iterator first, last, it;
+    int count;
+
+    if (compare_keys(lo, hi) > 0)
+        return reverse_range(REnd(), REnd());
+    first = last_at_most(hi);
+    last = last_less_than(lo);
+    if (limit <= 0)
+        return reverse_range(first, last);
+    for (it = first, count = 0; it != last && count < limit; ++it, count++)
+        ;
+    return reverse_range(first, it);
+}
+
+/* Prints a key.
+ */
+void BPlusTree::print_key( const char * key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER)
+        printf("%lld", (long long)*(const int64_t *)key);
+    else
+        printf("%.*s", key_length - 1, key);
+}
+
 /* Master insertion function.
  * Inserts a key and an associated value into
  * the B+ tree, causing the tree to be adjusted
@@ -168,40 +719,45 @@ node * BPlusTree::Insert( node * root, char * key, int value )
 {
     record * pointer;
     node * leaf;
-
-    /* The current implementation ignores
-     * duplicates.
-     */
-    if (Find(root, key, false) != NULL)
-        return root;
-
-    /* Create a new record for the
-     * value.
-     */
-    pointer = make_record(value);
-
+    int insertion_point;
 
     /* Case: the tree does not exist yet.
      * Start a new tree.
      */
     if (root == NULL) 
-        return start_new_tree(key, pointer);
+        return start_new_tree(key, make_record(value));
 
     /* Case: the tree already exists.
      * (Rest of function body.)
+     * The leaf is found once, and the position
+     * of the key in it serves both to reject
+     * duplicates and as the insertion point.
      */
     leaf = find_leaf(root, key, false);
+    insertion_point = lower_bound(leaf, key);
+
+    /* The current implementation ignores
+     * duplicates.
+     */
+    if (insertion_point < leaf->num_keys
+            && compare_keys(key_at(leaf, insertion_point), key) == 0)
+        return root;
+
+    /* Create a new record for the
+     * value.
+     */
+    pointer = make_record(value);
 
     /* Case: leaf has room for key and pointer.
      */
     if (leaf->num_keys < order - 1) {
-        leaf = insert_into_leaf(leaf, key, pointer);
+        leaf = insert_into_leaf(leaf, insertion_point, key, pointer);
         return root;
     }
 
     /* Case:  leaf must be split.
      */
-    return insert_into_leaf_after_splitting(root, leaf, key, pointer);
+    return insert_into_leaf_after_splitting(root, leaf, insertion_point, key, pointer);
 }
 
 /* Master deletion function.
@@ -210,12 +766,16 @@ node * BPlusTree::Delete(node * root, char * key)
 {
     node * key_leaf;
     record * key_record;
+    int i;
 
-    key_record = Find(root, key, false);
     key_leaf = find_leaf(root, key, false);
-    if (key_record != NULL && key_leaf != NULL) {
-        root = delete_entry(root, key_leaf, key, key_record);
-        free(key_record);
+    if (key_leaf == NULL)
+        return root;
+    i = lower_bound(key_leaf, key);
+    if (i < key_leaf->num_keys && compare_keys(key_at(key_leaf, i), key) == 0) {
+        key_record = (record *)key_leaf->pointers[i];
+        root = delete_entry(root, key_leaf, i, NULL);
+        free_record(key_record);
     }
     return root;
 }
@@ -228,9 +788,8 @@ record * BPlusTree::Find( node * root, char * key, bool verbose )
     int i = 0;
     node * c = find_leaf( root, key, verbose );
     if (c == NULL) return NULL;
-    for (i = 0; i < c->num_keys; i++)
-        if (strcmp(c->keys[i], key) == 0) break;
-    if (i == c->num_keys) 
+    i = lower_bound(c, key);
+    if (i == c->num_keys || compare_keys(key_at(c, i), key) != 0)
         return NULL;
     else
         return (record *)c->pointers[i];
@@ -239,32 +798,25 @@ record * BPlusTree::Find( node * root, char * key, bool verbose )
 /* Helper function for printing the
  * tree out.  See print_tree.
  */
-void BPlusTree::enqueue( node * new_node )
+void BPlusTree::enqueue( node_queue * queue, node * new_node )
 {
-    node * c;
-    if (queue == NULL) {
-        queue = new_node;
-        queue->next = NULL;
-    }
-    else {
-        c = queue;
-        while(c->next != NULL) {
-            c = c->next;
+    if (queue->tail == queue->capacity) {
+        queue->capacity = queue->capacity == 0 ? 64 : queue->capacity * 2;
+        queue->items = (node **)realloc(queue->items, queue->capacity * sizeof(node *));
+        if (queue->items == NULL) {
+            perror("Print queue.");
+            exit(EXIT_FAILURE);
         }
-        c->next = new_node;
-        new_node->next = NULL;
     }
+    queue->items[queue->tail++] = new_node;
 }
 
 /* Helper function for printing the
  * tree out.  See print_tree.
  */
-node * BPlusTree::dequeue( void )
+node * BPlusTree::dequeue( node_queue * queue )
 {
-    node * n = queue;
-    queue = queue->next;
-    n->next = NULL;
-    return n;
+    return queue->items[queue->head++];
 }
 
 /* Utility function to give the height
@@ -314,7 +866,8 @@ void BPlusTree::print_leaves( node * root )
         for (i = 0; i < c->num_keys; i++) {
             if (verbose_output)
                 printf("%lx ", (unsigned long)c->pointers[i]);
-            printf("%s ", c->keys[i]);
+            print_key(key_at(c, i));
+            printf(" ");
         }
         if (verbose_output)
             printf("%lx ", (unsigned long)c->pointers[order - 1]);
@@ -343,15 +896,15 @@ void BPlusTree::print_tree( node * root )
     int i = 0;
     int rank = 0;
     int new_rank = 0;
+    node_queue queue = { NULL, 0, 0, 0 };
 
     if (root == NULL) {
         printf("Empty tree.\n");
         return;
     }
-    queue = NULL;
-    enqueue(root);
-    while( queue != NULL ) {
-        n = dequeue();
+    enqueue(&queue, root);
+    while( queue.head != queue.tail ) {
+        n = dequeue(&queue);
         if (n->parent != NULL && n == n->parent->pointers[0]) {
             new_rank = path_to_root( root, n );
             if (new_rank != rank) {
@@ -364,11 +917,12 @@ void BPlusTree::print_tree( node * root )
         for (i = 0; i < n->num_keys; i++) {
             if (verbose_output)
                 printf("%lx ", (unsigned long)n->pointers[i]);
-            printf("%s ", n->keys[i]);
+            print_key(key_at(n, i));
+            printf(" ");
         }
         if (!n->is_leaf)
             for (i = 0; i <= n->num_keys; i++)
-                enqueue((node *)(n->pointers[i]));
+                enqueue(&queue, (node *)(n->pointers[i]));
         if (verbose_output) {
             if (n->is_leaf) 
                 printf("%lx ", (unsigned long)n->pointers[order - 1]);
@@ -378,58 +932,786 @@ void BPlusTree::print_tree( node * root )
         printf("| ");
     }
     printf("\n");
+    free(queue.items);
+}
+
+/* Finds the record under a given key and prints an
+ * appropriate message to stdout.
+ */
+void BPlusTree::find_and_print( node * root, char * key, bool verbose )
+{
+    record * r = Find(root, key, verbose);
+    if (r == NULL) {
+        printf("Record not found under key ");
+        print_key(key);
+        printf(".\n");
+    }
+    else {
+        printf("Record at %lx -- key ", (unsigned long)r);
+        print_key(key);
+        printf(", value %d.\n", r->value);
+    }
+}
+
+/* Traces the path from the root to a leaf, searching
+ * by key.  Displays information about the path
+ * if the verbose flag is set.
+ * Returns the leaf containing the given key.
+ */
+node * BPlusTree::find_leaf( node * root, char * key, bool verbose )
+{
+    int i = 0;
+    node * c = root;
+    if (c == NULL) {
+        if (verbose) 
+            printf("Empty tree.\n");
+        return c;
+    }
+    while (!c->is_leaf) {
+        if (verbose) {
+            printf("[");
+            for (i = 0; i < c->num_keys - 1; i++) {
+                print_key(key_at(c, i));
+                printf(" ");
+            }
+            print_key(key_at(c, i));
+            printf("] ");
+        }
+        i = upper_bound(c, key);
+        if (verbose)
+            printf("%d ->\n", i);
+        c = (node *)c->pointers[i];
+    }
+    if (verbose) {
+        printf("Leaf [");
+        for (i = 0; i < c->num_keys - 1; i++) {
+            print_key(key_at(c, i));
+            printf(" ");
+        }
+        print_key(key_at(c, i));
+        printf("] ->\n");
+    }
+    return c;
+}
+
+/* Runs an insert, through the latched path in
+ * thread-safe mode, the optimistic one in
+ * optimistic mode, or by copying the path in
+ * copy-on-write mode.
+ */
+node * BPlusTree::insert_key( char * key, int value )
+{
+    node * n;
+    int slot;
+
+    if (concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE)
+        return insert_cow(key, value);
+    if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC) {
+        slot = bpt_epoch_enter(&epochs);
+        n = insert_optimistic(key, value);
+        bpt_epoch_exit(&epochs, slot);
+        return n;
+    }
+    if (concurrency == BPTREE_CONCURRENCY_LATCH)
+        return insert_latched(key, value);
+    root_node = Insert(root_node, key, value);
+    return root_node;
+}
+
+/* Runs a delete as insert_key runs an insert.
+ */
+node * BPlusTree::delete_key( char * key )
+{
+    node * n;
+    int slot;
+
+    if (concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE)
+        return delete_cow(key);
+    if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC) {
+        slot = bpt_epoch_enter(&epochs);
+        n = delete_optimistic(key);
+        bpt_epoch_exit(&epochs, slot);
+        return n;
+    }
+    if (concurrency == BPTREE_CONCURRENCY_LATCH)
+        return delete_latched(key);
+    root_node = Delete(root_node, key);
+    return root_node;
+}
+
+/* Finds the record under a key, with shared
+ * latches in thread-safe mode, validated
+ * versions in optimistic mode, or in the root
+ * published last in copy-on-write mode.  The
+ * verbose search is not latched.
+ */
+record * BPlusTree::find_key( char * key, bool verbose )
+{
+    node * leaf;
+    record * r = NULL;
+    int i, slot;
+
+    if (concurrency == BPTREE_CONCURRENCY_NONE || verbose)
+        return Find(root_node, key, verbose);
+    if (concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE) {
+        slot = bpt_epoch_enter(&epochs);
+        r = Find(published_root(), key, false);
+        bpt_epoch_exit(&epochs, slot);
+        return r;
+    }
+    if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC) {
+        slot = bpt_epoch_enter(&epochs);
+        r = find_optimistic(key);
+        bpt_epoch_exit(&epochs, slot);
+        return r;
+    }
+    leaf = find_leaf_latched(key);
+    if (leaf == NULL)
+        return NULL;
+    i = lower_bound(leaf, key);
+    if (i < leaf->num_keys && compare_keys(key_at(leaf, i), key) == 0)
+        r = (record *)leaf->pointers[i];
+    bpt_latch_read_unlock(&leaf->latch);
+    return r;
+}
+
+/* Copies out the value under a key, while the
+ * leaf is latched in thread-safe mode.  In
+ * optimistic mode the record is only read once
+ * the leaf is validated, and is not freed before
+ * the thread leaves the tree, so the copy is of
+ * a record that was in the tree.
+ */
+bool BPlusTree::find_value( char * key, int * value )
+{
+    node * leaf;
+    record * r;
+    bool found = false;
+    int i, slot;
+
+    if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC || concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE) {
+        slot = bpt_epoch_enter(&epochs);
+        r = concurrency == BPTREE_CONCURRENCY_OPTIMISTIC ? find_optimistic(key) : Find(published_root(), key, false);
+        if (r != NULL)
+            *value = r->value;
+        bpt_epoch_exit(&epochs, slot);
+        return r != NULL;
+    }
+    if (concurrency == BPTREE_CONCURRENCY_NONE) {
+        r = Find(root_node, key, false);
+        if (r != NULL)
+            *value = r->value;
+        return r != NULL;
+    }
+    leaf = find_leaf_latched(key);
+    if (leaf == NULL)
+        return false;
+    i = lower_bound(leaf, key);
+    if (i < leaf->num_keys && compare_keys(key_at(leaf, i), key) == 0) {
+        *value = ((record *)leaf->pointers[i])->value;
+        found = true;
+    }
+    bpt_latch_read_unlock(&leaf->latch);
+    return found;
+}
+
+/* Descends to the leaf for a key in thread-safe
+ * mode, coupling shared latches: the latch of a
+ * child is taken before the latch of its parent
+ * is released, starting from the root latch.
+ * Returns the leaf still latched, or NULL if
+ * the tree is empty.
+ */
+node * BPlusTree::find_leaf_latched( char * key )
+{
+    node * c, * child;
+
+    bpt_latch_read_lock(&root_latch);
+    c = root_node;
+    if (c == NULL) {
+        bpt_latch_read_unlock(&root_latch);
+        return NULL;
+    }
+    bpt_latch_read_lock(&c->latch);
+    bpt_latch_read_unlock(&root_latch);
+    while (!c->is_leaf) {
+        child = (node *)c->pointers[upper_bound(c, key)];
+        bpt_latch_read_lock(&child->latch);
+        bpt_latch_read_unlock(&c->latch);
+        c = child;
+    }
+    return c;
+}
+
+/* A node is safe for an insert if it takes one
+ * more key without splitting, so the insert
+ * does not reach its ancestors.
+ */
+bool BPlusTree::insert_safe( node * n )
+{
+    return n->num_keys < order - 1;
+}
+
+/* A node is safe for a delete if it loses one
+ * key without falling below the minimum, or in
+ * the root without becoming empty, so the delete
+ * does not reach its ancestors.
+ */
+bool BPlusTree::delete_safe( node * n, node * root )
+{
+    if (n == root)
+        return n->num_keys > 1;
+    return n->num_keys > (n->is_leaf ? cut(order - 1) : cut(order) - 1);
+}
+
+/* Latches a node exclusive for a writer and
+ * adds it to the latches the writer holds.
+ */
+void BPlusTree::latch_node( latch_path * path, node * n )
+{
+    bpt_latch_write_lock(&n->latch);
+    path->latched[path->num_latched++] = n;
+}
+
+/* Releases the latches a writer holds above
+ * the last node it latched, once that node
+ * is known to be safe.
+ */
+void BPlusTree::release_ancestors( latch_path * path )
+{
+    int i;
+
+    if (path->root_latched) {
+        bpt_latch_write_unlock(&root_latch);
+        path->root_latched = false;
+    }
+    for (i = 0; i < path->num_latched - 1; i++)
+        bpt_latch_write_unlock(&path->latched[i]->latch);
+    path->latched[0] = path->latched[path->num_latched - 1];
+    path->num_latched = 1;
+}
+
+/* Releases all latches a writer holds, then
+ * frees the nodes it removed from the tree,
+ * marked obsolete first for optimistic readers.
+ */
+void BPlusTree::release_path( latch_path * path )
+{
+    int i;
+
+    for (i = 0; i < path->num_freed; i++)
+        bpt_latch_set_obsolete(&path->freed[i]->latch);
+    if (path->root_latched) {
+        bpt_latch_write_unlock(&root_latch);
+        path->root_latched = false;
+    }
+    for (i = 0; i < path->num_latched; i++)
+        bpt_latch_write_unlock(&path->latched[i]->latch);
+    path->num_latched = 0;
+    for (i = 0; i < path->num_freed; i++) {
+        if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC || concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE)
+            retire(path->freed[i], true);
+        else
+            free_node(path->freed[i]);
+    }
+    path->num_freed = 0;
+}
+
+/* Inserts in thread-safe mode.  The writer takes
+ * the root latch and descends latching each node
+ * exclusive, and releases all latches above a
+ * node that can not split, so only the nodes a
+ * split can reach stay latched while the insert
+ * runs.  root_node is only changed while the
+ * root latch is held.
+ */
+node * BPlusTree::insert_latched( char * key, int value )
+{
+    latch_path path;
+    node * root, * n, * c;
+    record * pointer;
+    int i;
+
+    path.num_latched = 0;
+    path.num_freed = 0;
+    bpt_latch_write_lock(&root_latch);
+    path.root_latched = true;
+
+    root = root_node;
+    if (root == NULL) {
+        root = root_node = start_new_tree(key, make_record(value));
+        release_path(&path);
+        return root;
+    }
+
+    latch_node(&path, root);
+    if (insert_safe(root))
+        release_ancestors(&path);
+    n = root;
+    while (!n->is_leaf) {
+        c = (node *)n->pointers[upper_bound(n, key)];
+        latch_node(&path, c);
+        if (insert_safe(c))
+            release_ancestors(&path);
+        n = c;
+    }
+
+    i = lower_bound(n, key);
+    if (i == n->num_keys || compare_keys(key_at(n, i), key) != 0) {
+        pointer = make_record(value);
+        if (n->num_keys < order - 1)
+            insert_into_leaf(n, i, key, pointer);
+        else {
+            root = insert_into_leaf_after_splitting(root, n, i, key, pointer);
+            if (path.root_latched)
+                root_node = root;
+        }
+    }
+    release_path(&path);
+    return root;
+}
+
+/* Deletes in thread-safe mode, latching as
+ * insert_latched does but keeping the latches
+ * above a node that can underflow.  The
+ * neighbors that coalescing or redistribution
+ * touches are latched by delete_entry.
+ */
+node * BPlusTree::delete_latched( char * key )
+{
+    latch_path path;
+    node * root, * n, * c;
+    record * key_record = NULL;
+    int i;
+
+    path.num_latched = 0;
+    path.num_freed = 0;
+    bpt_latch_write_lock(&root_latch);
+    path.root_latched = true;
+
+    root = root_node;
+    if (root == NULL) {
+        release_path(&path);
+        return NULL;
+    }
+
+    latch_node(&path, root);
+    if (delete_safe(root, root))
+        release_ancestors(&path);
+    n = root;
+    while (!n->is_leaf) {
+        c = (node *)n->pointers[upper_bound(n, key)];
+        latch_node(&path, c);
+        if (delete_safe(c, root))
+            release_ancestors(&path);
+        n = c;
+    }
+
+    i = lower_bound(n, key);
+    if (i < n->num_keys && compare_keys(key_at(n, i), key) == 0) {
+        key_record = (record *)n->pointers[i];
+        root = delete_entry(root, n, i, &path);
+        if (path.root_latched)
+            root_node = root;
+    }
+    release_path(&path);
+    if (key_record != NULL) {
+        if (concurrency == BPTREE_CONCURRENCY_OPTIMISTIC)
+            retire(key_record, false);
+        else
+            free_record(key_record);
+    }
+    return root;
+}
+
+/* Descends to the leaf for a key in optimistic
+ * mode without writing anything shared.  The
+ * version of each node is noted before it is
+ * read, and the parent is validated after the
+ * child pointer is read from it and again after
+ * the version of the child is noted, so the
+ * child was the right one.  A node removed from
+ * the tree is obsolete and not freed while it
+ * can be reached.  Restarts from the root on any
+ * conflict.  Returns the leaf and its version,
+ * which the caller validates after reading the
+ * leaf, or NULL if the tree is empty.
+ */
+node * BPlusTree::find_leaf_optimistic( char * key, uint64_t * version )
+{
+    node * n, * c;
+    uint64_t root_version, v, child_version;
+
+restart:
+    if (!bpt_latch_read_version(&root_latch, &root_version))
+        goto restart;
+    n = root_node;
+    if (n == NULL) {
+        if (!bpt_latch_validate(&root_latch, root_version))
+            goto restart;
+        return NULL;
+    }
+    if (!bpt_latch_read_version(&n->latch, &v)
+            || !bpt_latch_validate(&root_latch, root_version))
+        goto restart;
+    while (!n->is_leaf) {
+        c = (node *)n->pointers[upper_bound(n, key)];
+        if (!bpt_latch_validate(&n->latch, v))
+            goto restart;
+        if (!bpt_latch_read_version(&c->latch, &child_version)
+                || !bpt_latch_validate(&n->latch, v))
+            goto restart;
+        n = c;
+        v = child_version;
+    }
+    *version = v;
+    return n;
+}
+
+/* Finds the record under a key in optimistic
+ * mode, once the leaf it was read from is
+ * validated.  Called inside an epoch.
+ */
+record * BPlusTree::find_optimistic( char * key )
+{
+    node * leaf;
+    record * r;
+    uint64_t version;
+    int i;
+
+    do {
+        leaf = find_leaf_optimistic(key, &version);
+        if (leaf == NULL)
+            return NULL;
+        i = lower_bound(leaf, key);
+        r = i < leaf->num_keys && compare_keys(key_at(leaf, i), key) == 0
+            ? (record *)leaf->pointers[i] : NULL;
+    } while (!bpt_latch_validate(&leaf->latch, version));
+    return r;
+}
+
+/* Inserts in optimistic mode.  The leaf is found
+ * without latches and then latched only if it is
+ * still at the version seen, which also means it
+ * is still the leaf for the key.  An insert that
+ * would split the leaf goes the latched path.
+ */
+node * BPlusTree::insert_optimistic( char * key, int value )
+{
+    node * leaf;
+    uint64_t version;
+    int i;
+
+    for (;;) {
+        leaf = find_leaf_optimistic(key, &version);
+        if (leaf == NULL || leaf->num_keys >= order - 1)
+            return insert_latched(key, value);
+        if (!bpt_latch_upgrade(&leaf->latch, version))
+            continue;
+        i = lower_bound(leaf, key);
+        if (i == leaf->num_keys || compare_keys(key_at(leaf, i), key) != 0)
+            insert_into_leaf(leaf, i, key, make_record(value));
+        bpt_latch_write_unlock(&leaf->latch);
+        return leaf;
+    }
+}
+
+/* Deletes in optimistic mode, latching only the
+ * leaf unless it would underflow, and then going
+ * the latched path.  The removed record is kept
+ * until no reader can reach it.
+ */
+node * BPlusTree::delete_optimistic( char * key )
+{
+    node * leaf;
+    record * key_record = NULL;
+    uint64_t version;
+    int i;
+
+    for (;;) {
+        leaf = find_leaf_optimistic(key, &version);
+        if (leaf == NULL)
+            return NULL;
+        if (leaf->num_keys <= cut(order - 1))
+            return delete_latched(key);
+        if (!bpt_latch_upgrade(&leaf->latch, version))
+            continue;
+        i = lower_bound(leaf, key);
+        if (i < leaf->num_keys && compare_keys(key_at(leaf, i), key) == 0) {
+            key_record = (record *)leaf->pointers[i];
+            remove_entry_from_node(leaf, i);
+        }
+        bpt_latch_write_unlock(&leaf->latch);
+        if (key_record != NULL)
+            retire(key_record, false);
+        return leaf;
+    }
+}
+
+/* Copies a node for a writer in copy-on-write
+ * mode and puts the copy in place of the node
+ * at index in its parent, already a copy, as
+ * the parent of its children, and in a leaf in
+ * the links of its neighbors.  The links and
+ * parent pointers belong to the newest version,
+ * which readers of a version do not follow, so
+ * they are changed in place.  The node is
+ * retired once the new root is published.
+ */
+node * BPlusTree::copy_node( node * n, node * parent, int index, latch_path * path )
+{
+    node * copy = make_node();
+    int i;
+
+    memcpy(copy->keys, n->keys, n->num_keys * key_size);
+    memcpy(copy->pointers, n->pointers, order * sizeof(void *));
+    copy->is_leaf = n->is_leaf;
+    copy->num_keys = n->num_keys;
+    copy->parent = parent;
+    copy->prev = n->prev;
+    if (parent != NULL)
+        parent->pointers[index] = copy;
+    if (copy->is_leaf) {
+        if (copy->prev != NULL)
+            copy->prev->pointers[order - 1] = copy;
+        if (copy->pointers[order - 1] != NULL)
+            ((node *)copy->pointers[order - 1])->prev = copy;
+    }
+    else {
+        for (i = 0; i <= copy->num_keys; i++)
+            ((node *)copy->pointers[i])->parent = copy;
+    }
+    retire_node(n, path);
+    return copy;
+}
+
+/* Copies the path from the root to the leaf for
+ * a key, setting root to the copy of the root.
+ * Returns the copy of the leaf.
+ */
+node * BPlusTree::copy_path( node ** root, char * key, latch_path * path )
+{
+    node * n;
+    int i;
+
+    n = *root = copy_node(*root, NULL, 0, path);
+    while (!n->is_leaf) {
+        i = upper_bound(n, key);
+        n = copy_node((node *)n->pointers[i], n, i, path);
+    }
+    return n;
+}
+
+/* Reads the root published last.
+ */
+node * BPlusTree::published_root( void )
+{
+    return (node *)bpt_epoch_load_pointer((void * volatile *)&root_node);
+}
+
+/* Inserts in copy-on-write mode.  Writers take
+ * the root latch, one at a time.  The leaf is
+ * found first, and if the key is new the path
+ * to it is copied and the insert, splits and
+ * all, is made on the copies, out of the reach
+ * of readers.  Publishing the new root makes the
+ * whole insert visible at once.
+ */
+node * BPlusTree::insert_cow( char * key, int value )
+{
+    latch_path path;
+    node * root, * leaf;
+    int i;
+
+    path.num_latched = 0;
+    path.num_freed = 0;
+    bpt_latch_write_lock(&root_latch);
+    path.root_latched = true;
+
+    root = root_node;
+    if (root == NULL) {
+        root = start_new_tree(key, make_record(value));
+        bpt_epoch_store_pointer((void * volatile *)&root_node, root);
+        release_path(&path);
+        return root;
+    }
+    leaf = find_leaf(root, key, false);
+    i = lower_bound(leaf, key);
+    if (i < leaf->num_keys && compare_keys(key_at(leaf, i), key) == 0) {
+        release_path(&path);
+        return root;
+    }
+
+    leaf = copy_path(&root, key, &path);
+    if (leaf->num_keys < order - 1)
+        insert_into_leaf(leaf, i, key, make_record(value));
+    else
+        root = insert_into_leaf_after_splitting(root, leaf, i, key, make_record(value));
+    bpt_epoch_store_pointer((void * volatile *)&root_node, root);
+    release_path(&path);
+    return root;
 }
 
-/* Finds the record under a given key and prints an
- * appropriate message to stdout.
+/* Deletes in copy-on-write mode, as insert_cow
+ * inserts.  delete_entry copies the neighbor a
+ * coalescing or redistribution changes.  The
+ * record is retired with the nodes.
  */
-void BPlusTree::find_and_print( node * root, char * key, bool verbose )
+node * BPlusTree::delete_cow( char * key )
 {
-    record * r = Find(root, key, verbose);
-    if (r == NULL)
-        printf("Record not found under key %s.\n", key);
-    else 
-        printf("Record at %lx -- key %s, value %d.\n",
-                (unsigned long)r, key, r->value);
+    latch_path path;
+    node * root, * leaf;
+    record * key_record;
+    int i;
+
+    path.num_latched = 0;
+    path.num_freed = 0;
+    bpt_latch_write_lock(&root_latch);
+    path.root_latched = true;
+
+    root = root_node;
+    leaf = find_leaf(root, key, false);
+    if (leaf == NULL) {
+        release_path(&path);
+        return NULL;
+    }
+    i = lower_bound(leaf, key);
+    if (i == leaf->num_keys || compare_keys(key_at(leaf, i), key) != 0) {
+        release_path(&path);
+        return root;
+    }
+
+    key_record = (record *)leaf->pointers[i];
+    leaf = copy_path(&root, key, &path);
+    root = delete_entry(root, leaf, i, &path);
+    bpt_epoch_store_pointer((void * volatile *)&root_node, root);
+    release_path(&path);
+    retire(key_record, false);
+    return root;
 }
 
-/* Traces the path from the root to a leaf, searching
- * by key.  Displays information about the path
- * if the verbose flag is set.
- * Returns the leaf containing the given key.
+/* Scans a version from the first key not less
+ * than lo until a key greater than hi.  The path
+ * to the leaf is kept on a stack, and the next
+ * leaf is reached by going up to the first
+ * ancestor with a child to the right and down
+ * its leftmost path.
  */
-node * BPlusTree::find_leaf( node * root, char * key, bool verbose )
+scan_result BPlusTree::snapshot_scan( node * root, char * lo, char * hi, scan_callback fn, void * arg )
 {
-    int i = 0;
-    node * c = root;
-    if (c == NULL) {
-        if (verbose) 
-            printf("Empty tree.\n");
-        return c;
+    node * stack[BPTREE_MAX_HEIGHT];
+    int indices[BPTREE_MAX_HEIGHT];
+    scan_result result;
+    node * n;
+    record * r;
+    int depth = 0, i;
+
+    result.count = 0;
+    result.sum = 0;
+    result.min = 0;
+    result.max = 0;
+    if (root == NULL || compare_keys(lo, hi) > 0)
+        return result;
+    for (n = root; !n->is_leaf; depth++) {
+        stack[depth] = n;
+        indices[depth] = upper_bound(n, lo);
+        n = (node *)n->pointers[indices[depth]];
     }
-    while (!c->is_leaf) {
-        if (verbose) {
-            printf("[");
-            for (i = 0; i < c->num_keys - 1; i++)
-                printf("%s ", c->keys[i]);
-            printf("%s] ", c->keys[i]);
+    i = lower_bound(n, lo);
+    for (;;) {
+        for (; i < n->num_keys; i++) {
+            if (compare_keys(key_at(n, i), hi) > 0)
+                return result;
+            r = (record *)n->pointers[i];
+            if (result.count == 0 || r->value < result.min)
+                result.min = r->value;
+            if (result.count == 0 || r->value > result.max)
+                result.max = r->value;
+            result.count++;
+            result.sum += r->value;
+            if (fn != NULL)
+                fn(key_at(n, i), r, arg);
+        }
+        while (depth > 0 && indices[depth - 1] == stack[depth - 1]->num_keys)
+            depth--;
+        if (depth == 0)
+            return result;
+        n = (node *)stack[depth - 1]->pointers[++indices[depth - 1]];
+        for (; !n->is_leaf; depth++) {
+            stack[depth] = n;
+            indices[depth] = 0;
+            n = (node *)n->pointers[0];
         }
         i = 0;
-        while (i < c->num_keys) {
-            if (strcmp(key, c->keys[i]) >= 0) i++;
-            else break;
+    }
+}
+
+/* Retires a node or record removed in optimistic
+ * mode, in the epoch current after its removal,
+ * and reclaims the list once it grew long enough.
+ */
+void BPlusTree::retire( void * p, bool is_node )
+{
+    uint64_t epoch;
+
+    epoch = bpt_epoch_current(&epochs);
+    bpt_latch_write_lock(&retired_latch);
+    if (num_retired == retired_capacity) {
+        retired_capacity = retired_capacity == 0 ? 1024 : retired_capacity * 2;
+        retired = (retired_block *)realloc(retired, retired_capacity * sizeof(retired_block));
+        if (retired == NULL) {
+            perror("Retired blocks.");
+            exit(EXIT_FAILURE);
         }
-        if (verbose)
-            printf("%d ->\n", i);
-        c = (node *)c->pointers[i];
     }
-    if (verbose) {
-        printf("Leaf [");
-        for (i = 0; i < c->num_keys - 1; i++)
-            printf("%s ", c->keys[i]);
-        printf("%s] ->\n", c->keys[i]);
+    retired[num_retired].p = p;
+    retired[num_retired].is_node = is_node;
+    retired[num_retired].epoch = epoch;
+    num_retired++;
+    if (num_retired >= reclaim_at)
+        reclaim_retired();
+    bpt_latch_write_unlock(&retired_latch);
+}
+
+/* Advances the epoch and frees the retired blocks
+ * no thread in the tree can reach any more.  The
+ * list is reclaimed next when it doubled from what
+ * is left, so blocks a slow reader holds back are
+ * not scanned over and over.  Called with the list
+ * latched.
+ */
+void BPlusTree::reclaim_retired( void )
+{
+    uint64_t oldest;
+    size_t i, kept = 0;
+
+    oldest = bpt_epoch_advance(&epochs);
+    for (i = 0; i < num_retired; i++) {
+        if (retired[i].epoch >= oldest)
+            retired[kept++] = retired[i];
+        else if (retired[i].is_node)
+            free_node((node *)retired[i].p);
+        else
+            free_record((record *)retired[i].p);
     }
-    return c;
+    num_retired = kept;
+    reclaim_at = 2 * kept > BPTREE_RECLAIM_THRESHOLD ? 2 * kept : BPTREE_RECLAIM_THRESHOLD;
+}
+
+/* Frees all retired nodes and records, once no
+ * other thread uses the tree.
+ */
+void BPlusTree::free_retired( void )
+{
+    size_t i;
+
+    for (i = 0; i < num_retired; i++) {
+        if (retired[i].is_node)
+            free_node((node *)retired[i].p);
+        else
+            free_record((record *)retired[i].p);
+    }
+    num_retired = 0;
 }
 
 /* Finds the appropriate place to
@@ -448,7 +1730,11 @@ int BPlusTree::cut( int length )
  */
 record * BPlusTree::make_record(int value)
 {
-    record * new_record = (record *)malloc(sizeof(record));
+    record * new_record;
+    if (allocator != NULL)
+        new_record = (record *)allocator->Allocate(sizeof(record), sizeof(void *));
+    else
+        new_record = (record *)malloc(sizeof(record));
     if (new_record == NULL) {
         perror("Record creation.");
         exit(EXIT_FAILURE);
@@ -459,31 +1745,55 @@ record * BPlusTree::make_record(int value)
     return new_record;
 }
 
+/* Computes the layout of a node block of the given
+ * order: the node header, then the key slots, then
+ * the pointers.  Returns the block size rounded up
+ * to the cache line size, or to the page size for
+ * nodes of a page or more.
+ */
+int BPlusTree::node_layout( int nOrder, int * pointers_offset )
+{
+    int size, offset;
+
+    offset = sizeof(node) + (nOrder - 1) * key_size;
+    offset = (offset + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+    if (pointers_offset != NULL)
+        *pointers_offset = offset;
+    size = offset + nOrder * sizeof(void *);
+    if (size < BPTREE_PAGE_SIZE)
+        return (size + BPTREE_CACHE_LINE_SIZE - 1) / BPTREE_CACHE_LINE_SIZE * BPTREE_CACHE_LINE_SIZE;
+    return (size + BPTREE_PAGE_SIZE - 1) / BPTREE_PAGE_SIZE * BPTREE_PAGE_SIZE;
+}
+
 /* Creates a new general node, which can be adapted
  * to serve as either a leaf or an internal node.
+ * The header, keys and pointers of the node
+ * are one aligned block.
  */
 node * BPlusTree::make_node( void )
 {
     node * new_node;
-    new_node = (node *)malloc(sizeof(node));
+    if (allocator != NULL)
+        new_node = (node *)allocator->Allocate(node_size, node_alignment);
+    else {
+#ifdef BPTREE_OS_WINDOWS
+        new_node = (node *)_aligned_malloc(node_size, node_alignment);
+#else
+        if (posix_memalign((void **)&new_node, node_alignment, node_size) != 0)
+            new_node = NULL;
+#endif
+    }
     if (new_node == NULL) {
         perror("Node creation.");
         exit(EXIT_FAILURE);
     }
-    new_node->keys = (char **)malloc( (order - 1) * sizeof(char *) );
-    if (new_node->keys == NULL) {
-        perror("New node keys array.");
-        exit(EXIT_FAILURE);
-    }
-    new_node->pointers = (void **)malloc( order * sizeof(void *) );
-    if (new_node->pointers == NULL) {
-        perror("New node pointers array.");
-        exit(EXIT_FAILURE);
-    }
+    new_node->keys = (char *)new_node + sizeof(node);
+    new_node->pointers = (void **)((char *)new_node + pointers_offset);
     new_node->is_leaf = false;
     new_node->num_keys = 0;
     new_node->parent = NULL;
-    new_node->next = NULL;
+    new_node->prev = NULL;
+    bpt_latch_init(&new_node->latch);
     return new_node;
 }
 
@@ -497,6 +1807,44 @@ node * BPlusTree::make_leaf( void )
     return leaf;
 }
 
+/* Frees a node made by make_node.
+ */
+void BPlusTree::free_node( node * n )
+{
+    if (allocator != NULL) {
+        allocator->Free(n, node_size, node_alignment);
+        return;
+    }
+#ifdef BPTREE_OS_WINDOWS
+    _aligned_free(n);
+#else
+    free(n);
+#endif
+}
+
+/* Frees a node removed from the tree.  A writer in
+ * thread-safe mode may still hold its latch, so the
+ * node is kept on the path and freed after the
+ * latches are released.
+ */
+void BPlusTree::retire_node( node * n, latch_path * path )
+{
+    if (path != NULL)
+        path->freed[path->num_freed++] = n;
+    else
+        free_node(n);
+}
+
+/* Frees a record made by make_record.
+ */
+void BPlusTree::free_record( record * r )
+{
+    if (allocator != NULL)
+        allocator->Free(r, sizeof(record), sizeof(void *));
+    else
+        free(r);
+}
+
 /* Helper function used in insert_into_parent
  * to find the index of the parent's pointer to 
  * the node to the left of the key to be inserted.
@@ -511,24 +1859,18 @@ int BPlusTree::get_left_index(node * parent, node * left)
 }
 
 /* Inserts a new pointer to a record and its corresponding
- * key into a leaf.
+ * key into a leaf at the insertion point.
  * Returns the altered leaf.
  */
-node * BPlusTree::insert_into_leaf( node * leaf, char * key, record * pointer )
+node * BPlusTree::insert_into_leaf( node * leaf, int insertion_point, char * key, record * pointer )
 {
-    int i, insertion_point;
-
-    insertion_point = 0;
-    while (insertion_point < leaf->num_keys && strcmp(leaf->keys[insertion_point], key) < 0)
-        insertion_point++;
+    int i;
 
-    for (i = leaf->num_keys; i > insertion_point; i--) {
-        leaf->keys[i] = leaf->keys[i - 1];
+    memmove(key_at(leaf, insertion_point + 1), key_at(leaf, insertion_point),
+            (leaf->num_keys - insertion_point) * key_size);
+    for (i = leaf->num_keys; i > insertion_point; i--)
         leaf->pointers[i] = leaf->pointers[i - 1];
-    }
-    leaf->keys[insertion_point] = (char *)malloc(key_length);
-    memset(leaf->keys[insertion_point], 0, key_length);
-    strncpy(leaf->keys[insertion_point], key, key_length);
+    store_key(key_at(leaf, insertion_point), key);
     leaf->pointers[insertion_point] = pointer;
     leaf->num_keys++;
     return leaf;
@@ -539,16 +1881,16 @@ node * BPlusTree::insert_into_leaf( node * leaf, char * key, record * pointer )
  * the tree's order, causing the leaf to be split
  * in half.
  */
-node * BPlusTree::insert_into_leaf_after_splitting( node * root, node * leaf, char * key, record * pointer )
+node * BPlusTree::insert_into_leaf_after_splitting( node * root, node * leaf, int insertion_index, char * key, record * pointer )
 {
     node * new_leaf;
-    char ** temp_keys, * new_key;
+    char * temp_keys, * new_key;
     void ** temp_pointers;
-    int insertion_index, split, i, j;
+    int split, i, j;
 
     new_leaf = make_leaf();
 
-    temp_keys = (char **)malloc( order * sizeof(char *) );
+    temp_keys = (char *)malloc( order * key_size );
     if (temp_keys == NULL) {
         perror("Temporary keys array.");
         exit(EXIT_FAILURE);
@@ -560,42 +1902,38 @@ node * BPlusTree::insert_into_leaf_after_splitting( node * root, node * leaf, ch
         exit(EXIT_FAILURE);
     }
 
-    insertion_index = 0;
-    while (insertion_index < order - 1 && strcmp(leaf->keys[insertion_index], key) < 0)
-        insertion_index++;
-
     for (i = 0, j = 0; i < leaf->num_keys; i++, j++) {
         if (j == insertion_index) j++;
-        temp_keys[j] = leaf->keys[i];
+        memcpy(temp_keys + j * key_size, key_at(leaf, i), key_size);
         temp_pointers[j] = leaf->pointers[i];
     }
 
-    temp_keys[insertion_index] = (char *)malloc(key_length);
-    memset(temp_keys[insertion_index], 0, key_length);
-    strncpy(temp_keys[insertion_index], key, key_length);
+    store_key(temp_keys + insertion_index * key_size, key);
     temp_pointers[insertion_index] = pointer;
 
     leaf->num_keys = 0;
 
     split = cut(order - 1);
 
+    memcpy(leaf->keys, temp_keys, split * key_size);
     for (i = 0; i < split; i++) {
         leaf->pointers[i] = temp_pointers[i];
-        leaf->keys[i] = temp_keys[i];
         leaf->num_keys++;
     }
 
+    memcpy(new_leaf->keys, temp_keys + split * key_size, (order - split) * key_size);
     for (i = split, j = 0; i < order; i++, j++) {
         new_leaf->pointers[j] = temp_pointers[i];
-        new_leaf->keys[j] = temp_keys[i];
         new_leaf->num_keys++;
     }
 
     free(temp_pointers);
-    free(temp_keys);
 
     new_leaf->pointers[order - 1] = leaf->pointers[order - 1];
     leaf->pointers[order - 1] = new_leaf;
+    new_leaf->prev = leaf;
+    if (new_leaf->pointers[order - 1] != NULL)
+        ((node *)new_leaf->pointers[order - 1])->prev = new_leaf;
 
     for (i = leaf->num_keys; i < order - 1; i++)
         leaf->pointers[i] = NULL;
@@ -603,9 +1941,12 @@ node * BPlusTree::insert_into_leaf_after_splitting( node * root, node * leaf, ch
         new_leaf->pointers[i] = NULL;
 
     new_leaf->parent = leaf->parent;
-    new_key = new_leaf->keys[0];
+    new_key = temp_keys;
+    store_separator(new_key, key_at(leaf, leaf->num_keys - 1), key_at(new_leaf, 0));
 
-    return insert_into_parent(root, leaf, new_key, new_leaf);
+    root = insert_into_parent(root, leaf, new_key, new_leaf);
+    free(temp_keys);
+    return root;
 }
 
 /* Inserts a new key and pointer to a node
@@ -616,14 +1957,12 @@ node * BPlusTree::insert_into_node( node * root, node * n, int left_index, char
 {
     int i;
 
-    for (i = n->num_keys; i > left_index; i--) {
+    for (i = n->num_keys; i > left_index; i--)
         n->pointers[i + 1] = n->pointers[i];
-        n->keys[i] = n->keys[i - 1];
-    }
+    memmove(key_at(n, left_index + 1), key_at(n, left_index),
+            (n->num_keys - left_index) * key_size);
     n->pointers[left_index + 1] = right;
-    n->keys[left_index] = (char *)malloc(key_length);
-    memset(n->keys[left_index], 0, key_length);
-    strncpy(n->keys[left_index], key, key_length);
+    store_key(key_at(n, left_index), key);
     n->num_keys++;
     return root;
 }
@@ -636,7 +1975,7 @@ node * BPlusTree::insert_into_node_after_splitting( node * root, node * old_node
 {
     int i, j, split;
     node * new_node, * child;
-    char ** temp_keys, * k_prime;
+    char * temp_keys, * k_prime;
     node ** temp_pointers;
 
     /* First create a temporary set of keys and pointers
@@ -653,7 +1992,7 @@ node * BPlusTree::insert_into_node_after_splitting( node * root, node * old_node
         perror("Temporary pointers array for splitting nodes.");
         exit(EXIT_FAILURE);
     }
-    temp_keys = (char **)malloc( order * sizeof(char *) );
+    temp_keys = (char *)malloc( order * key_size );
     if (temp_keys == NULL) {
         perror("Temporary keys array for splitting nodes.");
         exit(EXIT_FAILURE);
@@ -666,13 +2005,11 @@ node * BPlusTree::insert_into_node_after_splitting( node * root, node * old_node
 
     for (i = 0, j = 0; i < old_node->num_keys; i++, j++) {
         if (j == left_index) j++;
-        temp_keys[j] = old_node->keys[i];
+        memcpy(temp_keys + j * key_size, key_at(old_node, i), key_size);
     }
 
     temp_pointers[left_index + 1] = right;
-    temp_keys[left_index] = (char *)malloc(key_length);
-    memset(temp_keys[left_index], 0, key_length);
-    strncpy(temp_keys[left_index], key, key_length);
+    store_key(temp_keys + left_index * key_size, key);
 
     /* Create the new node and copy
      * half the keys and pointers to the
@@ -681,21 +2018,20 @@ node * BPlusTree::insert_into_node_after_splitting( node * root, node * old_node
     split = cut(order);
     new_node = make_node();
     old_node->num_keys = 0;
+    memcpy(old_node->keys, temp_keys, (split - 1) * key_size);
     for (i = 0; i < split - 1; i++) {
         old_node->pointers[i] = temp_pointers[i];
-        old_node->keys[i] = temp_keys[i];
         old_node->num_keys++;
     }
     old_node->pointers[i] = temp_pointers[i];
-    k_prime = temp_keys[split - 1];
+    k_prime = temp_keys + (split - 1) * key_size;
+    memcpy(new_node->keys, temp_keys + split * key_size, (order - split) * key_size);
     for (++i, j = 0; i < order; i++, j++) {
         new_node->pointers[j] = temp_pointers[i];
-        new_node->keys[j] = temp_keys[i];
         new_node->num_keys++;
     }
     new_node->pointers[j] = temp_pointers[i];
     free(temp_pointers);
-    free(temp_keys);
     new_node->parent = old_node->parent;
     for (i = 0; i <= new_node->num_keys; i++) {
         child = (node *)(new_node->pointers[i]);
@@ -705,9 +2041,12 @@ node * BPlusTree::insert_into_node_after_splitting( node * root, node * old_node
     /* Insert a new key into the parent of the two
      * nodes resulting from the split, with
      * the old node to the left and the new to the right.
+     * k_prime lives in temp_keys, so it is freed after.
      */
 
-    return insert_into_parent(root, old_node, k_prime, new_node);
+    root = insert_into_parent(root, old_node, k_prime, new_node);
+    free(temp_keys);
+    return root;
 }
 
 /* Inserts a new node (leaf or internal node) into the B+ tree.
@@ -756,9 +2095,7 @@ node * BPlusTree::insert_into_parent( node * root, node * left, char * key, node
 node * BPlusTree::insert_into_new_root( node * left, char * key, node * right )
 {
     node * root = make_node();
-    root->keys[0] = (char *)malloc(key_length);
-    memset(root->keys[0], 0, key_length);
-    strncpy(root->keys[0], key, key_length);
+    store_key(key_at(root, 0), key);
     root->pointers[0] = left;
     root->pointers[1] = right;
     root->num_keys++;
@@ -774,9 +2111,7 @@ node * BPlusTree::insert_into_new_root( node * left, char * key, node * right )
 node * BPlusTree::start_new_tree( char * key, record * pointer )
 {
     node * root = make_leaf();
-    root->keys[0] = (char *)malloc(key_length);
-    memset(root->keys[0], 0, key_length);
-    strncpy(root->keys[0], key, key_length);
+    store_key(key_at(root, 0), key);
     root->pointers[0] = pointer;
     root->pointers[order - 1] = NULL;
     root->parent = NULL;
@@ -810,7 +2145,7 @@ int BPlusTree::get_neighbor_index( node * n )
     exit(EXIT_FAILURE);
 }
 
-node * BPlusTree::adjust_root( node * root )
+node * BPlusTree::adjust_root( node * root, latch_path * path )
 {
     node * new_root;
 
@@ -840,9 +2175,7 @@ node * BPlusTree::adjust_root( node * root )
     else
         new_root = NULL;
 
-    free(root->keys);
-    free(root->pointers);
-    free(root);
+    retire_node(root, path);
 
     return new_root;
 }
@@ -853,11 +2186,10 @@ node * BPlusTree::adjust_root( node * root )
  * can accept the additional entries
  * without exceeding the maximum.
  */
-node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int neighbor_index, char * k_prime )
+node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int neighbor_index, int k_prime_index, char * k_prime, latch_path * path )
 {
     int i, j, neighbor_insertion_index, n_start, n_end;
-    char * new_k_prime;
-    node * tmp;
+        node * tmp;
     bool split;
 
     /* Swap neighbor with node if node is on the
@@ -901,9 +2233,7 @@ node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int ne
         /* Append k_prime.
          */
 
-        neighbor->keys[neighbor_insertion_index] = (char *)malloc(key_length);
-        memset(neighbor->keys[neighbor_insertion_index], 0, key_length);
-        strncpy(neighbor->keys[neighbor_insertion_index], k_prime, key_length);
+        store_key(key_at(neighbor, neighbor_insertion_index), k_prime);
         neighbor->num_keys++;
 
 
@@ -923,7 +2253,7 @@ node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int ne
         }
 
         for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
+            memcpy(key_at(neighbor, i), key_at(n, j), key_size);
             neighbor->pointers[i] = n->pointers[j];
             neighbor->num_keys++;
             n->num_keys--;
@@ -936,13 +2266,17 @@ node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int ne
 
         neighbor->pointers[i] = n->pointers[j];
 
-        /* If the nodes are still split, remove the first key from
-         * n.
+        /* If the nodes are still split, move the first key of
+         * n up to the parent and remove it from n.
          */
         if (split) {
-            new_k_prime = n->keys[n_start];
+            for (i = 0; i < n->parent->num_keys; i++)
+                if (n->parent->pointers[i + 1] == n) {
+                    store_key(key_at(n->parent, i), key_at(n, n_start));
+                    break;
+                }
             for (i = 0, j = n_start + 1; i < n->num_keys; i++, j++) {
-                n->keys[i] = n->keys[j];
+                memcpy(key_at(n, i), key_at(n, j), key_size);
                 n->pointers[i] = n->pointers[j];
             }
             n->pointers[i] = n->pointers[j];
@@ -966,25 +2300,19 @@ node * BPlusTree::coalesce_nodes( node * root, node * n, node * neighbor, int ne
 
     else {
         for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
+            memcpy(key_at(neighbor, i), key_at(n, j), key_size);
             neighbor->pointers[i] = n->pointers[j];
             neighbor->num_keys++;
         }
         neighbor->pointers[order - 1] = n->pointers[order - 1];
+        if (neighbor->pointers[order - 1] != NULL)
+            ((node *)neighbor->pointers[order - 1])->prev = neighbor;
     }
 
     if (!split) {
-        root = delete_entry(root, n->parent, k_prime, n);
-        free(n->keys);
-        free(n->pointers);
-        free(n); 
+        root = delete_entry(root, n->parent, k_prime_index, path);
+        retire_node(n, path);
     }
-    else
-        for (i = 0; i < n->parent->num_keys; i++)
-            if (n->parent->pointers[i + 1] == n) {
-                n->parent->keys[i] = new_k_prime;
-                break;
-            }
 
     return root;
 }
@@ -1008,25 +2336,22 @@ node * BPlusTree::redistribute_nodes( node * root, node * n, node * neighbor, in
     if (neighbor_index != -1) {
         if (!n->is_leaf)
             n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
-        for (i = n->num_keys; i > 0; i--) {
-            n->keys[i] = n->keys[i - 1];
+        memmove(key_at(n, 1), key_at(n, 0), n->num_keys * key_size);
+        for (i = n->num_keys; i > 0; i--)
             n->pointers[i] = n->pointers[i - 1];
-        }
         if (!n->is_leaf) {
             n->pointers[0] = neighbor->pointers[neighbor->num_keys];
             tmp = (node *)n->pointers[0];
             tmp->parent = n;
             neighbor->pointers[neighbor->num_keys] = NULL;
-            n->keys[0] = k_prime;
-            n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
-            neighbor->keys[neighbor->num_keys - 1] = NULL;
+            store_key(key_at(n, 0), k_prime);
+            store_key(key_at(n->parent, k_prime_index), key_at(neighbor, neighbor->num_keys - 1));
         }
         else {
             n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
             neighbor->pointers[neighbor->num_keys - 1] = NULL;
-            n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-            neighbor->keys[neighbor->num_keys - 1] = NULL;
-            strncpy(n->parent->keys[k_prime_index], n->keys[0], key_length);
+            store_key(key_at(n, 0), key_at(neighbor, neighbor->num_keys - 1));
+            store_key(key_at(n->parent, k_prime_index), key_at(n, 0));
         }
     }
 
@@ -1038,21 +2363,20 @@ node * BPlusTree::redistribute_nodes( node * root, node * n, node * neighbor, in
 
     else {  
         if (n->is_leaf) {
-            n->keys[n->num_keys] = neighbor->keys[0];
+            store_key(key_at(n, n->num_keys), key_at(neighbor, 0));
             n->pointers[n->num_keys] = neighbor->pointers[0];
-            strncpy(n->parent->keys[k_prime_index], neighbor->keys[1], key_length);
+            store_key(key_at(n->parent, k_prime_index), key_at(neighbor, 1));
         }
         else {
-            n->keys[n->num_keys] = k_prime;
+            store_key(key_at(n, n->num_keys), k_prime);
             n->pointers[n->num_keys + 1] = neighbor->pointers[0];
             tmp = (node *)n->pointers[n->num_keys + 1];
             tmp->parent = n;
-            n->parent->keys[k_prime_index] = neighbor->keys[0];
+            store_key(key_at(n->parent, k_prime_index), key_at(neighbor, 0));
         }
-        for (i = 0; i < neighbor->num_keys; i++) {
-            neighbor->keys[i] = neighbor->keys[i + 1];
+        memmove(key_at(neighbor, 0), key_at(neighbor, 1), (neighbor->num_keys - 1) * key_size);
+        for (i = 0; i < neighbor->num_keys - 1; i++)
             neighbor->pointers[i] = neighbor->pointers[i + 1];
-        }
         if (!n->is_leaf)
             neighbor->pointers[i] = neighbor->pointers[i + 1];
         else
@@ -1070,11 +2394,11 @@ node * BPlusTree::redistribute_nodes( node * root, node * n, node * neighbor, in
 }
 
 /* Deletes an entry from the B+ tree.
- * Removes the record and its key and pointer
- * from the leaf, and then makes all appropriate
+ * Removes the key at index and its pointer
+ * from the node, and then makes all appropriate
  * changes to preserve the B+ tree properties.
  */
-node * BPlusTree::delete_entry( node * root, node * n, char * key, void * pointer )
+node * BPlusTree::delete_entry( node * root, node * n, int index, latch_path * path )
 {
     int min_keys;
     node * neighbor;
@@ -1085,13 +2409,13 @@ node * BPlusTree::delete_entry( node * root, node * n, char * key, void * pointe
 
     // Remove key and pointer from node.
 
-    n = remove_entry_from_node(n, key, (node *)pointer);
+    n = remove_entry_from_node(n, index);
 
     /* Case:  deletion from the root. 
      */
 
     if (n == root) 
-        return adjust_root(root);
+        return adjust_root(root, path);
 
 
     /* Case:  deletion from a node below the root.
@@ -1125,16 +2449,30 @@ node * BPlusTree::delete_entry( node * root, node * n, char * key, void * pointe
 
     neighbor_index = get_neighbor_index( n );
     k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-    k_prime = n->parent->keys[k_prime_index];
+    k_prime = key_at(n->parent, k_prime_index);
     neighbor = neighbor_index == -1 ? (node *)(n->parent->pointers[1]) : 
         (node *)(n->parent->pointers[neighbor_index]);
 
+    /* In thread-safe mode the parent is latched, as n
+     * is not safe, but the neighbor has to be latched
+     * before it is read.
+     */
+
+    /* In copy-on-write mode the writer is alone, and
+     * the neighbor is copied instead, as the path was.
+     */
+
+    if (concurrency == BPTREE_CONCURRENCY_COPY_ON_WRITE)
+        neighbor = copy_node(neighbor, n->parent, neighbor_index == -1 ? 1 : neighbor_index, path);
+    else if (path != NULL)
+        latch_node(path, neighbor);
+
     capacity = n->is_leaf ? order : order - 1;
 
     /* Coalescence. */
 
     if (neighbor->num_keys + n->num_keys < capacity)
-        return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime);
+        return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime_index, k_prime, path);
 
     /* Redistribution. */
 
@@ -1142,23 +2480,22 @@ node * BPlusTree::delete_entry( node * root, node * n, char * key, void * pointe
         return redistribute_nodes(root, n, neighbor, neighbor_index, k_prime_index, k_prime);
 }
 
-node * BPlusTree::remove_entry_from_node( node * n, char * key, node * pointer )
+/* Removes the key at index from a node, together
+ * with its pointer: the record pointer at index
+ * in a leaf, or the child pointer at index + 1
+ * in an internal node.
+ */
+node * BPlusTree::remove_entry_from_node( node * n, int index )
 {
     int i, num_pointers;
 
     // Remove the key and shift other keys accordingly.
-    i = 0;
-    while (strcmp(n->keys[i], key) != 0)
-        i++;
-    for (++i; i < n->num_keys; i++)
-        n->keys[i - 1] = n->keys[i];
+    memmove(key_at(n, index), key_at(n, index + 1), (n->num_keys - index - 1) * key_size);
 
     // Remove the pointer and shift other pointers accordingly.
     // First determine number of pointers.
     num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-    i = 0;
-    while (n->pointers[i] != pointer)
-        i++;
+    i = n->is_leaf ? index : index + 1;
     for (++i; i < num_pointers; i++)
         n->pointers[i - 1] = n->pointers[i];
 
@@ -1190,16 +2527,816 @@ void BPlusTree::destroy_tree_nodes( node * root )
 {
     int i;
     if (root->is_leaf)
-        for (i = 0; i < root->num_keys; i++) {
-            free(root->pointers[i]);
-            free(root->keys[i]);
-        }
+        for (i = 0; i < root->num_keys; i++)
+            free_record((record *)root->pointers[i]);
     else
         for (i = 0; i < root->num_keys + 1; i++)
             destroy_tree_nodes((node *)(root->pointers[i]));
-    free(root->pointers);
-    free(root->keys);
-    free(root);
+    free_node(root);
+}
+
+
+
+/* Orders the indexes of buffered keys by key,
+ * for the presort of a bulk load.
+ */
+struct BPlusTree::bulk_key_less {
+    BPlusTree * tree;
+    bool operator()( size_t a, size_t b ) const
+    {
+        return tree->compare_keys(tree->bulk.keys + a * tree->key_size,
+                                  tree->bulk.keys + b * tree->key_size) < 0;
+    }
+};
+
+/* Starts a bulk load into an empty tree.  The
+ * fill factor gives the keys per leaf and the
+ * children per internal node, but never less
+ * than the minimum a node may hold.
+ */
+bool BPlusTree::begin_bulk_load( double fill_factor, bool presort )
+{
+    if (root_node != NULL)
+        return false;
+    if (!(fill_factor > 0 && fill_factor <= 1))
+        fill_factor = 1;
+
+    bulk.leaf_fill = (int)(fill_factor * (order - 1) + 0.5);
+    if (bulk.leaf_fill < cut(order - 1))
+        bulk.leaf_fill = cut(order - 1);
+    if (bulk.leaf_fill > order - 1)
+        bulk.leaf_fill = order - 1;
+    bulk.node_fill = (int)(fill_factor * order + 0.5);
+    if (bulk.node_fill < cut(order))
+        bulk.node_fill = cut(order);
+    if (bulk.node_fill > order)
+        bulk.node_fill = order;
+
+    bulk.presort = presort;
+    bulk.failed = false;
+    bulk.nodes = NULL;
+    bulk.num_nodes = 0;
+    bulk.nodes_capacity = 0;
+    bulk.keys = NULL;
+    bulk.values = NULL;
+    bulk.num_entries = 0;
+    bulk.entries_capacity = 0;
+    return true;
+}
+
+void BPlusTree::bulk_load_add( int key, int value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        bulk_load_add_key((char *)&num, value);
+        return;
+    }
+    char * key_str = format_key(key);
+    bulk_load_add_key(key_str, value);
+    free(key_str);
+}
+
+void BPlusTree::bulk_load_add( const char * key, int value )
+{
+    int64_t num;
+    bulk_load_add_key(make_key((char *)key, &num), value);
+}
+
+/* Adds a key to the bulk load, either buffered
+ * for the presort or appended to the leaves.
+ */
+void BPlusTree::bulk_load_add_key( char * key, int value )
+{
+    if (bulk.failed)
+        return;
+    if (!bulk.presort) {
+        bulk_load_append(key, value);
+        return;
+    }
+    if (bulk.num_entries == bulk.entries_capacity) {
+        bulk.entries_capacity = bulk.entries_capacity == 0 ? 1024 : bulk.entries_capacity * 2;
+        bulk.keys = (char *)realloc(bulk.keys, bulk.entries_capacity * key_size);
+        bulk.values = (int *)realloc(bulk.values, bulk.entries_capacity * sizeof(int));
+        if (bulk.keys == NULL || bulk.values == NULL) {
+            perror("Bulk load buffer.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    store_key(bulk.keys + bulk.num_entries * key_size, key);
+    bulk.values[bulk.num_entries] = value;
+    bulk.num_entries++;
+}
+
+/* Appends a key and its record to the last leaf,
+ * starting a new leaf when the last one holds
+ * the fill.  A key equal to the last one is
+ * ignored, and a smaller key fails the load.
+ */
+void BPlusTree::bulk_load_append( char * key, int value )
+{
+    node * leaf, * new_leaf;
+    int c;
+
+    leaf = bulk.num_nodes > 0 ? bulk.nodes[bulk.num_nodes - 1] : NULL;
+    if (leaf != NULL) {
+        c = compare_keys(key_at(leaf, leaf->num_keys - 1), key);
+        if (c == 0)
+            return;
+        if (c > 0) {
+            bulk.failed = true;
+            return;
+        }
+    }
+
+    if (leaf == NULL || leaf->num_keys == bulk.leaf_fill) {
+        if (bulk.num_nodes == bulk.nodes_capacity) {
+            bulk.nodes_capacity = bulk.nodes_capacity == 0 ? 1024 : bulk.nodes_capacity * 2;
+            bulk.nodes = (node **)realloc(bulk.nodes, bulk.nodes_capacity * sizeof(node *));
+            if (bulk.nodes == NULL) {
+                perror("Bulk load nodes.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        new_leaf = make_leaf();
+        new_leaf->pointers[order - 1] = NULL;
+        new_leaf->prev = leaf;
+        if (leaf != NULL)
+            leaf->pointers[order - 1] = new_leaf;
+        bulk.nodes[bulk.num_nodes++] = new_leaf;
+        leaf = new_leaf;
+    }
+
+    store_key(key_at(leaf, leaf->num_keys), key);
+    leaf->pointers[leaf->num_keys] = make_record(value);
+    leaf->num_keys++;
+}
+
+/* Returns the leftmost leaf under a node, whose
+ * first key and the last of the leaf before it
+ * give the separator of the node in its parent.
+ */
+node * BPlusTree::bulk_low_leaf( node * n )
+{
+    while (!n->is_leaf)
+        n = (node *)n->pointers[0];
+    return n;
+}
+
+/* Builds the parents of the nodes of one level,
+ * spreading the children evenly so that each
+ * parent holds at least the minimum, and puts
+ * them in place of the children.
+ * Returns the number of parents.
+ */
+size_t BPlusTree::bulk_load_level( size_t num_children )
+{
+    size_t num_parents, base, extra, i, j, count, k;
+    node * parent, * child, * leaf;
+
+    num_parents = (num_children + bulk.node_fill - 1) / bulk.node_fill;
+    if (num_parents > 1 && num_children / num_parents < (size_t)cut(order))
+        num_parents = num_children / cut(order);
+    base = num_children / num_parents;
+    extra = num_children % num_parents;
+
+    for (i = 0, j = 0; i < num_parents; i++, j += count) {
+        count = base + (i < extra ? 1 : 0);
+        parent = make_node();
+        for (k = 0; k < count; k++) {
+            child = bulk.nodes[j + k];
+            child->parent = parent;
+            parent->pointers[k] = child;
+            if (k > 0) {
+                leaf = bulk_low_leaf(child);
+                store_separator(key_at(parent, k - 1), key_at(leaf->prev, leaf->prev->num_keys - 1), key_at(leaf, 0));
+            }
+        }
+        parent->num_keys = count - 1;
+        bulk.nodes[i] = parent;
+    }
+    return num_parents;
+}
+
+/* Finishes a bulk load.  Sorts and appends the
+ * buffered keys for a presort, evens out the
+ * last two leaves if the last one is below the
+ * minimum, then builds the internal levels up
+ * to the root.
+ */
+bool BPlusTree::end_bulk_load( void )
+{
+    node * last, * prev;
+    size_t i, * sorted;
+    int min_keys, total, move;
+    bulk_key_less less;
+
+    if (bulk.presort && bulk.num_entries > 0) {
+        sorted = (size_t *)malloc(bulk.num_entries * sizeof(size_t));
+        if (sorted == NULL) {
+            perror("Bulk load sort.");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < bulk.num_entries; i++)
+            sorted[i] = i;
+        less.tree = this;
+        std::stable_sort(sorted, sorted + bulk.num_entries, less);
+        for (i = 0; i < bulk.num_entries; i++)
+            bulk_load_append(bulk.keys + sorted[i] * key_size, bulk.values[sorted[i]]);
+        free(sorted);
+    }
+    free(bulk.keys);
+    free(bulk.values);
+    bulk.keys = NULL;
+    bulk.values = NULL;
+
+    if (bulk.failed) {
+        for (i = 0; i < bulk.num_nodes; i++)
+            destroy_tree_nodes(bulk.nodes[i]);
+        free(bulk.nodes);
+        bulk.nodes = NULL;
+        return false;
+    }
+
+    min_keys = cut(order - 1);
+    if (bulk.num_nodes > 1 && bulk.nodes[bulk.num_nodes - 1]->num_keys < min_keys) {
+        last = bulk.nodes[bulk.num_nodes - 1];
+        prev = bulk.nodes[bulk.num_nodes - 2];
+        total = prev->num_keys + last->num_keys;
+        if (total <= order - 1) {
+            memcpy(key_at(prev, prev->num_keys), last->keys, last->num_keys * key_size);
+            memcpy(prev->pointers + prev->num_keys, last->pointers, last->num_keys * sizeof(void *));
+            prev->num_keys = total;
+            prev->pointers[order - 1] = NULL;
+            free_node(last);
+            bulk.num_nodes--;
+        }
+        else {
+            move = total / 2 - last->num_keys;
+            memmove(key_at(last, move), last->keys, last->num_keys * key_size);
+            memmove(last->pointers + move, last->pointers, last->num_keys * sizeof(void *));
+            memcpy(last->keys, key_at(prev, prev->num_keys - move), move * key_size);
+            memcpy(last->pointers, prev->pointers + prev->num_keys - move, move * sizeof(void *));
+            prev->num_keys -= move;
+            last->num_keys += move;
+        }
+    }
+
+    while (bulk.num_nodes > 1)
+        bulk.num_nodes = bulk_load_level(bulk.num_nodes);
+    if (bulk.num_nodes == 1) {
+        root_node = bulk.nodes[0];
+        root_node->parent = NULL;
+    }
+    free(bulk.nodes);
+    bulk.nodes = NULL;
+    return true;
+}
+
+/* State of a parallel bulk load, shared by its
+ * tasks.  Each phase runs its tasks at once, and
+ * task i works on run i of the sorted entries.
+ */
+struct BPlusTree::parallel_bulk {
+    enum { SORT, MERGE, COUNT, PACK, BUILD } phase;
+    BPlusTree * tree;
+    int num_tasks;
+    bool presort;
+    size_t * sorted;        /* Indexes of the entries in key order.*/
+    size_t * unique;        /* First entry of each distinct key.*/
+    size_t num_unique;
+    size_t runs[BPTREE_MAX_THREADS + 1];    /* Run of each task in sorted.*/
+    size_t counts[BPTREE_MAX_THREADS];      /* Distinct keys of each run, then where they go in unique.*/
+    bool unsorted[BPTREE_MAX_THREADS];      /* The run is not in order.*/
+    int merge_width;        /* Runs in each half of a merge.*/
+    int build_tasks;        /* Tasks building leaves.*/
+    size_t num_leaves;
+    size_t last_start;      /* First key of the last leaf in unique.*/
+};
+
+/* Runs one task of a phase of a parallel bulk
+ * load: sorts a run, merges two sorted halves,
+ * counts the distinct keys of a run, packs them
+ * into unique, or builds and links a run of
+ * leaves.  A key equal to the one before it is
+ * not distinct.
+ */
+void BPlusTree::parallel_bulk_task( void * arg, int index )
+{
+    parallel_bulk * job = (parallel_bulk *)arg;
+    BPlusTree * tree = job->tree;
+    bulk_key_less less;
+    size_t i, k, lo, mid, hi, entry;
+    node * leaf, * prev;
+    char * keys = tree->bulk.keys;
+    int key_size = tree->key_size, c;
+
+    less.tree = tree;
+    switch (job->phase) {
+    case parallel_bulk::SORT:
+        for (i = job->runs[index]; i < job->runs[index + 1]; i++)
+            job->sorted[i] = i;
+        if (job->presort)
+            std::stable_sort(job->sorted + job->runs[index], job->sorted + job->runs[index + 1], less);
+        break;
+    case parallel_bulk::MERGE:
+        lo = 2 * index * job->merge_width;
+        mid = lo + job->merge_width;
+        hi = mid + job->merge_width < (size_t)job->num_tasks ? mid + job->merge_width : job->num_tasks;
+        if (mid < hi)
+            std::inplace_merge(job->sorted + job->runs[lo], job->sorted + job->runs[mid],
+                               job->sorted + job->runs[hi], less);
+        break;
+    case parallel_bulk::COUNT:
+        job->counts[index] = 0;
+        job->unsorted[index] = false;
+        for (i = job->runs[index]; i < job->runs[index + 1]; i++) {
+            c = i == 0 ? -1 : tree->compare_keys(keys + job->sorted[i - 1] * key_size,
+                                                 keys + job->sorted[i] * key_size);
+            if (c > 0)
+                job->unsorted[index] = true;
+            if (c != 0)
+                job->counts[index]++;
+        }
+        break;
+    case parallel_bulk::PACK:
+        k = job->counts[index];
+        for (i = job->runs[index]; i < job->runs[index + 1]; i++)
+            if (i == 0 || tree->compare_keys(keys + job->sorted[i - 1] * key_size,
+                                             keys + job->sorted[i] * key_size) != 0)
+                job->unique[k++] = job->sorted[i];
+        break;
+    case parallel_bulk::BUILD:
+        prev = NULL;
+        for (i = job->num_leaves * index / job->build_tasks;
+             i < job->num_leaves * (index + 1) / job->build_tasks; i++) {
+            leaf = tree->make_leaf();
+            leaf->pointers[tree->order - 1] = NULL;
+            leaf->prev = prev;
+            if (prev != NULL)
+                prev->pointers[tree->order - 1] = leaf;
+            lo = tree->parallel_leaf_start(job, i);
+            hi = tree->parallel_leaf_start(job, i + 1);
+            for (k = lo; k < hi; k++) {
+                entry = job->unique[k];
+                tree->store_key(tree->key_at(leaf, k - lo), keys + entry * key_size);
+                leaf->pointers[k - lo] = tree->make_record(tree->bulk.values[entry]);
+            }
+            leaf->num_keys = hi - lo;
+            tree->bulk.nodes[i] = leaf;
+            prev = leaf;
+        }
+        break;
+    }
+}
+
+/* Returns where a leaf of a parallel bulk load
+ * starts in the distinct keys.  The leaves hold
+ * the fill but for the last two, evened out as
+ * end_bulk_load does.
+ */
+size_t BPlusTree::parallel_leaf_start( parallel_bulk * job, size_t leaf )
+{
+    if (leaf + 1 < job->num_leaves)
+        return leaf * bulk.leaf_fill;
+    if (leaf + 1 == job->num_leaves)
+        return job->last_start;
+    return job->num_unique;
+}
+
+/* Finishes a parallel bulk load of the buffered
+ * keys.  Sorts the runs and merges them pairwise
+ * for a presort, or checks the order, packs the
+ * distinct keys, lays the leaves out and builds
+ * them, then stitches the runs of leaves into one
+ * chain and builds the internal levels.
+ */
+bool BPlusTree::end_parallel_bulk_load( int num_threads, bool presort )
+{
+    parallel_bulk job;
+    size_t n, i, total, count, rest;
+    int t;
+    bool failed = false;
+
+    n = bulk.num_entries;
+    if (num_threads <= 0)
+        num_threads = bpt_cpu_count();
+    if ((size_t)num_threads > n / BPTREE_PARALLEL_MIN_ENTRIES)
+        num_threads = (int)(n / BPTREE_PARALLEL_MIN_ENTRIES);
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > BPTREE_MAX_THREADS)
+        num_threads = BPTREE_MAX_THREADS;
+
+    job.tree = this;
+    job.num_tasks = num_threads;
+    job.presort = presort;
+    job.sorted = (size_t *)malloc((n > 0 ? n : 1) * sizeof(size_t));
+    if (job.sorted == NULL) {
+        perror("Bulk load sort.");
+        exit(EXIT_FAILURE);
+    }
+    for (t = 0; t <= num_threads; t++)
+        job.runs[t] = n * t / num_threads;
+
+    job.phase = parallel_bulk::SORT;
+    bpt_run_tasks(parallel_bulk_task, &job, num_threads);
+    if (presort) {
+        job.phase = parallel_bulk::MERGE;
+        for (job.merge_width = 1; job.merge_width < num_threads; job.merge_width *= 2)
+            bpt_run_tasks(parallel_bulk_task, &job, (num_threads + 2 * job.merge_width - 1) / (2 * job.merge_width));
+    }
+    job.phase = parallel_bulk::COUNT;
+    bpt_run_tasks(parallel_bulk_task, &job, num_threads);
+
+    total = 0;
+    for (t = 0; t < num_threads; t++) {
+        failed = failed || job.unsorted[t];
+        count = job.counts[t];
+        job.counts[t] = total;
+        total += count;
+    }
+    job.unique = NULL;
+    if (!failed && total > 0) {
+        job.num_unique = total;
+        job.unique = (size_t *)malloc(total * sizeof(size_t));
+        if (job.unique == NULL) {
+            perror("Bulk load sort.");
+            exit(EXIT_FAILURE);
+        }
+        job.phase = parallel_bulk::PACK;
+        bpt_run_tasks(parallel_bulk_task, &job, num_threads);
+    }
+    free(job.sorted);
+
+    if (job.unique != NULL) {
+        job.num_leaves = (total + bulk.leaf_fill - 1) / bulk.leaf_fill;
+        job.last_start = (job.num_leaves - 1) * bulk.leaf_fill;
+        if (job.num_leaves > 1 && total - job.last_start < (size_t)cut(order - 1)) {
+            rest = total - (job.num_leaves - 2) * bulk.leaf_fill;
+            if (rest <= (size_t)(order - 1)) {
+                job.num_leaves--;
+                job.last_start = (job.num_leaves - 1) * bulk.leaf_fill;
+            }
+            else
+                job.last_start = (job.num_leaves - 2) * bulk.leaf_fill + rest - rest / 2;
+        }
+        bulk.nodes = (node **)malloc(job.num_leaves * sizeof(node *));
+        if (bulk.nodes == NULL) {
+            perror("Bulk load nodes.");
+            exit(EXIT_FAILURE);
+        }
+        bulk.num_nodes = job.num_leaves;
+        job.build_tasks = allocator != NULL ? 1 : num_threads;
+        job.phase = parallel_bulk::BUILD;
+        bpt_run_tasks(parallel_bulk_task, &job, job.build_tasks);
+        for (t = 1; t < job.build_tasks; t++) {
+            i = job.num_leaves * t / job.build_tasks;
+            if (i == 0 || i == job.num_leaves)
+                continue;
+            bulk.nodes[i - 1]->pointers[order - 1] = bulk.nodes[i];
+            bulk.nodes[i]->prev = bulk.nodes[i - 1];
+        }
+        free(job.unique);
+    }
+    free(bulk.keys);
+    free(bulk.values);
+    bulk.keys = NULL;
+    bulk.values = NULL;
+    if (failed)
+        return false;
+
+    while (bulk.num_nodes > 1)
+        bulk.num_nodes = bulk_load_level(bulk.num_nodes);
+    if (bulk.num_nodes == 1) {
+        root_node = bulk.nodes[0];
+        root_node->parent = NULL;
+    }
+    free(bulk.nodes);
+    bulk.nodes = NULL;
+    return true;
+}
+
+/* State of a parallel scan, shared by its tasks.
+ * The subtrees covering the range are cut into
+ * one run per task.
+ */
+struct BPlusTree::parallel_scan_job {
+    BPlusTree * tree;
+    char * lo;
+    char * hi;
+    scan_callback fn;
+    void * arg;
+    node ** nodes;          /* Subtrees covering the range, in key order.*/
+    size_t num_nodes;
+    int num_tasks;
+    scan_result results[BPTREE_MAX_THREADS];    /* Result of each task.*/
+};
+
+/* Scans the run of subtrees of one task, from the
+ * leftmost leaf of its first subtree up to the
+ * leftmost leaf of the first subtree of the next
+ * task.  Only the first task starts inside the
+ * first subtree, at lo, and only the last task
+ * can reach keys past hi, so only the last
+ * compares each key.
+ */
+void BPlusTree::parallel_scan_task( void * arg, int index )
+{
+    parallel_scan_job * job = (parallel_scan_job *)arg;
+    BPlusTree * tree = job->tree;
+    scan_result * result = &job->results[index];
+    size_t first, last;
+    node * leaf, * stop;
+    record * r;
+    bool last_task;
+    int i;
+
+    first = job->num_nodes * index / job->num_tasks;
+    last = job->num_nodes * (index + 1) / job->num_tasks;
+    result->count = 0;
+    result->sum = 0;
+    result->min = 0;
+    result->max = 0;
+    if (first == last)
+        return;
+
+    if (index == 0) {
+        leaf = tree->find_leaf(tree->root_node, job->lo, false);
+        i = tree->lower_bound(leaf, job->lo);
+    }
+    else {
+        for (leaf = job->nodes[first]; !leaf->is_leaf; leaf = (node *)leaf->pointers[0])
+            ;
+        i = 0;
+    }
+    stop = NULL;
+    if (last < job->num_nodes)
+        for (stop = job->nodes[last]; !stop->is_leaf; stop = (node *)stop->pointers[0])
+            ;
+    last_task = last == job->num_nodes;
+
+    for (; leaf != stop; leaf = (node *)leaf->pointers[tree->order - 1], i = 0) {
+        for (; i < leaf->num_keys; i++) {
+            if (last_task && tree->compare_keys(tree->key_at(leaf, i), job->hi) > 0)
+                return;
+            r = (record *)leaf->pointers[i];
+            if (result->count == 0 || r->value < result->min)
+                result->min = r->value;
+            if (result->count == 0 || r->value > result->max)
+                result->max = r->value;
+            result->count++;
+            result->sum += r->value;
+            if (job->fn != NULL)
+                job->fn(tree->key_at(leaf, i), r, job->arg);
+        }
+    }
+}
+
+/* Scans the keys from lo to hi in parallel.  From
+ * the root down, each level is replaced with the
+ * children covering the range, until it holds
+ * enough subtrees for the threads or is the leaf
+ * level.  A child i of a node covers the keys from
+ * key i - 1 up to but not including key i.  The
+ * results of the tasks are then reduced.
+ */
+scan_result BPlusTree::parallel_scan( char * lo, char * hi, scan_callback fn, void * arg, int num_threads )
+{
+    parallel_scan_job job;
+    scan_result result;
+    node ** children, * n;
+    size_t target, num_children, j;
+    int i, t;
+
+    result.count = 0;
+    result.sum = 0;
+    result.min = 0;
+    result.max = 0;
+    if (root_node == NULL || compare_keys(lo, hi) > 0)
+        return result;
+    if (num_threads <= 0)
+        num_threads = bpt_cpu_count();
+    if (num_threads > BPTREE_MAX_THREADS)
+        num_threads = BPTREE_MAX_THREADS;
+
+    job.nodes = (node **)malloc(sizeof(node *));
+    if (job.nodes == NULL) {
+        perror("Scan partition.");
+        exit(EXIT_FAILURE);
+    }
+    job.nodes[0] = root_node;
+    job.num_nodes = 1;
+    target = (size_t)num_threads * BPTREE_SCAN_PARTS_PER_THREAD;
+    while (num_threads > 1 && job.num_nodes < target && !job.nodes[0]->is_leaf) {
+        children = (node **)malloc(job.num_nodes * order * sizeof(node *));
+        if (children == NULL) {
+            perror("Scan partition.");
+            exit(EXIT_FAILURE);
+        }
+        num_children = 0;
+        for (j = 0; j < job.num_nodes; j++) {
+            n = job.nodes[j];
+            for (i = 0; i <= n->num_keys; i++)
+                if ((i == 0 || compare_keys(key_at(n, i - 1), hi) <= 0)
+                        && (i == n->num_keys || compare_keys(key_at(n, i), lo) > 0))
+                    children[num_children++] = (node *)n->pointers[i];
+        }
+        free(job.nodes);
+        job.nodes = children;
+        job.num_nodes = num_children;
+    }
+
+    job.tree = this;
+    job.lo = lo;
+    job.hi = hi;
+    job.fn = fn;
+    job.arg = arg;
+    job.num_tasks = (size_t)num_threads < job.num_nodes ? num_threads : (int)job.num_nodes;
+    bpt_run_tasks(parallel_scan_task, &job, job.num_tasks);
+    free(job.nodes);
+
+    for (t = 0; t < job.num_tasks; t++) {
+        if (job.results[t].count == 0)
+            continue;
+        if (result.count == 0 || job.results[t].min < result.min)
+            result.min = job.results[t].min;
+        if (result.count == 0 || job.results[t].max > result.max)
+            result.max = job.results[t].max;
+        result.count += job.results[t].count;
+        result.sum += job.results[t].sum;
+    }
+    return result;
+}
+
+/* Writes the snapshot to a file beside path,
+ * then renames it over path.
+ */
+bool BPlusTree::SaveSnapshot( const char * path )
+{
+    char * tmp_path;
+    FILE * fp;
+    bool ok;
+
+    tmp_path = (char *)malloc(strlen(path) + 5);
+    if (tmp_path == NULL) {
+        perror("Snapshot.");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(tmp_path);
+        return false;
+    }
+    ok = write_snapshot(fp);
+    ok = fclose(fp) == 0 && ok;
+#ifdef BPTREE_OS_WINDOWS
+    if (ok)
+        remove(path);
+#endif
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok)
+        remove(tmp_path);
+    free(tmp_path);
+    return ok;
 }
 
+/* Writes the leaves packed full from the leaf
+ * chain, noting the offset and low key of each,
+ * then each internal level over the level below
+ * until one node is left, the root.  Children
+ * are spread evenly over the nodes of a level.
+ * The header is written last, at offset 0.
+ * The keys of a leaf are sorted, so the prefix
+ * they share is the one its first and last key
+ * share.
+ */
+bool BPlusTree::write_snapshot( FILE * fp )
+{
+    bpt_snapshot_header header;
+    bpt_snapshot_node * n;
+    uint64_t offset, node_size, pointers, num_keys, count, parents, first, next_count;
+    uint64_t * offsets, l, p;
+    char * low_keys, * buffer, * zeros;
+    char ** keys;
+    int32_t * values;
+    node * leaf, * c;
+    int i, j, k, leaf_keys, per_node, extra, prefix, suffix;
+    bool ok = true;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BPTREE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = BPTREE_SNAPSHOT_VERSION;
+    header.order = order;
+    header.key_length = key_length - 1;
+    header.key_type = key_type;
+    header.key_size = key_size;
+
+    num_keys = 0;
+    leaf = root_node;
+    while (leaf != NULL && !leaf->is_leaf)
+        leaf = (node *)leaf->pointers[0];
+    for (c = leaf; c != NULL; c = (node *)c->pointers[order - 1])
+        num_keys += c->num_keys;
+    header.num_keys = num_keys;
+
+    leaf_keys = order - 1;
+    count = (num_keys + leaf_keys - 1) / leaf_keys;
+    offsets = (uint64_t *)malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    low_keys = (char *)malloc((count > 0 ? count : 1) * key_size);
+    bpt_snapshot_layout(order - 1, key_size, 0, false, &node_size);
+    buffer = (char *)malloc(node_size);
+    zeros = (char *)calloc(1, sizeof(header) + 8);
+    keys = (char **)malloc(leaf_keys * sizeof(char *));
+    values = (int32_t *)malloc(leaf_keys * sizeof(int32_t));
+    if (offsets == NULL || low_keys == NULL || buffer == NULL || zeros == NULL || keys == NULL || values == NULL) {
+        perror("Snapshot.");
+        exit(EXIT_FAILURE);
+    }
+    n = (bpt_snapshot_node *)buffer;
+
+    offset = bpt_snapshot_align(sizeof(header));
+    ok = fwrite(zeros, 1, offset, fp) == offset;
+
+    /* Leaves, each full but the last.
+     */
+    i = 0;
+    for (l = 0; l < count && ok; l++) {
+        k = (int)(l + 1 < count ? leaf_keys : num_keys - l * leaf_keys);
+        for (j = 0; j < k; j++) {
+            if (i == leaf->num_keys) {
+                leaf = (node *)leaf->pointers[order - 1];
+                i = 0;
+            }
+            keys[j] = key_at(leaf, i);
+            values[j] = ((record *)leaf->pointers[i])->value;
+            i++;
+        }
+        prefix = 0;
+        if (key_type == BPTREE_KEY_TYPE_STRING) {
+            while (prefix < key_length - 1 && prefix < UINT16_MAX && keys[0][prefix] != '\0'
+                    && keys[0][prefix] == keys[k - 1][prefix])
+                prefix++;
+        }
+        suffix = key_size - prefix;
+        pointers = bpt_snapshot_layout(k, key_size, prefix, true, &node_size);
+        memset(buffer, 0, node_size);
+        n->is_leaf = 1;
+        n->prefix_length = prefix;
+        n->num_keys = k;
+        n->next = l + 1 < count ? offset + node_size : 0;
+        memcpy(buffer + sizeof(bpt_snapshot_node), keys[0], prefix);
+        for (j = 0; j < k; j++)
+            memcpy(buffer + sizeof(bpt_snapshot_node) + prefix + j * suffix, keys[j] + prefix, suffix);
+        memcpy(buffer + pointers, values, k * sizeof(int32_t));
+        memcpy(low_keys + l * key_size, keys[0], key_size);
+        offsets[l] = offset;
+        ok = fwrite(buffer, 1, node_size, fp) == node_size;
+        offset += node_size;
+    }
+    if (count > 0) {
+        header.first_leaf = offsets[0];
+        header.height = 1;
+    }
+
+    /* Internal levels, written over the offsets
+     * and low keys of the level below.
+     */
+    while (count > 1 && ok) {
+        parents = (count + order - 1) / order;
+        per_node = (int)(count / parents);
+        extra = (int)(count % parents);
+        first = 0;
+        next_count = 0;
+        for (p = 0; p < parents && ok; p++) {
+            k = per_node + (p < (uint64_t)extra ? 1 : 0) - 1;
+            pointers = bpt_snapshot_layout(k, key_size, 0, false, &node_size);
+            memset(buffer, 0, node_size);
+            n->is_leaf = 0;
+            n->num_keys = k;
+            n->next = 0;
+            memcpy(buffer + sizeof(bpt_snapshot_node), low_keys + (first + 1) * key_size, k * key_size);
+            memcpy(buffer + pointers, offsets + first, (k + 1) * sizeof(uint64_t));
+            memmove(low_keys + next_count * key_size, low_keys + first * key_size, key_size);
+            offsets[next_count++] = offset;
+            ok = fwrite(buffer, 1, node_size, fp) == node_size;
+            offset += node_size;
+            first += k + 1;
+        }
+        count = next_count;
+        header.height++;
+    }
 
+    if (count == 1)
+        header.root = offsets[0];
+    header.file_size = offset;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, 1, sizeof(header), fp) == sizeof(header);
+
+    free(offsets);
+    free(low_keys);
+    free(buffer);
+    free(zeros);
+    free(keys);
+    free(values);
+    return ok;
+}
@@ -7,11 +7,13 @@
  *  @date 2014-02-14
  *  @version 1.0
  *
- *  B+ tree key can be an integer or a string. The internal key is stored
- *  as string. For example, user input an integer as a key, key length is
- *  8, if key = 4, then the stored tree node key is '00000004'; User input
- *  a string as a key, then the stored tree node key is as the string
- *  that inputted.
+ *  B+ tree key can be an integer or a string. In string key mode the
+ *  internal key is stored as string. For example, user input an integer
+ *  as a key, key length is 8, if key = 4, then the stored tree node key
+ *  is '00000004'; User input a string as a key, then the stored tree node
+ *  key is as the string that inputted.
+ *  In integer key mode the key is stored and compared as a native 64-bit
+ *  integer, no string conversion is done.
  *  Must be compiled with a C99-compliant C compiler such as the latest GCC.
  *
  *****************************************************************************/
@@ -39,6 +41,13 @@
 #   define BPTREE_INTERFACE_API
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <iterator>
+#include "bplustree_latch.h"
+#include "bplustree_epoch.h"
+
 #ifndef NULL
 #   define NULL 0
 #endif
@@ -55,17 +64,96 @@
 #define BPTREE_DEFAULT_ORDER 4
 
 /**
- * Minimum order is necessarily 3.  We set the maximum
- * order arbitrarily.  You may change the maximum order.
+ * Minimum order is necessarily 3.  There is no fixed
+ * maximum order, instead a node may not be larger
+ * than the maximum node size in bytes.
  */
 #define BPTREE_MIN_ORDER 3
-#define BPTREE_MAX_ORDER 30
+#define BPTREE_MAX_NODE_SIZE (1024 * 1024)
+
+/**
+ * Passing order BPTREE_ORDER_AUTO picks the largest
+ * order whose node fits in the node size, so nodes
+ * can be tuned to fit L1/L2 cache lines or pages.
+ * Default node size is one page.
+ */
+#define BPTREE_ORDER_AUTO 0
+#define BPTREE_DEFAULT_NODE_SIZE 4096
+
+/**
+ * Each node is allocated as a single block aligned
+ * to the cache line size, and its size is rounded up
+ * to a multiple of the cache line size, or of the
+ * page size for nodes of a page or more.
+ */
+#define BPTREE_CACHE_LINE_SIZE 64
+#define BPTREE_PAGE_SIZE 4096
 
 /**
  * Default key length is 4
  */
 #define BPTREE_DEFAULT_KEY_LENGTH 4
 
+/**
+ * Key types. Keys are stored as strings of
+ * key length by default, or as native 64-bit
+ * integers in integer key mode.
+ */
+#define BPTREE_KEY_TYPE_STRING 0
+#define BPTREE_KEY_TYPE_INTEGER 1
+
+/**
+ * In integer key mode the search within a node
+ * narrows the range by binary search down to at
+ * most this many keys, which are then counted
+ * by a branch-free SIMD kernel chosen at runtime
+ * (AVX2, SSE4.2 or scalar).  Define BPTREE_NO_SIMD
+ * to always use the scalar kernel.
+ */
+#define BPTREE_SIMD_SEARCH_WINDOW 32
+
+/**
+ * Maximum height of a tree in thread-safe mode,
+ * which bounds the latches a writer holds at once.
+ * A tree of order 3 and this height holds more
+ * than 2^63 keys.
+ */
+#define BPTREE_MAX_HEIGHT 64
+
+/**
+ * Concurrency modes.  With latches readers and
+ * writers latch each node on their way down.
+ * In optimistic mode readers latch nothing and
+ * validate node versions instead, and writers
+ * latch only the leaf they change, falling back
+ * to latching the path for splits and merges.
+ * In copy-on-write mode writers copy the path
+ * they change and publish a new root, so readers
+ * see each version whole without latching.
+ */
+#define BPTREE_CONCURRENCY_NONE 0
+#define BPTREE_CONCURRENCY_LATCH 1
+#define BPTREE_CONCURRENCY_OPTIMISTIC 2
+#define BPTREE_CONCURRENCY_COPY_ON_WRITE 3
+
+/**
+ * Minimum number of pairs per thread of a parallel
+ * bulk load, below which fewer threads are used.
+ */
+#define BPTREE_PARALLEL_MIN_ENTRIES 16384
+
+/**
+ * Number of subtrees a parallel scan aims to cut
+ * its range into per thread, to even out the work.
+ */
+#define BPTREE_SCAN_PARTS_PER_THREAD 4
+
+/**
+ * Number of nodes and records retired in optimistic
+ * mode before the retired ones are reclaimed.
+ */
+#define BPTREE_RECLAIM_THRESHOLD 256
+
 /**
  * Type representing the record
  * to which a given key refers.
@@ -81,6 +169,27 @@ typedef struct record {
     int value;  /**< Value of record.*/
 } record;
 
+/**
+ * Count, sum, minimum and maximum of the values of
+ * the records a parallel scan went over.  Minimum
+ * and maximum are 0 if count is 0.
+ */
+typedef struct scan_result {
+    int64_t count;  /**< Number of records.*/
+    int64_t sum;    /**< Sum of the values.*/
+    int min;        /**< Smallest value.*/
+    int max;        /**< Largest value.*/
+} scan_result;
+
+/**
+ * Function a parallel scan calls for each record,
+ * given the key as iterators return it, the record
+ * and the argument passed to the scan.  It is
+ * called from many threads at once, each going
+ * over its part of the range in key order.
+ */
+typedef void (*scan_callback)( const char * key, record * r, void * arg );
+
 /**
  * Type representing a node in the B+ tree.
  * This type is general enough to serve for both
@@ -102,23 +211,78 @@ typedef struct record {
  * at i + 1 points to the subtree with keys
  * greater than or equal to the key in this
  * node at index i.
+ * A node is one allocation holding this header,
+ * followed by the keys and then the pointers.
+ * The keys of a node are stored inline in one
+ * contiguous block of order - 1 fixed-width
+ * slots.  A slot holds a string key of key
+ * length padded with '\0' in string key mode,
+ * or a 64-bit integer in integer key mode.
  * The num_keys field is used to keep
  * track of the number of valid keys.
  * In an internal node, the number of valid
  * pointers is always num_keys + 1.
  * In a leaf, the number of valid pointers
  * to data is always num_keys.  The
- * last leaf pointer points to the next leaf.
+ * last leaf pointer points to the next leaf,
+ * and prev links back to the previous leaf.
  */
 typedef struct node {
-    void ** pointers;   /**< Array of pointers.*/
-    char ** keys;   /**< Array of keys.*/
+    void ** pointers;   /**< Array of pointers, inside the node block.*/
+    char * keys;    /**< Block of key slots, inside the node block.*/
     struct node * parent; /**< Pointer of parent node.*/
     bool is_leaf;   /**< Leaf node.*/
     int num_keys;   /**< Number of valid keys.*/
-    struct node * next; /**< Used for queue.*/
+    struct node * prev; /**< Previous leaf, in a leaf.*/
+    bpt_latch latch;    /**< Reader/writer latch, used in thread-safe mode.*/
 } node;
 
+/**
+ * Point-in-time view of a B+ tree in copy-on-write
+ * mode: the root published when it was taken, and
+ * the epoch slot it holds, which keeps the nodes
+ * and records reachable from the root from being
+ * freed while the tree changes.
+ */
+typedef struct tree_snapshot {
+    node * root;        /**< Root of the version, NULL if empty.*/
+    uint64_t epoch;     /**< Epoch the view was taken in.*/
+    int slot;           /**< Epoch slot held, -1 if none.*/
+} tree_snapshot;
+
+/**
+ * Interface of the memory the B+ tree takes its nodes
+ * and records from.  By default they are taken from
+ * the heap one by one.
+ */
+class BPTREE_INTERFACE_API BPTreeAllocator
+{
+public:
+    virtual ~BPTreeAllocator() {}
+    
+    /**
+     * Allocates a block.
+     * @param size      Size of the block in bytes
+     * @param alignment Alignment of the block, a power of two
+     * @return      Return the block or NULL on failure.
+     */
+    virtual void * Allocate( size_t size, size_t alignment ) = 0;
+    
+    /**
+     * Frees a block made by Allocate.
+     * @param p         The block
+     * @param size      Size the block was allocated with
+     * @param alignment Alignment the block was allocated with
+     */
+    virtual void Free( void * p, size_t size, size_t alignment ) = 0;
+    
+    /**
+     * Frees every block made by Allocate at once.
+     * @return      Return false if the allocator can not release in bulk.
+     */
+    virtual bool ReleaseAll() { return false; }
+};
+
 /**
  * BPlusTree class.
  */
@@ -127,16 +291,167 @@ class BPTREE_INTERFACE_API BPlusTree
 public:
     /**
      * BPlusTree constructor.
-     * @param nOrder        Order of B+ tree(3~30,Default:4)
-     * @param nKeyLength    Length of key(Default:4)
+     * @param nOrder        Order of B+ tree(>=3 or BPTREE_ORDER_AUTO,Default:4)
+     * @param nKeyLength    Length of key(Default:4), ignored in integer key mode
+     * @param nKeyType      Key type(BPTREE_KEY_TYPE_STRING or BPTREE_KEY_TYPE_INTEGER,Default:string)
+     * @param nNodeSize     Target node size in bytes used by BPTREE_ORDER_AUTO(Default:4096)
      */
-    BPlusTree( int nOrder = BPTREE_DEFAULT_ORDER, int nKeyLength = BPTREE_DEFAULT_KEY_LENGTH );
+    BPlusTree( int nOrder = BPTREE_DEFAULT_ORDER, int nKeyLength = BPTREE_DEFAULT_KEY_LENGTH, int nKeyType = BPTREE_KEY_TYPE_STRING, int nNodeSize = BPTREE_DEFAULT_NODE_SIZE );
     
     /**
      * BPlusTree destructor.
      */
     ~BPlusTree();
 public:
+    /**
+     * Position of a record in a leaf, with the accessors
+     * shared by the forward and the reverse iterators.
+     */
+    class leaf_position
+    {
+    public:
+        record & operator*() const { return *(record *)leaf->pointers[index]; }
+        record * operator->() const { return (record *)leaf->pointers[index]; }
+        
+        /**
+         * Returns the key, a string of key length in string key
+         * mode, or pointing to an int64_t in integer key mode.
+         */
+        const char * GetKey() const { return leaf->keys + index * key_size; }
+        
+        /**
+         * Returns the key in integer key mode.
+         */
+        int64_t GetIntegerKey() const { return *(const int64_t *)GetKey(); }
+        
+        /**
+         * Returns the record.
+         */
+        record * GetRecord() const { return (record *)leaf->pointers[index]; }
+    protected:
+        leaf_position( node * n, int i, int nKeySize ) : leaf(n), index(i), key_size(nKeySize) {}
+        
+        node * leaf;    /**< Current leaf, NULL at the end.*/
+        int index;      /**< Index of the key in the leaf.*/
+        int key_size;   /**< Size of a key slot.*/
+    };
+    
+    /**
+     * Forward iterator over the records of the B+ tree in
+     * key order.  It walks the leaves through their links
+     * to the next leaf, so a scan neither allocates nor
+     * copies.  Iterators are invalidated by Insert, Delete
+     * and DestroyBPTree.
+     */
+    class iterator : public leaf_position
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef record value_type;
+        typedef ptrdiff_t difference_type;
+        typedef record * pointer;
+        typedef record & reference;
+        
+        iterator() : leaf_position(NULL, 0, 0), next_index(0) {}
+        
+        iterator & operator++()
+        {
+            if (++index == leaf->num_keys) {
+                leaf = (node *)leaf->pointers[next_index];
+                index = 0;
+            }
+            return *this;
+        }
+        
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+        
+        bool operator==( const iterator & other ) const { return leaf == other.leaf && index == other.index; }
+        bool operator!=( const iterator & other ) const { return !(*this == other); }
+    private:
+        friend class BPlusTree;
+        iterator( node * n, int i, int nOrder, int nKeySize )
+            : leaf_position(n, i, nKeySize), next_index(nOrder - 1)
+        {
+            if (leaf != NULL && index == leaf->num_keys) {
+                leaf = (node *)leaf->pointers[next_index];
+                index = 0;
+            }
+        }
+        
+        int next_index; /**< Index of the next leaf pointer.*/
+    };
+    
+    /**
+     * Iterator over the records of the B+ tree in descending
+     * key order, walking the leaves through their links to
+     * the previous leaf.  Invalidated as iterator is.
+     */
+    class reverse_iterator : public leaf_position
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef record value_type;
+        typedef ptrdiff_t difference_type;
+        typedef record * pointer;
+        typedef record & reference;
+        
+        reverse_iterator() : leaf_position(NULL, 0, 0) {}
+        
+        reverse_iterator & operator++()
+        {
+            if (--index < 0)
+                to_previous_leaf();
+            return *this;
+        }
+        
+        reverse_iterator operator++(int)
+        {
+            reverse_iterator it = *this;
+            ++*this;
+            return it;
+        }
+        
+        bool operator==( const reverse_iterator & other ) const { return leaf == other.leaf && index == other.index; }
+        bool operator!=( const reverse_iterator & other ) const { return !(*this == other); }
+    private:
+        friend class BPlusTree;
+        reverse_iterator( node * n, int i, int nKeySize )
+            : leaf_position(n, i, nKeySize)
+        {
+            if (leaf != NULL && index < 0)
+                to_previous_leaf();
+        }
+        
+        void to_previous_leaf()
+        {
+            leaf = leaf->prev;
+            index = leaf != NULL ? leaf->num_keys - 1 : 0;
+        }
+    };
+    
+    /**
+     * Pair of iterators over the records with keys in
+     * a range, usable in a range-based for loop.
+     */
+    template <class Iterator>
+    class basic_range
+    {
+    public:
+        basic_range( Iterator first, Iterator last ) : first_it(first), last_it(last) {}
+        Iterator begin() const { return first_it; }
+        Iterator end() const { return last_it; }
+    private:
+        Iterator first_it;
+        Iterator last_it;
+    };
+    typedef basic_range<iterator> range;
+    typedef basic_range<reverse_iterator> reverse_range;
+    
     /**
      * Inserts a key and an associated value into
      * the B+ tree, causing the tree to be adjusted
@@ -218,14 +533,321 @@ public:
      */
     void FindAndPrint( int key, bool verbose );
     
+    /**
+     * Returns the order of B+ tree.
+     */
+    int GetOrder();
+    
     /**
      * Sets the verbose value.
      * @param verbose   Causes the pointer addresses to be printed out in hexadecimal notation next to their corresponding keys
      */
     void SetVerbose( bool verbose );
+    
+    /**
+     * Finds the value to which a key refers.  Unlike Find,
+     * the value is copied out while the leaf is latched,
+     * so it is safe against a concurrent Delete of the key
+     * in thread-safe mode.
+     * @param key       The key
+     * @param value     Receives the value
+     * @return      Return false if not found.
+     */
+    bool FindValue( char * key, int * value );
+    bool FindValue( int key, int * value );
+    
+    /**
+     * Turns thread-safe mode on or off.  In thread-safe mode
+     * Insert, Delete, Find and FindValue can be called from
+     * many threads at once: they descend the tree latching
+     * each node, readers shared and writers exclusive, and
+     * a writer releases the latches of the ancestors as soon
+     * as the child it latched can not split or underflow.
+     * Printing, iterators, BulkLoad and DestroyBPTree are not
+     * latched and must not run alongside writers, the record
+     * Find returns may be freed by a concurrent Delete, and
+     * the allocator, if set, must be safe to call from many
+     * threads (BPTreeArena is not).  Must be set while no
+     * other thread uses the tree.
+     * @param thread_safe   Turns thread-safe mode on
+     */
+    void SetThreadSafe( bool thread_safe );
+    
+    /**
+     * Sets the concurrency mode.  BPTREE_CONCURRENCY_LATCH is
+     * the thread-safe mode of SetThreadSafe.  In
+     * BPTREE_CONCURRENCY_OPTIMISTIC mode Find and FindValue
+     * write nothing shared: they note the version of each
+     * node, read it and validate the version, restarting
+     * from the root if a writer changed the node meanwhile.
+     * Insert and Delete find the leaf the same way and latch
+     * only the leaf; when it would split or underflow they
+     * latch the path as in thread-safe mode.  Nodes and
+     * records removed in optimistic mode may still be read,
+     * so they are retired and freed only once every thread
+     * that was in the tree when they were removed has left
+     * it.  The same restrictions as for SetThreadSafe apply,
+     * and at most BPTREE_EPOCH_SLOTS threads are in the tree
+     * at once.
+     * In BPTREE_CONCURRENCY_COPY_ON_WRITE mode a node is never
+     * changed once readers can reach it.  Insert and Delete,
+     * one at a time, copy the path from the root to the leaf
+     * and the neighbors they change, make the change on the
+     * copies and publish the new root, and the nodes copied
+     * are retired as in optimistic mode.  Find, FindValue
+     * and the snapshots of TakeSnapshot read a version whole
+     * without latches.  Leaf links and parent pointers are
+     * kept for the newest version only, so iterators and
+     * ParallelScan walk the newest version and must not run
+     * alongside writers.
+     * @param nMode     BPTREE_CONCURRENCY_NONE, BPTREE_CONCURRENCY_LATCH, BPTREE_CONCURRENCY_OPTIMISTIC or BPTREE_CONCURRENCY_COPY_ON_WRITE
+     */
+    void SetConcurrency( int nMode );
+
+    /**
+     * Takes a snapshot of the tree in copy-on-write mode: the
+     * version published last, which lookups and scans of the
+     * snapshot read, unchanged by later writers, until it is
+     * released.  A snapshot holds one of the
+     * BPTREE_EPOCH_SLOTS epoch slots, and the nodes and records
+     * retired while it is held are kept until it is released.
+     * In other modes the snapshot is empty.
+     * @return      Return the snapshot, to pass to ReleaseSnapshot.
+     */
+    tree_snapshot TakeSnapshot();
+
+    /**
+     * Releases a snapshot.
+     * @param snapshot  The snapshot
+     */
+    void ReleaseSnapshot( tree_snapshot * snapshot );
+
+    /**
+     * Finds the value to which a key refers in a snapshot.
+     * @param snapshot  The snapshot
+     * @param key       The key
+     * @param value     Receives the value
+     * @return      Return false if not found.
+     */
+    bool FindValue( const tree_snapshot * snapshot, char * key, int * value );
+    bool FindValue( const tree_snapshot * snapshot, int key, int * value );
+
+    /**
+     * Scans the records of a snapshot with keys from lo to
+     * hi in key order, on the calling thread, while writers
+     * go on.  Leaf links belong to the newest version, so the
+     * next leaf is found from the path to the last one.
+     * @param snapshot  The snapshot
+     * @param lo        The smallest key
+     * @param hi        The largest key
+     * @param fn        Function called for each record, or NULL(Default:NULL)
+     * @param arg       Argument passed to fn(Default:NULL)
+     * @return      Return the count, sum, minimum and maximum of the values.
+     */
+    scan_result Scan( const tree_snapshot * snapshot, char * lo, char * hi, scan_callback fn = NULL, void * arg = NULL );
+    scan_result Scan( const tree_snapshot * snapshot, int lo, int hi, scan_callback fn = NULL, void * arg = NULL );
+    
+    /**
+     * Returns an iterator to the record of the smallest key.
+     */
+    iterator Begin();
+    
+    /**
+     * Returns the iterator past the record of the largest key.
+     */
+    iterator End();
+    
+    /**
+     * Returns an iterator to the record of the first key
+     * not less than key, or End() if there is none.
+     * @param key       The key
+     */
+    iterator LowerBound( char * key );
+    iterator LowerBound( int key );
+    
+    /**
+     * Returns an iterator to the record of the first key
+     * greater than key, or End() if there is none.
+     * @param key       The key
+     */
+    iterator UpperBound( char * key );
+    iterator UpperBound( int key );
+    
+    /**
+     * Returns the records with keys from lo to hi, inclusive,
+     * in key order.  The range is empty if lo is greater than hi.
+     * @param lo        The smallest key
+     * @param hi        The largest key
+     */
+    range Range( char * lo, char * hi );
+    range Range( int lo, int hi );
+    
+    /**
+     * Returns a reverse iterator to the record of the largest key.
+     */
+    reverse_iterator RBegin();
+    
+    /**
+     * Returns the reverse iterator past the record of the smallest key.
+     */
+    reverse_iterator REnd();
+    
+    /**
+     * Returns the records with keys from hi down to lo,
+     * inclusive, in descending key order, such as the
+     * latest entries of time ordered keys.  The range is
+     * empty if lo is greater than hi.
+     * @param hi        The largest key
+     * @param lo        The smallest key
+     * @param limit     Maximum number of records, 0 for no limit(Default:0)
+     */
+    reverse_range RangeDescending( char * hi, char * lo, int limit = 0 );
+    reverse_range RangeDescending( int hi, int lo, int limit = 0 );
+    
+    /**
+     * Scans the records with keys from lo to hi on many
+     * threads.  The range is cut into parts at the subtrees
+     * of the first level under the root that has a few per
+     * thread, and each thread walks the leaves of its
+     * parts.  The count, sum, minimum and maximum of the
+     * values are reduced from the parts, and fn, if given,
+     * is called for each record.  Not latched, so it must
+     * not run alongside writers.
+     * @param lo            The smallest key
+     * @param hi            The largest key
+     * @param fn            Function called for each record, or NULL(Default:NULL)
+     * @param arg           Argument passed to fn(Default:NULL)
+     * @param num_threads   Number of threads, 0 for one per processor(Default:0)
+     * @return      Return the count, sum, minimum and maximum of the values.
+     */
+    scan_result ParallelScan( char * lo, char * hi, scan_callback fn = NULL, void * arg = NULL, int num_threads = 0 );
+    scan_result ParallelScan( int lo, int hi, scan_callback fn = NULL, void * arg = NULL, int num_threads = 0 );
+    
+    /**
+     * Writes a read-only snapshot of the tree for
+     * BPTreeSnapshot to map: the records packed into full
+     * leaves in key order, with the prefix of the string
+     * keys of a leaf stored once, and internal levels built
+     * over them, linked by file offsets instead of pointers.
+     * The snapshot is written beside path and renamed over
+     * it, so processes mapping an older snapshot at path keep
+     * reading it.  Not latched, so it must not run alongside
+     * writers.
+     * @param path      Path of the snapshot
+     * @return      Return false on an I/O error.
+     */
+    bool SaveSnapshot( const char * path );
+    
+    /**
+     * Sets the allocator nodes and records are taken from.
+     * The tree does not own the allocator, which must outlive
+     * the tree.  An allocator that releases in bulk, such as
+     * BPTreeArena, must serve this tree only, and then
+     * DestroyBPTree releases it instead of walking the tree.
+     * @param pAllocator    The allocator, or NULL for the heap
+     * @return      Return false if the tree is not empty.
+     */
+    bool SetAllocator( BPTreeAllocator * pAllocator );
+    
+    /**
+     * Builds the B+ tree from a range of key/value pairs
+     * sorted by key, bottom-up in one pass: the leaves are
+     * packed in order, then each internal level is built
+     * over the level below, without descending the tree
+     * for each key.  Keys after the first of equal keys
+     * are ignored, as by Insert.  The tree must be empty.
+     * @param first         First pair, whose first member is the key(int or string) and second the value
+     * @param last          End of the range
+     * @param fill_factor   Fraction of each node to fill, in (0, 1](Default:1)
+     * @param presort       Sorts the pairs before loading, so the range needs not be sorted(Default:false)
+     * @return      Return false if the tree is not empty, or the range is not sorted and presort is false; the tree is left empty.
+     */
+    template <class InputIterator>
+    bool BulkLoad( InputIterator first, InputIterator last, double fill_factor = 1.0, bool presort = false )
+    {
+        if (!begin_bulk_load(fill_factor, presort))
+            return false;
+        for (; first != last; ++first)
+            bulk_load_add((*first).first, (*first).second);
+        return end_bulk_load();
+    }
+    
+    /**
+     * Builds the B+ tree from a range of key/value pairs as
+     * BulkLoad does, on many threads.  The pairs are copied
+     * into a buffer, which with presort is sorted by sorting
+     * one run per thread and merging the runs pairwise.  The
+     * distinct keys are then cut into the same leaves as
+     * BulkLoad makes, and each thread builds and links the
+     * leaves of a disjoint run of them.  The runs are
+     * stitched into one leaf chain, and the internal levels
+     * are built over it.  With an allocator set the leaves
+     * are built on one thread, since the allocator needs not
+     * be safe to call from many.  The tree must be empty.
+     * @param first         First pair, whose first member is the key(int or string) and second the value
+     * @param last          End of the range
+     * @param num_threads   Number of threads, 0 for one per processor(Default:0)
+     * @param fill_factor   Fraction of each node to fill, in (0, 1](Default:1)
+     * @param presort       Sorts the pairs before loading, so the range needs not be sorted(Default:false)
+     * @return      Return false if the tree is not empty, or the range is not sorted and presort is false; the tree is left empty.
+     */
+    template <class InputIterator>
+    bool ParallelBulkLoad( InputIterator first, InputIterator last, int num_threads = 0, double fill_factor = 1.0, bool presort = false )
+    {
+        if (!begin_bulk_load(fill_factor, true))
+            return false;
+        for (; first != last; ++first)
+            bulk_load_add((*first).first, (*first).second);
+        return end_parallel_bulk_load(num_threads, presort);
+    }
 private:
-    void enqueue( node * new_node );
-    node * dequeue( void );
+    friend class ShardedBPlusTree;
+    char * format_key( int key );
+    char * make_key( char * key, int64_t * num );
+    char * key_at( node * n, int index );
+    int compare_keys( const char * a, const char * b );
+    void store_key( char * dest, const char * src );
+    void store_separator( char * dest, const char * left, const char * right );
+    void print_key( const char * key );
+    int lower_bound( node * n, const char * key );
+    int upper_bound( node * n, const char * key );
+    iterator lower_bound_iterator( char * key );
+    iterator upper_bound_iterator( char * key );
+    range make_range( char * lo, char * hi );
+    reverse_iterator last_at_most( char * key );
+    reverse_iterator last_less_than( char * key );
+    reverse_range make_reverse_range( char * hi, char * lo, int limit );
+    
+    /**
+     * Queue of nodes for printing the tree level
+     * by level, local to each print so printing
+     * changes nothing in the tree.
+     */
+    typedef struct node_queue {
+        node ** items;
+        int head;
+        int tail;
+        int capacity;
+    } node_queue;
+    
+    /**
+     * Latches held by a writer in thread-safe mode in
+     * the order they were taken, whether it holds the
+     * root latch, and the nodes it freed, which are only
+     * released once the latches are released.  In
+     * copy-on-write mode the nodes freed include those
+     * copied, on the path and beside it.
+     */
+    typedef struct latch_path {
+        bool root_latched;
+        node * latched[2 * BPTREE_MAX_HEIGHT];
+        int num_latched;
+        node * freed[3 * BPTREE_MAX_HEIGHT + 1];
+        int num_freed;
+    } latch_path;
+    
+    void enqueue( node_queue * queue, node * new_node );
+    node * dequeue( node_queue * queue );
     int height( node * root );
     int path_to_root( node * root, node * child );
     void print_leaves( node * root );
@@ -235,12 +857,42 @@ private:
     record * Find( node * root, char * key, bool verbose );
     int cut( int length );
     
+    node * insert_key( char * key, int value );
+    node * delete_key( char * key );
+    record * find_key( char * key, bool verbose );
+    bool find_value( char * key, int * value );
+    node * find_leaf_latched( char * key );
+    bool insert_safe( node * n );
+    bool delete_safe( node * n, node * root );
+    void latch_node( latch_path * path, node * n );
+    void release_ancestors( latch_path * path );
+    void release_path( latch_path * path );
+    node * insert_latched( char * key, int value );
+    node * delete_latched( char * key );
+    node * find_leaf_optimistic( char * key, uint64_t * version );
+    record * find_optimistic( char * key );
+    node * insert_optimistic( char * key, int value );
+    node * delete_optimistic( char * key );
+    node * copy_node( node * n, node * parent, int index, latch_path * path );
+    node * copy_path( node ** root, char * key, latch_path * path );
+    node * insert_cow( char * key, int value );
+    node * delete_cow( char * key );
+    node * published_root( void );
+    scan_result snapshot_scan( node * root, char * lo, char * hi, scan_callback fn, void * arg );
+    void retire( void * p, bool is_node );
+    void reclaim_retired( void );
+    void free_retired( void );
+    
+    int node_layout( int nOrder, int * pointers_offset );
     record * make_record( int value );
     node * make_node( void );
     node * make_leaf( void );
+    void free_node( node * n );
+    void free_record( record * r );
+    void retire_node( node * n, latch_path * path );
     int get_left_index( node * parent, node * left );
-    node * insert_into_leaf( node * leaf, char * key, record * pointer );
-    node * insert_into_leaf_after_splitting( node * root, node * leaf, char * key, record * pointer );
+    node * insert_into_leaf( node * leaf, int insertion_point, char * key, record * pointer );
+    node * insert_into_leaf_after_splitting( node * root, node * leaf, int insertion_index, char * key, record * pointer );
     node * insert_into_node( node * root, node * parent, int left_index, char * key, node * right );
     node * insert_into_node_after_splitting( node * root, node * parent, int left_index, char * key, node * right );
     node * insert_into_parent( node * root, node * left, char * key, node * right );
@@ -249,15 +901,33 @@ private:
     node * Insert( node * root, char * key, int value );
     
     int get_neighbor_index( node * n );
-    node * adjust_root( node * root );
-    node * coalesce_nodes( node * root, node * n, node * neighbor, int neighbor_index, char * k_prime );
+    node * adjust_root( node * root, latch_path * path );
+    node * coalesce_nodes( node * root, node * n, node * neighbor, int neighbor_index, int k_prime_index, char * k_prime, latch_path * path );
     node * redistribute_nodes( node * root, node * n, node * neighbor, int neighbor_index, int k_prime_index, char * k_prime );
-    node * delete_entry( node * root, node * n, char * key, void * pointer );
-    node * remove_entry_from_node( node * n, char * key, node * pointer );
+    node * delete_entry( node * root, node * n, int index, latch_path * path );
+    node * remove_entry_from_node( node * n, int index );
     node * Delete(node * root, char * key);
     
     node * destroy_tree( node * root );
     void destroy_tree_nodes( node * root );
+    
+    struct bulk_key_less;
+    bool begin_bulk_load( double fill_factor, bool presort );
+    void bulk_load_add( int key, int value );
+    void bulk_load_add( const char * key, int value );
+    void bulk_load_add_key( char * key, int value );
+    void bulk_load_append( char * key, int value );
+    size_t bulk_load_level( size_t num_children );
+    node * bulk_low_leaf( node * n );
+    bool end_bulk_load( void );
+    struct parallel_bulk;
+    static void parallel_bulk_task( void * arg, int index );
+    size_t parallel_leaf_start( parallel_bulk * job, size_t leaf );
+    bool end_parallel_bulk_load( int num_threads, bool presort );
+    struct parallel_scan_job;
+    static void parallel_scan_task( void * arg, int index );
+    scan_result parallel_scan( char * lo, char * hi, scan_callback fn, void * arg, int num_threads );
+    bool write_snapshot( FILE * fp );
 private:
     /**
      * Order of B+ tree.
@@ -269,6 +939,35 @@ private:
      */
     int key_length;
     
+    /**
+     * Type of key.
+     */
+    int key_type;
+    
+    /**
+     * Size in bytes of a key slot in a node.
+     */
+    int key_size;
+    
+    /**
+     * Kernel counting the integer keys less than or
+     * equal to a key, chosen by CPU features.
+     */
+    int (*count_keys_le)( const int64_t * keys, int n, int64_t key );
+    
+    /**
+     * Size in bytes of a node block, its alignment,
+     * and offset of the pointers array in the block.
+     */
+    int node_size;
+    int node_alignment;
+    int pointers_offset;
+    
+    /**
+     * Allocator of nodes and records, NULL for the heap.
+     */
+    BPTreeAllocator * allocator;
+    
     /**
      * The user can toggle on and off the "verbose"
      * property, which causes the pointer addresses
@@ -278,17 +977,58 @@ private:
     bool verbose_output;
     
     /**
-     * The queue is used to print the tree in
-     * level order, starting from the root
-     * printing each entire rank on a separate
-     * line, finishing with the leaves.
+     * The root node of B+ tree.
      */
-    node * queue;
+    node * root_node;
     
     /**
-     * The root node of B+ tree.
+     * Concurrency mode, and in thread-safe modes the
+     * latch guarding root_node, taken as if it were
+     * the parent of the root.
      */
-    node * root_node;
+    int concurrency;
+    bpt_latch root_latch;
+    
+    /**
+     * Nodes and records removed in optimistic mode, each
+     * with the epoch it was retired in, kept until no
+     * reader can reach them, the latch guarding the list,
+     * and the length at which the list is reclaimed next.
+     */
+    typedef struct retired_block {
+        void * p;
+        bool is_node;
+        uint64_t epoch;
+    } retired_block;
+    retired_block * retired;
+    size_t num_retired;
+    size_t retired_capacity;
+    size_t reclaim_at;
+    bpt_latch retired_latch;
+    
+    /**
+     * Epochs of the threads in the tree in optimistic mode.
+     */
+    bpt_epoch epochs;
+    
+    /**
+     * State of a bulk load in progress.  The leaves are
+     * built into nodes as the keys come, and with presort
+     * the keys and values are first buffered to be sorted.
+     */
+    struct {
+        int leaf_fill;      /**< Keys per leaf.*/
+        int node_fill;      /**< Children per internal node.*/
+        bool presort;       /**< Buffer and sort the keys.*/
+        bool failed;        /**< The keys were not sorted.*/
+        node ** nodes;      /**< Leaves built, then each internal level.*/
+        size_t num_nodes;
+        size_t nodes_capacity;
+        char * keys;        /**< Buffered key slots.*/
+        int * values;       /**< Buffered values.*/
+        size_t num_entries;
+        size_t entries_capacity;
+    } bulk;
 };
 
 #endif
@@ -0,0 +1,156 @@
+#include "bplustree_arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef BPTREE_OS_WINDOWS
+#include <malloc.h>
+#endif
+
+BPTreeArena::BPTreeArena( size_t nSlabSize/* = BPTREE_ARENA_SLAB_SIZE*/ )
+{
+    slab_size = nSlabSize;
+    reserved_bytes = 0;
+    classes = NULL;
+}
+
+BPTreeArena::~BPTreeArena()
+{
+    ReleaseAll();
+}
+
+/* Takes a block from the free list of its size
+ * class, or else carves it out of the current
+ * slab of the class, adding a slab when the
+ * current one is used up.
+ */
+void * BPTreeArena::Allocate( size_t size, size_t alignment )
+{
+    size_class * c;
+    void * p;
+
+    c = find_class(size, alignment);
+    if (c == NULL)
+        return NULL;
+    if (c->free_list != NULL) {
+        p = c->free_list;
+        c->free_list = c->free_list->next;
+        return p;
+    }
+    if (c->cursor == c->limit && !add_slab(c))
+        return NULL;
+    p = c->cursor;
+    c->cursor += c->size;
+    return p;
+}
+
+/* Puts a block back on the free list of its
+ * size class, for the next Allocate of the
+ * same size to reuse.
+ */
+void BPTreeArena::Free( void * p, size_t size, size_t alignment )
+{
+    size_class * c;
+    free_block * b;
+
+    if (p == NULL)
+        return;
+    c = find_class(size, alignment);
+    if (c == NULL)
+        return;
+    b = (free_block *)p;
+    b->next = c->free_list;
+    c->free_list = b;
+}
+
+/* Frees all slabs of all size classes.  Every
+ * block the arena handed out is gone after this.
+ */
+bool BPTreeArena::ReleaseAll()
+{
+    size_class * c;
+    char * slab, * previous;
+
+    while (classes != NULL) {
+        c = classes;
+        classes = c->next;
+        slab = c->slabs;
+        while (slab != NULL) {
+            memcpy(&previous, slab + c->slab_bytes, sizeof(char *));
+#ifdef BPTREE_OS_WINDOWS
+            _aligned_free(slab);
+#else
+            free(slab);
+#endif
+            slab = previous;
+        }
+        free(c);
+    }
+    reserved_bytes = 0;
+    return true;
+}
+
+size_t BPTreeArena::GetReservedBytes()
+{
+    return reserved_bytes;
+}
+
+/* Finds the size class of blocks of the given size
+ * and alignment, creating it if needed.  The block
+ * size is rounded up to a multiple of the alignment
+ * and of the pointer size, so every block of a slab
+ * aligned to the alignment is aligned too and can
+ * hold the free list link.
+ */
+BPTreeArena::size_class * BPTreeArena::find_class( size_t size, size_t alignment )
+{
+    size_class * c;
+
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+    size = (size + alignment - 1) / alignment * alignment;
+    for (c = classes; c != NULL; c = c->next)
+        if (c->size == size && c->alignment == alignment)
+            return c;
+
+    c = (size_class *)malloc(sizeof(size_class));
+    if (c == NULL)
+        return NULL;
+    c->size = size;
+    c->alignment = alignment;
+    c->slab_bytes = (slab_size > sizeof(char *) ? slab_size - sizeof(char *) : 0) / size * size;
+    if (c->slab_bytes < BPTREE_ARENA_MIN_BLOCKS * size)
+        c->slab_bytes = BPTREE_ARENA_MIN_BLOCKS * size;
+    c->cursor = NULL;
+    c->limit = NULL;
+    c->slabs = NULL;
+    c->free_list = NULL;
+    c->next = classes;
+    classes = c;
+    return c;
+}
+
+/* Adds a slab to a size class.  The slab holds the
+ * blocks followed by the link to the previous slab
+ * of the class.
+ */
+bool BPTreeArena::add_slab( size_class * c )
+{
+    size_t bytes;
+    char * slab;
+
+    bytes = c->slab_bytes + sizeof(char *);
+#ifdef BPTREE_OS_WINDOWS
+    slab = (char *)_aligned_malloc(bytes, c->alignment);
+#else
+    if (posix_memalign((void **)&slab, c->alignment, bytes) != 0)
+        slab = NULL;
+#endif
+    if (slab == NULL)
+        return false;
+    memcpy(slab + c->slab_bytes, &c->slabs, sizeof(char *));
+    c->slabs = slab;
+    c->cursor = slab;
+    c->limit = slab + c->slab_bytes;
+    reserved_bytes += bytes;
+    return true;
+}
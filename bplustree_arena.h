@@ -0,0 +1,99 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Slab Arena
+ *
+ *  @file bplustree_arena.h
+ *
+ *  Size class slab arena for the nodes and records of a B+ tree.  Blocks
+ *  are carved out of large slabs, blocks freed by the tree (for example
+ *  the nodes released by coalescing) go to a free list of their size
+ *  class and are reused, and the whole arena can be released at once,
+ *  which turns destroying a tree into freeing a handful of slabs.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_ARENA_HEADER
+#define _BPLUSTREE_ARENA_HEADER
+
+#include "bplustree.h"
+
+/**
+ * Default size of a slab is 64KB.  A slab always
+ * holds at least BPTREE_ARENA_MIN_BLOCKS blocks.
+ */
+#define BPTREE_ARENA_SLAB_SIZE (64 * 1024)
+#define BPTREE_ARENA_MIN_BLOCKS 8
+
+/**
+ * BPTreeArena class.
+ * Blocks are grouped in size classes by their size
+ * rounded up to a multiple of the alignment and of
+ * the pointer size.  Each class carves its blocks
+ * out of its own slabs and keeps a free list of
+ * the blocks freed.
+ */
+class BPTREE_INTERFACE_API BPTreeArena : public BPTreeAllocator
+{
+public:
+    /**
+     * BPTreeArena constructor.
+     * @param nSlabSize     Size in bytes of a slab(Default:64KB)
+     */
+    BPTreeArena( size_t nSlabSize = BPTREE_ARENA_SLAB_SIZE );
+
+    /**
+     * BPTreeArena destructor, releases all slabs.
+     */
+    ~BPTreeArena();
+public:
+    void * Allocate( size_t size, size_t alignment );
+    void Free( void * p, size_t size, size_t alignment );
+    bool ReleaseAll();
+
+    /**
+     * Returns the number of bytes held in slabs.
+     */
+    size_t GetReservedBytes();
+private:
+    /**
+     * Free block, linked in the free list of its class.
+     */
+    typedef struct free_block {
+        struct free_block * next;
+    } free_block;
+
+    /**
+     * Size class.  The slabs of a class all hold
+     * slab_bytes of blocks, followed by the link to
+     * the previous slab of the class.
+     */
+    typedef struct size_class {
+        size_t size;        /**< Size of the blocks.*/
+        size_t alignment;   /**< Alignment of the slabs.*/
+        size_t slab_bytes;  /**< Bytes of blocks in a slab.*/
+        char * cursor;      /**< Next unused block in the current slab.*/
+        char * limit;       /**< End of the blocks of the current slab.*/
+        char * slabs;       /**< Current slab, NULL if none.*/
+        free_block * free_list; /**< Blocks freed.*/
+        struct size_class * next;
+    } size_class;
+
+    size_class * find_class( size_t size, size_t alignment );
+    bool add_slab( size_class * c );
+private:
+    /**
+     * Size in bytes of a slab.
+     */
+    size_t slab_size;
+
+    /**
+     * Number of bytes held in slabs.
+     */
+    size_t reserved_bytes;
+
+    /**
+     * The size classes.
+     */
+    size_class * classes;
+};
+
+#endif
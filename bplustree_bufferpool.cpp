@@ -0,0 +1,741 @@
+#include "bplustree_bufferpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 2Q queue of a frame.
+ */
+#define POOL_QUEUE_NONE 0
+#define POOL_QUEUE_A1IN 1
+#define POOL_QUEUE_AM 2
+
+static inline int pool_hash( uint32_t page, int mask )
+{
+    return (int)((page * 2654435761u) >> 7) & mask;
+}
+
+BPTreeBufferPool::BPTreeBufferPool( BPTreePageFile * pFile, int nFrames, int nPolicy/* = BPTREE_EVICT_CLOCK*/ )
+{
+    int i, n;
+
+    file = pFile;
+    page_size = pFile->GetPageSize();
+    policy = nPolicy;
+    if (policy != BPTREE_EVICT_LRU_K && policy != BPTREE_EVICT_2Q)
+        policy = BPTREE_EVICT_CLOCK;
+    num_frames = nFrames < BPTREE_POOL_MIN_FRAMES ? BPTREE_POOL_MIN_FRAMES : nFrames;
+    base_frames = num_frames;
+    for (n = 1; n < num_frames; n *= 2)
+        ;
+    bucket_mask = n - 1;
+    num_ghosts = num_frames / 2;
+    a1in_max = num_frames / 4;
+
+    frames = (pool_frame *)calloc(num_frames, sizeof(pool_frame));
+    buckets = (int *)malloc(n * sizeof(int));
+    ghosts = (uint32_t *)malloc(num_ghosts * sizeof(uint32_t));
+    ghost_next = (int *)malloc(num_ghosts * sizeof(int));
+    ghost_buckets = (int *)malloc(n * sizeof(int));
+    write_buffer = (char *)malloc(page_size);
+    if (frames == NULL || buckets == NULL || ghosts == NULL || ghost_next == NULL
+            || ghost_buckets == NULL || write_buffer == NULL) {
+        perror("Buffer pool creation.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_frames; i++) {
+        frames[i].data = (char *)malloc(page_size);
+        if (frames[i].data == NULL) {
+            perror("Buffer pool creation.");
+            exit(EXIT_FAILURE);
+        }
+        frames[i].page = BPTREE_PAGE_NULL;
+        frames[i].hash_next = i + 1 < num_frames ? i + 1 : -1;
+    }
+    for (i = 0; i < n; i++) {
+        buckets[i] = -1;
+        ghost_buckets[i] = -1;
+    }
+    for (i = 0; i < num_ghosts; i++)
+        ghosts[i] = BPTREE_PAGE_NULL;
+    free_frames = 0;
+    ghost_pos = 0;
+    clock_hand = 0;
+    clock = 0;
+    a1in.head = a1in.tail = -1;
+    a1in.count = 0;
+    am.head = am.tail = -1;
+    am.count = 0;
+    resident_count = 0;
+    resident_max = num_frames * 3 / 4;
+    no_steal = false;
+    checkpointing = false;
+    dirty_count = 0;
+    writes_in_flight = 0;
+    write_failed = false;
+    hits = 0;
+    misses = 0;
+    stopping = false;
+
+    bpt_mutex_init(&mutex);
+    bpt_cond_init(&wake);
+    bpt_cond_init(&done);
+    bpt_cond_init(&released);
+    bpt_thread_start(&writer, writer_task, this);
+}
+
+BPTreeBufferPool::~BPTreeBufferPool()
+{
+    int i;
+
+    bpt_mutex_lock(&mutex);
+    stopping = true;
+    bpt_cond_broadcast(&wake);
+    bpt_mutex_unlock(&mutex);
+    bpt_thread_join(&writer);
+    if (!no_steal)
+        FlushAll();
+    bpt_cond_destroy(&wake);
+    bpt_cond_destroy(&done);
+    bpt_cond_destroy(&released);
+    bpt_mutex_destroy(&mutex);
+
+    for (i = 0; i < num_frames; i++)
+        free(frames[i].data);
+    free(frames);
+    free(buckets);
+    free(ghosts);
+    free(ghost_next);
+    free(ghost_buckets);
+    free(write_buffer);
+}
+
+/* Pins a cached page, or reads it into a free
+ * frame or the frame of the victim chosen by the
+ * policy, sparing resident pages if any other
+ * can go.  A dirty victim is written first.  In
+ * no-steal mode dirty pages are not victims; if
+ * no page can go, the pin waits for the pages of
+ * a checkpoint under way to be unpinned, as the
+ * checkpoint does not need the pool to end, and
+ * with none under way a frame is added, to be
+ * given back at the end of the next checkpoint.
+ * The page may be read by another pin while one
+ * waits, so the lookup is made again.
+ */
+char * BPTreeBufferPool::Pin( uint32_t page )
+{
+    int f;
+
+    bpt_mutex_lock(&mutex);
+    for (;;) {
+        f = lookup(page);
+        if (f >= 0) {
+            frames[f].pin_count++;
+            touch(f);
+            hits++;
+            bpt_mutex_unlock(&mutex);
+            return frames[f].data;
+        }
+        if (free_frames >= 0) {
+            f = free_frames;
+            free_frames = frames[f].hash_next;
+            break;
+        }
+        f = choose_victim(true);
+        if (f < 0)
+            f = choose_victim(false);
+        if (f >= 0) {
+            if (frames[f].dirty && !write_frame(f)) {
+                bpt_mutex_unlock(&mutex);
+                return NULL;
+            }
+            retire(f);
+            break;
+        }
+        if (!no_steal) {
+            bpt_mutex_unlock(&mutex);
+            return NULL;
+        }
+        if (!checkpointing) {
+            f = grow();
+            break;
+        }
+        bpt_cond_wait(&released, &mutex, -1);
+    }
+    misses++;
+
+    if (!file->ReadPage(page, frames[f].data)) {
+        frames[f].page = BPTREE_PAGE_NULL;
+        frames[f].hash_next = free_frames;
+        free_frames = f;
+        bpt_mutex_unlock(&mutex);
+        return NULL;
+    }
+    frames[f].page = page;
+    frames[f].pin_count = 1;
+    frames[f].dirty = false;
+    frames[f].resident = false;
+    hash_insert(f);
+    admit(f);
+    bpt_mutex_unlock(&mutex);
+    return frames[f].data;
+}
+
+/* Unpins a page.  The writer thread is woken
+ * once half the frames are dirty.
+ */
+void BPTreeBufferPool::Unpin( uint32_t page, bool dirty, bool resident )
+{
+    int f;
+
+    bpt_mutex_lock(&mutex);
+    f = lookup(page);
+    if (f < 0) {
+        bpt_mutex_unlock(&mutex);
+        return;
+    }
+    frames[f].pin_count--;
+    if (dirty && !frames[f].dirty) {
+        frames[f].dirty = true;
+        dirty_count++;
+        if (dirty_count > num_frames / 2 && !no_steal)
+            bpt_cond_broadcast(&wake);
+    }
+    if (resident && !frames[f].resident && resident_count < resident_max) {
+        frames[f].resident = true;
+        resident_count++;
+    }
+    else if (!resident && frames[f].resident) {
+        frames[f].resident = false;
+        resident_count--;
+    }
+    bpt_mutex_unlock(&mutex);
+}
+
+/* Waits for the writes of the writer thread first,
+ * so none of them lands after a newer version of
+ * its page written here.
+ */
+bool BPTreeBufferPool::FlushAll()
+{
+    bool failed;
+    int f;
+
+    bpt_mutex_lock(&mutex);
+    while (writes_in_flight > 0)
+        bpt_cond_wait(&done, &mutex, -1);
+    for (f = 0; f < num_frames; f++) {
+        if (frames[f].page != BPTREE_PAGE_NULL && frames[f].dirty)
+            write_frame(f);
+    }
+    failed = write_failed;
+    write_failed = false;
+    bpt_mutex_unlock(&mutex);
+    return !failed;
+}
+
+void BPTreeBufferPool::SetNoSteal( bool no_steal )
+{
+    bpt_mutex_lock(&mutex);
+    this->no_steal = no_steal;
+    bpt_mutex_unlock(&mutex);
+}
+
+int BPTreeBufferPool::BeginCheckpoint( uint32_t ** pages, char ** data )
+{
+    int f, n = 0;
+
+    bpt_mutex_lock(&mutex);
+    while (writes_in_flight > 0)
+        bpt_cond_wait(&done, &mutex, -1);
+    *pages = (uint32_t *)malloc((dirty_count > 0 ? dirty_count : 1) * sizeof(uint32_t));
+    *data = (char *)malloc((dirty_count > 0 ? dirty_count : 1) * (size_t)page_size);
+    if (*pages == NULL || *data == NULL) {
+        perror("Checkpoint.");
+        exit(EXIT_FAILURE);
+    }
+    for (f = 0; f < num_frames; f++) {
+        if (frames[f].page == BPTREE_PAGE_NULL || !frames[f].dirty)
+            continue;
+        (*pages)[n] = frames[f].page;
+        memcpy(*data + (size_t)n * page_size, frames[f].data, page_size);
+        frames[f].dirty = false;
+        frames[f].pin_count++;
+        n++;
+    }
+    dirty_count = 0;
+    checkpointing = n > 0;
+    bpt_mutex_unlock(&mutex);
+    return n;
+}
+
+void BPTreeBufferPool::EndCheckpoint( const uint32_t * pages, int count, bool written )
+{
+    int i, f;
+
+    bpt_mutex_lock(&mutex);
+    for (i = 0; i < count; i++) {
+        f = lookup(pages[i]);
+        if (f < 0)
+            continue;
+        frames[f].pin_count--;
+        if (!written && !frames[f].dirty) {
+            frames[f].dirty = true;
+            dirty_count++;
+        }
+    }
+    checkpointing = false;
+    shrink();
+    bpt_cond_broadcast(&released);
+    bpt_mutex_unlock(&mutex);
+}
+
+int BPTreeBufferPool::GetFrameCount()
+{
+    int n;
+    bpt_mutex_lock(&mutex);
+    n = num_frames;
+    bpt_mutex_unlock(&mutex);
+    return n;
+}
+
+int BPTreeBufferPool::GetOverflowCount()
+{
+    int n;
+    bpt_mutex_lock(&mutex);
+    n = num_frames - base_frames;
+    bpt_mutex_unlock(&mutex);
+    return n;
+}
+
+int BPTreeBufferPool::GetDirtyCount()
+{
+    int n;
+    bpt_mutex_lock(&mutex);
+    n = dirty_count;
+    bpt_mutex_unlock(&mutex);
+    return n;
+}
+
+uint64_t BPTreeBufferPool::GetHitCount()
+{
+    return hits;
+}
+
+uint64_t BPTreeBufferPool::GetMissCount()
+{
+    return misses;
+}
+
+int BPTreeBufferPool::lookup( uint32_t page )
+{
+    int f;
+
+    for (f = buckets[pool_hash(page, bucket_mask)]; f >= 0; f = frames[f].hash_next) {
+        if (frames[f].page == page)
+            return f;
+    }
+    return -1;
+}
+
+void BPTreeBufferPool::hash_insert( int frame )
+{
+    int * bucket = &buckets[pool_hash(frames[frame].page, bucket_mask)];
+
+    frames[frame].hash_next = *bucket;
+    *bucket = frame;
+}
+
+void BPTreeBufferPool::hash_remove( int frame )
+{
+    int * link = &buckets[pool_hash(frames[frame].page, bucket_mask)];
+
+    while (*link != frame)
+        link = &frames[*link].hash_next;
+    *link = frames[frame].hash_next;
+}
+
+void BPTreeBufferPool::queue_push( pool_queue * q, int frame )
+{
+    frames[frame].prev = q->tail;
+    frames[frame].next = -1;
+    if (q->tail >= 0)
+        frames[q->tail].next = frame;
+    else
+        q->head = frame;
+    q->tail = frame;
+    q->count++;
+}
+
+void BPTreeBufferPool::queue_remove( pool_queue * q, int frame )
+{
+    if (frames[frame].prev >= 0)
+        frames[frames[frame].prev].next = frames[frame].next;
+    else
+        q->head = frames[frame].next;
+    if (frames[frame].next >= 0)
+        frames[frames[frame].next].prev = frames[frame].prev;
+    else
+        q->tail = frames[frame].prev;
+    q->count--;
+}
+
+/* Forgets a page remembered after leaving A1in,
+ * returning true if it was.
+ */
+bool BPTreeBufferPool::ghost_take( uint32_t page )
+{
+    int * link;
+
+    if (num_ghosts == 0)
+        return false;
+    link = &ghost_buckets[pool_hash(page, bucket_mask)];
+    while (*link >= 0) {
+        if (ghosts[*link] == page) {
+            ghosts[*link] = BPTREE_PAGE_NULL;
+            *link = ghost_next[*link];
+            return true;
+        }
+        link = &ghost_next[*link];
+    }
+    return false;
+}
+
+/* Remembers a page leaving A1in in place of the
+ * oldest remembered.
+ */
+void BPTreeBufferPool::ghost_add( uint32_t page )
+{
+    int slot, * link;
+
+    if (num_ghosts == 0)
+        return;
+    slot = ghost_pos;
+    ghost_pos = (ghost_pos + 1) % num_ghosts;
+    if (ghosts[slot] != BPTREE_PAGE_NULL) {
+        link = &ghost_buckets[pool_hash(ghosts[slot], bucket_mask)];
+        while (*link != slot)
+            link = &ghost_next[*link];
+        *link = ghost_next[slot];
+    }
+    ghosts[slot] = page;
+    link = &ghost_buckets[pool_hash(page, bucket_mask)];
+    ghost_next[slot] = *link;
+    *link = slot;
+}
+
+/* Notes a use of a cached page.  Under LRU-K, uses
+ * with no other page pinned in between count as one,
+ * as when a page is pinned again by the same lookup.
+ */
+void BPTreeBufferPool::touch( int frame )
+{
+    int i;
+
+    switch (policy) {
+    case BPTREE_EVICT_LRU_K:
+        if (frames[frame].history[0] == clock)
+            break;
+        for (i = BPTREE_LRU_K - 1; i > 0; i--)
+            frames[frame].history[i] = frames[frame].history[i - 1];
+        frames[frame].history[0] = ++clock;
+        break;
+    case BPTREE_EVICT_2Q:
+        if (frames[frame].queue == POOL_QUEUE_AM) {
+            queue_remove(&am, frame);
+            queue_push(&am, frame);
+        }
+        break;
+    default:
+        frames[frame].referenced = true;
+        break;
+    }
+}
+
+/* Notes the first use of a page read.  Under 2Q a
+ * page remembered from A1in goes to Am, any other
+ * to A1in.
+ */
+void BPTreeBufferPool::admit( int frame )
+{
+    int i;
+
+    switch (policy) {
+    case BPTREE_EVICT_LRU_K:
+        for (i = 1; i < BPTREE_LRU_K; i++)
+            frames[frame].history[i] = 0;
+        frames[frame].history[0] = ++clock;
+        break;
+    case BPTREE_EVICT_2Q:
+        if (ghost_take(frames[frame].page)) {
+            frames[frame].queue = POOL_QUEUE_AM;
+            queue_push(&am, frame);
+        }
+        else {
+            frames[frame].queue = POOL_QUEUE_A1IN;
+            queue_push(&a1in, frame);
+        }
+        break;
+    default:
+        frames[frame].referenced = true;
+        break;
+    }
+}
+
+/* Removes the page of a victim from the pool.
+ */
+void BPTreeBufferPool::retire( int frame )
+{
+    if (frames[frame].queue == POOL_QUEUE_A1IN) {
+        queue_remove(&a1in, frame);
+        ghost_add(frames[frame].page);
+    }
+    else if (frames[frame].queue == POOL_QUEUE_AM)
+        queue_remove(&am, frame);
+    frames[frame].queue = POOL_QUEUE_NONE;
+    if (frames[frame].resident)
+        resident_count--;
+    frames[frame].resident = false;
+    hash_remove(frame);
+}
+
+int BPTreeBufferPool::choose_victim( bool spare_resident )
+{
+    int f;
+
+    switch (policy) {
+    case BPTREE_EVICT_LRU_K:
+        return choose_lru_k(spare_resident);
+    case BPTREE_EVICT_2Q:
+        if (a1in.count > a1in_max) {
+            f = choose_2q(&a1in, spare_resident);
+            return f >= 0 ? f : choose_2q(&am, spare_resident);
+        }
+        f = choose_2q(&am, spare_resident);
+        return f >= 0 ? f : choose_2q(&a1in, spare_resident);
+    default:
+        return choose_clock(spare_resident);
+    }
+}
+
+/* Sweeps the clock hand at most twice round, the
+ * first time clearing the reference bits it passes.
+ */
+int BPTreeBufferPool::choose_clock( bool spare_resident )
+{
+    int i, f;
+
+    for (i = 0; i < 2 * num_frames; i++) {
+        f = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+        if (!evictable(f, spare_resident))
+            continue;
+        if (frames[f].referenced) {
+            frames[f].referenced = false;
+            continue;
+        }
+        return f;
+    }
+    return -1;
+}
+
+/* Picks the page used fewer than K times that was
+ * used the longest ago, or if none, the page whose
+ * Kth last use is the oldest.
+ */
+int BPTreeBufferPool::choose_lru_k( bool spare_resident )
+{
+    int f, best = -1;
+    bool full, best_full = true;
+    uint64_t age, best_age = 0;
+
+    for (f = 0; f < num_frames; f++) {
+        if (!evictable(f, spare_resident))
+            continue;
+        full = frames[f].history[BPTREE_LRU_K - 1] != 0;
+        age = full ? frames[f].history[BPTREE_LRU_K - 1] : frames[f].history[0];
+        if (best < 0 || (!full && best_full) || (full == best_full && age < best_age)) {
+            best = f;
+            best_full = full;
+            best_age = age;
+        }
+    }
+    return best;
+}
+
+int BPTreeBufferPool::choose_2q( pool_queue * q, bool spare_resident )
+{
+    int f;
+
+    for (f = q->head; f >= 0; f = frames[f].next) {
+        if (evictable(f, spare_resident))
+            return f;
+    }
+    return -1;
+}
+
+bool BPTreeBufferPool::evictable( int frame, bool spare_resident )
+{
+    return frames[frame].pin_count == 0 && !(spare_resident && frames[frame].resident)
+        && !(no_steal && frames[frame].dirty);
+}
+
+/* Adds a frame past those the pool was made with.
+ * The hash keeps its buckets, and the 2Q queues
+ * their limits.  The pages stay where they are,
+ * as only the array of frames is reallocated.
+ */
+int BPTreeBufferPool::grow()
+{
+    pool_frame * grown;
+    int f = num_frames;
+
+    grown = (pool_frame *)realloc(frames, (num_frames + 1) * sizeof(pool_frame));
+    if (grown == NULL) {
+        perror("Buffer pool growth.");
+        exit(EXIT_FAILURE);
+    }
+    frames = grown;
+    memset(&frames[f], 0, sizeof(pool_frame));
+    frames[f].data = (char *)malloc(page_size);
+    if (frames[f].data == NULL) {
+        perror("Buffer pool growth.");
+        exit(EXIT_FAILURE);
+    }
+    frames[f].page = BPTREE_PAGE_NULL;
+    num_frames++;
+    return f;
+}
+
+/* Gives back the frames added past those the pool
+ * was made with, from the last, until one holds a
+ * page pinned.  A dirty page is moved to a free
+ * frame or to the frame of a victim; a clean one
+ * leaves the pool.
+ */
+void BPTreeBufferPool::shrink()
+{
+    int f, g, * link;
+
+    while (num_frames > base_frames) {
+        f = num_frames - 1;
+        if (frames[f].page == BPTREE_PAGE_NULL) {
+            link = &free_frames;
+            while (*link != f)
+                link = &frames[*link].hash_next;
+            *link = frames[f].hash_next;
+        }
+        else if (frames[f].pin_count > 0)
+            break;
+        else if (frames[f].dirty) {
+            if (free_frames >= 0) {
+                g = free_frames;
+                free_frames = frames[g].hash_next;
+            }
+            else {
+                g = choose_victim(true);
+                if (g < 0)
+                    g = choose_victim(false);
+                if (g < 0 || g == f)
+                    break;
+                if (frames[g].dirty && !write_frame(g))
+                    break;
+                retire(g);
+            }
+            move_frame(f, g);
+        }
+        else
+            retire(f);
+        free(frames[f].data);
+        num_frames--;
+        if (clock_hand >= num_frames)
+            clock_hand = 0;
+    }
+}
+
+/* Moves the page of a frame, with its state, to a
+ * frame holding none, which takes its place in the
+ * hash and at the tail of its 2Q queue.
+ */
+void BPTreeBufferPool::move_frame( int from, int to )
+{
+    char * data = frames[to].data;
+    int queue = frames[from].queue;
+
+    hash_remove(from);
+    if (queue == POOL_QUEUE_A1IN)
+        queue_remove(&a1in, from);
+    else if (queue == POOL_QUEUE_AM)
+        queue_remove(&am, from);
+    frames[to] = frames[from];
+    frames[from].data = data;
+    frames[from].page = BPTREE_PAGE_NULL;
+    frames[from].queue = POOL_QUEUE_NONE;
+    frames[from].dirty = false;
+    frames[from].resident = false;
+    hash_insert(to);
+    if (queue == POOL_QUEUE_A1IN)
+        queue_push(&a1in, to);
+    else if (queue == POOL_QUEUE_AM)
+        queue_push(&am, to);
+}
+
+bool BPTreeBufferPool::write_frame( int frame )
+{
+    if (!file->WritePage(frames[frame].page, frames[frame].data)) {
+        write_failed = true;
+        return false;
+    }
+    frames[frame].dirty = false;
+    dirty_count--;
+    return true;
+}
+
+void BPTreeBufferPool::writer_task( void * arg, int /*index*/ )
+{
+    ((BPTreeBufferPool *)arg)->run_writer();
+}
+
+/* Writes back the dirty pages not pinned every
+ * interval, or when woken by Unpin, unless in
+ * no-steal mode.  A page is copied and pinned
+ * for its write, so it can be used meanwhile
+ * but not evicted and read back before the
+ * write lands.
+ */
+void BPTreeBufferPool::run_writer()
+{
+    uint32_t page;
+    bool ok;
+    int f;
+
+    bpt_mutex_lock(&mutex);
+    while (!stopping) {
+        if (dirty_count <= num_frames / 2 || write_failed || no_steal)
+            bpt_cond_wait(&wake, &mutex, BPTREE_POOL_WRITER_INTERVAL);
+        for (f = 0; f < num_frames && !stopping && !no_steal; f++) {
+            if (frames[f].page == BPTREE_PAGE_NULL || !frames[f].dirty || frames[f].pin_count > 0)
+                continue;
+            page = frames[f].page;
+            memcpy(write_buffer, frames[f].data, page_size);
+            frames[f].dirty = false;
+            dirty_count--;
+            frames[f].pin_count++;
+            writes_in_flight++;
+            bpt_mutex_unlock(&mutex);
+            ok = file->WritePage(page, write_buffer);
+            bpt_mutex_lock(&mutex);
+            frames[f].pin_count--;
+            writes_in_flight--;
+            if (!ok) {
+                write_failed = true;
+                if (!frames[f].dirty) {
+                    frames[f].dirty = true;
+                    dirty_count++;
+                }
+            }
+            bpt_cond_broadcast(&done);
+        }
+    }
+    bpt_mutex_unlock(&mutex);
+}
@@ -0,0 +1,280 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Buffer Pool
+ *
+ *  @file bplustree_bufferpool.h
+ *
+ *  Bounded cache of the pages of a page file.  A page is pinned while in
+ *  use and can not leave the pool until unpinned; unpinned pages stay in
+ *  their frames until the eviction policy, CLOCK, LRU-K or 2Q, picks
+ *  them to make room.  Pages marked resident when unpinned, the internal
+ *  pages of a tree, are passed over by eviction while any other page can
+ *  go, so the upper levels of a tree larger than the pool stay cached.
+ *
+ *  Changed pages are written back by a writer thread of the pool in the
+ *  background, so an eviction seldom has to wait for a write; a dirty
+ *  page picked for eviction anyway is written first.  In no-steal mode,
+ *  used with a write-ahead log, a changed page is never written by the
+ *  pool: it stays cached until a checkpoint takes it.  When every page
+ *  is pinned or dirty, a pin waits for the checkpoint being written to
+ *  release its pages, and with none under way the pool takes a frame
+ *  past its number, given back at the end of the next checkpoint.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_BUFFERPOOL_HEADER
+#define _BPLUSTREE_BUFFERPOOL_HEADER
+
+#include <stdint.h>
+#include "bplustree_pagefile.h"
+#include "bplustree_thread.h"
+
+/**
+ * Eviction policies.
+ * CLOCK evicts a page not used since the clock hand last
+ * passed it; LRU-K the page whose Kth most recent use is
+ * the oldest, any page used fewer than K times first;
+ * 2Q pages used once from a FIFO queue, and pages used
+ * again, when remembered after leaving that queue, from
+ * an LRU queue.
+ */
+#define BPTREE_EVICT_CLOCK 0
+#define BPTREE_EVICT_LRU_K 1
+#define BPTREE_EVICT_2Q 2
+
+/**
+ * K of LRU-K.
+ */
+#define BPTREE_LRU_K 2
+
+/**
+ * Default and least number of frames in a pool.
+ */
+#define BPTREE_POOL_DEFAULT_FRAMES 1024
+#define BPTREE_POOL_MIN_FRAMES 16
+
+/**
+ * Interval of the writer thread in milliseconds.
+ */
+#define BPTREE_POOL_WRITER_INTERVAL 100
+
+/**
+ * BPTreeBufferPool class.
+ * Pin and Unpin may be called from many threads at once,
+ * under a mutex of the pool, which also synchronizes them
+ * with its writer thread.
+ */
+class BPTREE_INTERFACE_API BPTreeBufferPool
+{
+public:
+    /**
+     * BPTreeBufferPool constructor, starts the writer thread.
+     * @param pFile     The open page file, used with its page size
+     * @param nFrames   Number of pages cached(>=BPTREE_POOL_MIN_FRAMES)
+     * @param nPolicy   Eviction policy(Default:BPTREE_EVICT_CLOCK)
+     */
+    BPTreeBufferPool( BPTreePageFile * pFile, int nFrames, int nPolicy = BPTREE_EVICT_CLOCK );
+
+    /**
+     * BPTreeBufferPool destructor, stops the writer thread and
+     * writes back the pages changed.
+     */
+    ~BPTreeBufferPool();
+public:
+    /**
+     * Pins a page, reading it into a frame if not cached.
+     * In no-steal mode, waits for a checkpoint under way
+     * when no page can leave the pool.
+     * @param page      The page ID
+     * @return      Return the page, or NULL on an I/O error or if every frame is pinned.
+     */
+    char * Pin( uint32_t page );
+
+    /**
+     * Unpins a page pinned.
+     * @param page      The page ID
+     * @param dirty     True if the page was changed
+     * @param resident  True to keep the page over pages not resident
+     */
+    void Unpin( uint32_t page, bool dirty, bool resident );
+
+    /**
+     * Writes back every page changed, and waits for writes
+     * under way in the writer thread.  The file is not synced.
+     * @return      Return false if a write failed since the last call.
+     */
+    bool FlushAll();
+
+    /**
+     * Turns no-steal mode on or off.
+     * @param no_steal  Keeps changed pages until a checkpoint
+     */
+    void SetNoSteal( bool no_steal );
+
+    /**
+     * Takes a copy of every changed page for a checkpoint
+     * and marks them clean.  The pages stay pinned until
+     * EndCheckpoint, so they are not evicted and read back
+     * before the checkpoint has written them.
+     * @param pages     Set to the page IDs, freed by the caller
+     * @param data      Set to the copies, one after another, freed by the caller
+     * @return      Return the number of pages.
+     */
+    int BeginCheckpoint( uint32_t ** pages, char ** data );
+
+    /**
+     * Unpins the pages of a checkpoint, marking them dirty
+     * again if the checkpoint was not written, and gives
+     * back the frames taken past the number the pool was
+     * made with that no longer hold a page pinned.
+     * @param pages     The page IDs BeginCheckpoint gave
+     * @param count     The number of pages
+     * @param written   True if the checkpoint was written
+     */
+    void EndCheckpoint( const uint32_t * pages, int count, bool written );
+
+    /**
+     * Returns the number of frames, which in no-steal mode
+     * may exceed the number the pool was made with until
+     * the next checkpoint ends.
+     */
+    int GetFrameCount();
+
+    /**
+     * Returns the number of frames past the number the
+     * pool was made with.
+     */
+    int GetOverflowCount();
+
+    /**
+     * Returns the number of changed pages.
+     */
+    int GetDirtyCount();
+
+    /**
+     * Returns the number of pins of a page cached, and of a
+     * page read from the file.
+     */
+    uint64_t GetHitCount();
+    uint64_t GetMissCount();
+private:
+    /**
+     * Frame holding a page.  A frame is on the A1in or Am
+     * queue under 2Q, linked by prev and next, and
+     * history holds the last K uses under LRU-K.
+     */
+    typedef struct pool_frame {
+        uint32_t page;                      /**< Page held, BPTREE_PAGE_NULL if none.*/
+        int pin_count;                      /**< Pins, those of the writer included.*/
+        bool dirty;                         /**< Changed since read or written.*/
+        bool resident;                      /**< Kept over pages not resident.*/
+        bool referenced;                    /**< Used since passed by the clock hand.*/
+        int queue;                          /**< 2Q queue.*/
+        int prev;                           /**< Previous frame on the queue.*/
+        int next;                           /**< Next frame on the queue.*/
+        int hash_next;                      /**< Next frame in the hash bucket.*/
+        uint64_t history[BPTREE_LRU_K];     /**< Times of last uses, newest first.*/
+        char * data;                        /**< The page.*/
+    } pool_frame;
+
+    /**
+     * Queue of frames, oldest first.
+     */
+    typedef struct pool_queue {
+        int head;
+        int tail;
+        int count;
+    } pool_queue;
+
+    int lookup( uint32_t page );
+    void hash_insert( int frame );
+    void hash_remove( int frame );
+    void queue_push( pool_queue * q, int frame );
+    void queue_remove( pool_queue * q, int frame );
+    bool ghost_take( uint32_t page );
+    void ghost_add( uint32_t page );
+    void touch( int frame );
+    void admit( int frame );
+    void retire( int frame );
+    int choose_victim( bool spare_resident );
+    int choose_clock( bool spare_resident );
+    int choose_lru_k( bool spare_resident );
+    int choose_2q( pool_queue * q, bool spare_resident );
+    bool evictable( int frame, bool spare_resident );
+    int grow();
+    void shrink();
+    void move_frame( int from, int to );
+    bool write_frame( int frame );
+    static void writer_task( void * arg, int index );
+    void run_writer();
+private:
+    BPTreePageFile * file;
+    int page_size;
+    int policy;
+
+    /**
+     * Frames, the number the pool was made with, a hash
+     * of the pages held to their frames, and the frames
+     * holding no page, linked by hash_next.
+     */
+    pool_frame * frames;
+    int num_frames;
+    int base_frames;
+    int * buckets;
+    int bucket_mask;
+    int free_frames;
+
+    /**
+     * Clock hand and time of use, for CLOCK and LRU-K.
+     */
+    int clock_hand;
+    uint64_t clock;
+
+    /**
+     * 2Q queues, the most pages kept on A1in, and the
+     * pages remembered after leaving A1in, in a ring
+     * with a hash of its own.
+     */
+    pool_queue a1in;
+    pool_queue am;
+    int a1in_max;
+    uint32_t * ghosts;
+    int * ghost_next;
+    int * ghost_buckets;
+    int num_ghosts;
+    int ghost_pos;
+
+    /**
+     * Frames resident, and the most of them.
+     */
+    int resident_count;
+    int resident_max;
+
+    /**
+     * No-steal mode, whether the pages of a checkpoint are
+     * pinned, dirty frames, writes under way in the writer
+     * thread, whether a write failed, and counts of pins.
+     */
+    bool no_steal;
+    bool checkpointing;
+    int dirty_count;
+    int writes_in_flight;
+    bool write_failed;
+    uint64_t hits;
+    uint64_t misses;
+
+    /**
+     * Mutex of the pool, the condition the writer thread
+     * waits on, the condition of its writes finished, the
+     * condition of the pages of a checkpoint unpinned, the
+     * writer thread and its buffer.
+     */
+    bpt_mutex mutex;
+    bpt_cond wake;
+    bpt_cond done;
+    bpt_cond released;
+    bpt_thread writer;
+    char * write_buffer;
+    bool stopping;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Epoch Reclamation
+ *
+ *  @file bplustree_epoch.h
+ *
+ *  Epoch based reclamation of the nodes and records a B+ tree removes
+ *  while optimistic readers may still be reading them.  The tree keeps
+ *  a global epoch and a table of slots.  A thread entering the tree
+ *  claims a slot and publishes the epoch it entered in, and clears the
+ *  slot when it leaves.  A block removed from the tree is retired with
+ *  the epoch current after its removal, and is freed once every thread
+ *  in the tree entered in a later epoch, since a thread entering after
+ *  the removal can no longer reach it.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_EPOCH_HEADER
+#define _BPLUSTREE_EPOCH_HEADER
+
+#include <stdint.h>
+#include "bplustree_latch.h"
+
+/**
+ * Number of threads that can be in the tree at once.
+ * A thread finding all slots taken waits for one.
+ */
+#define BPTREE_EPOCH_SLOTS 64
+
+/**
+ * Slot of a thread in the tree, padded to a cache
+ * line so threads do not share the line they write.
+ */
+typedef struct bpt_epoch_slot {
+    volatile uint64_t epoch;    /**< Epoch entered in, 0 if the slot is free.*/
+    char padding[64 - sizeof(uint64_t)];
+} bpt_epoch_slot;
+
+/**
+ * Global epoch and the slots of the threads in the tree.
+ */
+typedef struct bpt_epoch {
+    volatile uint64_t global;   /**< Current epoch, starting at 1.*/
+    char padding[64 - sizeof(uint64_t)];
+    bpt_epoch_slot slots[BPTREE_EPOCH_SLOTS];
+} bpt_epoch;
+
+#ifdef _MSC_VER
+static inline uint64_t bpt_epoch_load( volatile uint64_t * p )
+{
+    return (uint64_t)_InterlockedOr64((volatile __int64 *)p, 0);
+}
+
+static inline void bpt_epoch_store( volatile uint64_t * p, uint64_t v )
+{
+    _InterlockedExchange64((volatile __int64 *)p, (__int64)v);
+}
+
+static inline bool bpt_epoch_cas( volatile uint64_t * p, uint64_t expected, uint64_t desired )
+{
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)p, (__int64)desired, (__int64)expected) == expected;
+}
+
+static inline uint64_t bpt_epoch_increment( volatile uint64_t * p )
+{
+    return (uint64_t)_InterlockedIncrement64((volatile __int64 *)p);
+}
+
+static inline void bpt_epoch_fence( void )
+{
+    MemoryBarrier();
+}
+
+static inline void * bpt_epoch_load_pointer( void * volatile * p )
+{
+    return _InterlockedCompareExchangePointer(p, NULL, NULL);
+}
+
+static inline void bpt_epoch_store_pointer( void * volatile * p, void * v )
+{
+    _InterlockedExchangePointer(p, v);
+}
+#else
+static inline uint64_t bpt_epoch_load( volatile uint64_t * p )
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static inline void bpt_epoch_store( volatile uint64_t * p, uint64_t v )
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+static inline bool bpt_epoch_cas( volatile uint64_t * p, uint64_t expected, uint64_t desired )
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t bpt_epoch_increment( volatile uint64_t * p )
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void bpt_epoch_fence( void )
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void * bpt_epoch_load_pointer( void * volatile * p )
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void bpt_epoch_store_pointer( void * volatile * p, void * v )
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+#endif
+
+static inline void bpt_epoch_init( bpt_epoch * e )
+{
+    int i;
+    e->global = 1;
+    for (i = 0; i < BPTREE_EPOCH_SLOTS; i++)
+        e->slots[i].epoch = 0;
+}
+
+/* Enters the tree: claims a free slot and publishes
+ * the current epoch in it, and publishes it again
+ * until the epoch did not move meanwhile, so a
+ * reclaimer either sees the slot or advanced the
+ * epoch before the thread read anything.  The
+ * search for a slot starts at a hash of the stack
+ * address, which differs between threads, so a
+ * thread usually finds the slot it used last.
+ * Returns the slot, for bpt_epoch_exit.
+ */
+static inline int bpt_epoch_enter( bpt_epoch * e )
+{
+    uint64_t epoch, current;
+    int i, spins = 0;
+
+    i = (int)(((uintptr_t)&epoch >> 12) % BPTREE_EPOCH_SLOTS);
+    epoch = bpt_epoch_load(&e->global);
+    while (!bpt_epoch_cas(&e->slots[i].epoch, 0, epoch)) {
+        i = (i + 1) % BPTREE_EPOCH_SLOTS;
+        if (i == 0)
+            bpt_latch_pause(spins++);
+        epoch = bpt_epoch_load(&e->global);
+    }
+    for (;;) {
+        bpt_epoch_fence();
+        current = bpt_epoch_load(&e->global);
+        if (current == epoch)
+            return i;
+        epoch = current;
+        bpt_epoch_store(&e->slots[i].epoch, epoch);
+    }
+}
+
+/* Leaves the tree, freeing the slot.
+ */
+static inline void bpt_epoch_exit( bpt_epoch * e, int slot )
+{
+    bpt_epoch_store(&e->slots[slot].epoch, 0);
+}
+
+/* Returns the epoch to retire a block in, read
+ * after the block was removed from the tree.
+ */
+static inline uint64_t bpt_epoch_current( bpt_epoch * e )
+{
+    bpt_epoch_fence();
+    return bpt_epoch_load(&e->global);
+}
+
+/* Advances the epoch, and returns the oldest epoch
+ * a thread in the tree entered in, or the new epoch
+ * if none is in it.  Blocks retired in an earlier
+ * epoch can be freed.
+ */
+static inline uint64_t bpt_epoch_advance( bpt_epoch * e )
+{
+    uint64_t oldest, epoch;
+    int i;
+
+    oldest = bpt_epoch_increment(&e->global);
+    for (i = 0; i < BPTREE_EPOCH_SLOTS; i++) {
+        epoch = bpt_epoch_load(&e->slots[i].epoch);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+#endif
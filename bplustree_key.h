@@ -0,0 +1,112 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Keys
+ *
+ *  @file bplustree_key.h
+ *
+ *  Key handling shared by BPlusTree, PagedBPlusTree and BPTreeSnapshot,
+ *  which store keys alike: a string key in a slot of the key length,
+ *  terminator included, and an integer key as a 64-bit integer.  Each
+ *  function takes the key type and key length of the tree.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_KEY_HEADER
+#define _BPLUSTREE_KEY_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bplustree.h"
+
+/* Converts an integer key to its string form
+ * in string key mode, left padded with '0' to
+ * the key length.  For example, with key length
+ * 8, 4 becomes "00000004".  The leading digits
+ * of a number too long for the key are cut.
+ * The caller frees the returned string.
+ */
+static inline char * bpt_key_format( int key, int key_length )
+{
+    char digits[16];
+    char * key_str;
+    int i, n;
+
+    key_str = (char *)malloc(key_length);
+    if (key_str == NULL) {
+        perror("Key creation.");
+        exit(EXIT_FAILURE);
+    }
+    memset(key_str, '0', key_length - 1);
+    key_str[key_length - 1] = '\0';
+    n = sprintf(digits, "%d", key);
+    for (i = 0; i < n && i < key_length - 1; i++)
+        key_str[key_length - 2 - i] = digits[n - 1 - i];
+    return key_str;
+}
+
+/* Returns a key given as a string in the form
+ * used inside a tree.  In integer key mode the
+ * string is parsed into num and the returned
+ * key points to it.
+ */
+static inline char * bpt_key_make( char * key, int64_t * num, int key_type )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        *num = strtoll(key, NULL, 10);
+        return (char *)num;
+    }
+    return key;
+}
+
+/* Compares two keys.  Returns a negative value,
+ * zero or a positive value if a is less than,
+ * equal to or greater than b.  String keys are
+ * compared up to the key length only.
+ */
+static inline int bpt_key_compare( const char * a, const char * b, int key_type, int key_length )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t x, y;
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        return (x > y) - (x < y);
+    }
+    return strncmp(a, b, key_length - 1);
+}
+
+/* Stores a key into a key slot.  String keys
+ * longer than the key length are truncated
+ * and the rest of the slot is filled with '\0'.
+ */
+static inline void bpt_key_store( char * dest, const char * src, int key_type, int key_length )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER)
+        memcpy(dest, src, sizeof(int64_t));
+    else {
+        strncpy(dest, src, key_length - 1);
+        dest[key_length - 1] = '\0';
+    }
+}
+
+/* Stores the separator of two neighboring leaves
+ * into a key slot: for string keys the shortest
+ * prefix of right, the smallest key of the right
+ * leaf, greater than left, the largest of the
+ * left one.  Keys are routed as by right itself,
+ * and comparisons against it end sooner.
+ */
+static inline void bpt_key_separator( char * dest, const char * left, const char * right, int key_type, int key_length )
+{
+    int i = 0;
+
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        memcpy(dest, right, sizeof(int64_t));
+        return;
+    }
+    while (i < key_length - 1 && left[i] == right[i] && right[i] != '\0')
+        i++;
+    memset(dest, 0, key_length);
+    memcpy(dest, right, i + 1);
+}
+
+#endif
@@ -0,0 +1,234 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Node Latch
+ *
+ *  @file bplustree_latch.h
+ *
+ *  Reader/writer spin latch held in each node of a thread-safe B+ tree.
+ *  It is one 64-bit word, so it adds nothing to allocate or destroy with
+ *  the node: a writer bit, a bit set by a writer waiting for the readers
+ *  to leave, which keeps new readers out so writers are not starved, a
+ *  bit marking a node removed from the tree, the count of readers, and
+ *  in the high half a version counter that every exclusive unlock bumps.
+ *  A thread that fails to take the latch spins a while and then yields
+ *  the processor.
+ *
+ *  The version lets readers go without the latch at all: an optimistic
+ *  reader notes the version, reads the node, and validates that the
+ *  version is unchanged, restarting otherwise.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_LATCH_HEADER
+#define _BPLUSTREE_LATCH_HEADER
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <windows.h>
+#else
+#   include <sched.h>
+#endif
+
+/**
+ * Number of spins before a thread waiting
+ * for a latch yields the processor.
+ */
+#define BPTREE_LATCH_SPINS 64
+
+#define BPTREE_LATCH_WRITER 0x80000000u
+#define BPTREE_LATCH_WRITER_WAITING 0x40000000u
+#define BPTREE_LATCH_OBSOLETE 0x20000000u
+#define BPTREE_LATCH_READERS 0x1fffffffu
+#define BPTREE_LATCH_VERSION ((uint64_t)1 << 32)
+
+/**
+ * Reader/writer latch with a version.
+ */
+typedef struct bpt_latch {
+    volatile uint64_t word; /**< Version, state bits and reader count.*/
+} bpt_latch;
+
+#ifdef _MSC_VER
+static inline uint64_t bpt_latch_load( bpt_latch * l )
+{
+    return (uint64_t)_InterlockedOr64((volatile __int64 *)&l->word, 0);
+}
+
+static inline bool bpt_latch_cas( bpt_latch * l, uint64_t expected, uint64_t desired )
+{
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64 *)&l->word, (__int64)desired, (__int64)expected) == expected;
+}
+
+static inline void bpt_latch_or( bpt_latch * l, uint64_t bits )
+{
+    _InterlockedOr64((volatile __int64 *)&l->word, (__int64)bits);
+}
+
+static inline void bpt_latch_add( bpt_latch * l, uint64_t delta )
+{
+    _InterlockedExchangeAdd64((volatile __int64 *)&l->word, (__int64)delta);
+}
+
+static inline void bpt_latch_fence( void )
+{
+    _ReadWriteBarrier();
+}
+
+static inline void bpt_latch_pause( int spins )
+{
+    if (spins < BPTREE_LATCH_SPINS)
+        _mm_pause();
+    else
+        SwitchToThread();
+}
+#else
+static inline uint64_t bpt_latch_load( bpt_latch * l )
+{
+    return __atomic_load_n(&l->word, __ATOMIC_ACQUIRE);
+}
+
+static inline bool bpt_latch_cas( bpt_latch * l, uint64_t expected, uint64_t desired )
+{
+    return __atomic_compare_exchange_n(&l->word, &expected, desired, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void bpt_latch_or( bpt_latch * l, uint64_t bits )
+{
+    __atomic_fetch_or(&l->word, bits, __ATOMIC_RELAXED);
+}
+
+static inline void bpt_latch_add( bpt_latch * l, uint64_t delta )
+{
+    __atomic_fetch_add(&l->word, delta, __ATOMIC_RELEASE);
+}
+
+static inline void bpt_latch_fence( void )
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+static inline void bpt_latch_pause( int spins )
+{
+    if (spins < BPTREE_LATCH_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    else
+        sched_yield();
+}
+#endif
+
+static inline void bpt_latch_init( bpt_latch * l )
+{
+    l->word = 0;
+}
+
+/* Takes the latch shared, once no writer holds
+ * it or waits for it.
+ */
+static inline void bpt_latch_read_lock( bpt_latch * l )
+{
+    uint64_t v;
+    int spins = 0;
+    for (;;) {
+        v = bpt_latch_load(l);
+        if ((v & (BPTREE_LATCH_WRITER | BPTREE_LATCH_WRITER_WAITING)) == 0
+                && bpt_latch_cas(l, v, v + 1))
+            return;
+        bpt_latch_pause(spins++);
+    }
+}
+
+static inline void bpt_latch_read_unlock( bpt_latch * l )
+{
+    bpt_latch_add(l, (uint64_t)-1);
+}
+
+/* Takes the latch exclusive.  A writer that has
+ * to wait for readers flags it, so no new reader
+ * comes in meanwhile.
+ */
+static inline void bpt_latch_write_lock( bpt_latch * l )
+{
+    uint64_t v;
+    int spins = 0;
+    for (;;) {
+        v = bpt_latch_load(l);
+        if ((v & (BPTREE_LATCH_WRITER | BPTREE_LATCH_READERS)) == 0
+                && bpt_latch_cas(l, v, (v & ~(uint64_t)BPTREE_LATCH_WRITER_WAITING) | BPTREE_LATCH_WRITER))
+            return;
+        if ((v & BPTREE_LATCH_WRITER_WAITING) == 0)
+            bpt_latch_or(l, BPTREE_LATCH_WRITER_WAITING);
+        bpt_latch_pause(spins++);
+    }
+}
+
+/* Releases the latch taken exclusive and bumps
+ * the version in the same atomic add.
+ */
+static inline void bpt_latch_write_unlock( bpt_latch * l )
+{
+    bpt_latch_add(l, BPTREE_LATCH_VERSION - BPTREE_LATCH_WRITER);
+}
+
+/* Marks a node removed from the tree, while the
+ * latch is held exclusive, so optimistic readers
+ * that reach it restart.
+ */
+static inline void bpt_latch_set_obsolete( bpt_latch * l )
+{
+    bpt_latch_or(l, BPTREE_LATCH_OBSOLETE);
+}
+
+/* Notes the version for an optimistic read,
+ * waiting while a writer holds the latch.
+ * Returns false if the node is obsolete.
+ */
+static inline bool bpt_latch_read_version( bpt_latch * l, uint64_t * version )
+{
+    uint64_t v;
+    int spins = 0;
+    for (;;) {
+        v = bpt_latch_load(l);
+        if ((v & BPTREE_LATCH_OBSOLETE) != 0)
+            return false;
+        if ((v & BPTREE_LATCH_WRITER) == 0) {
+            *version = v;
+            return true;
+        }
+        bpt_latch_pause(spins++);
+    }
+}
+
+/* Validates an optimistic read: returns true if
+ * no writer took the latch since the version was
+ * noted, so what was read in between is consistent.
+ */
+static inline bool bpt_latch_validate( bpt_latch * l, uint64_t version )
+{
+    const uint64_t mask = ~(uint64_t)(BPTREE_LATCH_WRITER_WAITING | BPTREE_LATCH_READERS);
+    bpt_latch_fence();
+    return (bpt_latch_load(l) & mask) == (version & mask);
+}
+
+/* Takes the latch exclusive if it is still at the
+ * version noted by an optimistic read, without
+ * waiting.  Returns false if it changed.
+ */
+static inline bool bpt_latch_upgrade( bpt_latch * l, uint64_t version )
+{
+    if ((version & BPTREE_LATCH_READERS) != 0)
+        return false;
+    return bpt_latch_cas(l, version, (version & ~(uint64_t)BPTREE_LATCH_WRITER_WAITING) | BPTREE_LATCH_WRITER);
+}
+
+#endif
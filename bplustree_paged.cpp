@@ -0,0 +1,1096 @@
+#include "bplustree_paged.h"
+#include "bplustree_key.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+PagedBPlusTree::PagedBPlusTree()
+{
+    order = 0;
+    key_type = BPTREE_KEY_TYPE_STRING;
+    key_length = 0;
+    key_size = 0;
+    page_size = 0;
+    pointers_offset = 0;
+    pool = NULL;
+    pool_frames = BPTREE_POOL_DEFAULT_FRAMES;
+    pool_policy = BPTREE_EVICT_CLOCK;
+    use_log = false;
+    commit_window = BPTREE_WAL_COMMIT_WINDOW;
+    checkpoint_percent = BPTREE_CHECKPOINT_DIRTY_PERCENT;
+    checkpoint_records = BPTREE_CHECKPOINT_LOG_RECORDS;
+    checkpoint_pages = 0;
+    log_key = NULL;
+    checkpointer.started = false;
+    checkpoint_wanted = false;
+    checkpoint_busy = false;
+    checkpoint_stop = false;
+    checkpoints = 0;
+    bpt_mutex_init(&checkpoint_mutex);
+    bpt_cond_init(&checkpoint_cond);
+    split_keys = NULL;
+    split_children = NULL;
+    split_values = NULL;
+    promoted = NULL;
+    bpt_latch_init(&tree_latch);
+}
+
+PagedBPlusTree::~PagedBPlusTree()
+{
+    Close();
+    bpt_cond_destroy(&checkpoint_cond);
+    bpt_mutex_destroy(&checkpoint_mutex);
+}
+
+/* Opens the page file.  A new file takes the
+ * settings given, with the order lowered until
+ * a node fits a page, and records them in its
+ * superblock; an existing one is checked against
+ * the layout of its own settings.  With a log,
+ * the records past the checkpoint of the file
+ * are replayed into the pool, or dropped with a
+ * new file, and the checkpointer is started.
+ * Without one, a log left beside the file is
+ * replayed by recover_log, or dropped with a new
+ * file, as it belonged to the file replaced.
+ */
+bool PagedBPlusTree::Open( const char * path, int nOrder/* = BPTREE_ORDER_AUTO*/, int nKeyLength/* = BPTREE_DEFAULT_KEY_LENGTH*/, int nKeyType/* = BPTREE_KEY_TYPE_STRING*/, int nPageSize/* = BPTREE_PAGE_SIZE*/ )
+{
+    bpt_superblock * sb;
+    bool created;
+
+    Close();
+    if (!file.Open(path, nPageSize, &created))
+        return false;
+    sb = file.GetSuperblock();
+    if (created) {
+        if (nKeyLength < 0)
+            nKeyLength = BPTREE_DEFAULT_KEY_LENGTH;
+        sb->key_length = nKeyLength;
+        sb->key_type = nKeyType == BPTREE_KEY_TYPE_INTEGER ? BPTREE_KEY_TYPE_INTEGER : BPTREE_KEY_TYPE_STRING;
+    }
+    key_length = sb->key_length + 1;
+    key_type = sb->key_type;
+    key_size = key_type == BPTREE_KEY_TYPE_INTEGER ? (int)sizeof(int64_t) : key_length;
+    page_size = sb->page_size;
+    if (created) {
+        order = nOrder;
+        if (order == BPTREE_ORDER_AUTO) {
+            order = BPTREE_MIN_ORDER;
+            while (page_layout(order + 1, NULL) <= page_size)
+                order++;
+        }
+        if (order < BPTREE_MIN_ORDER)
+            order = BPTREE_MIN_ORDER;
+        while (order > BPTREE_MIN_ORDER && page_layout(order, NULL) > page_size)
+            order--;
+        sb->order = order;
+        if (page_layout(order, NULL) <= page_size && !file.WriteSuperblock()) {
+            file.Close();
+            return false;
+        }
+    }
+    order = sb->order;
+    if (order < BPTREE_MIN_ORDER || page_layout(order, &pointers_offset) > page_size) {
+        file.Close();
+        return false;
+    }
+
+    split_keys = (char *)malloc(order * key_size);
+    split_children = (uint32_t *)malloc((order + 1) * sizeof(uint32_t));
+    split_values = (int32_t *)malloc(order * sizeof(int32_t));
+    promoted = (char *)malloc(key_size);
+    log_key = (char *)malloc(key_size);
+    if (split_keys == NULL || split_children == NULL || split_values == NULL || promoted == NULL || log_key == NULL) {
+        perror("Paged tree creation.");
+        exit(EXIT_FAILURE);
+    }
+    pool = new BPTreeBufferPool(&file, pool_frames, pool_policy);
+    checkpoint_pages = pool->GetFrameCount() * checkpoint_percent / 100;
+
+    char * log_path = (char *)malloc(strlen(path) + sizeof(BPTREE_WAL_SUFFIX));
+    if (log_path == NULL) {
+        perror("Paged tree creation.");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(log_path, "%s%s", path, BPTREE_WAL_SUFFIX);
+    bool opened;
+    if (!use_log) {
+        if (!BPTreeWAL::Exists(log_path))
+            opened = true;
+        else if (created) {
+            opened = wal.Open(log_path, key_size) && wal.Reset();
+            wal.Close();
+        }
+        else
+            opened = recover_log(log_path);
+    }
+    else {
+        pool->SetNoSteal(true);
+        opened = wal.Open(log_path, key_size)
+            && (created ? wal.Reset() : wal.Replay(sb->checkpoint_lsn, replay_record, this))
+            && bpt_thread_start(&checkpointer, checkpoint_task, this);
+    }
+    free(log_path);
+    if (!opened) {
+        close_tree();
+        return false;
+    }
+    if (use_log)
+        wal.SetCommitWindow(commit_window);
+    return true;
+}
+
+/* Opening without the log, replays and drops the
+ * log a logged session left, so changes it made
+ * durable are kept and none is replayed later onto
+ * a tree changed since.  The changes replayed are
+ * written first as a checkpoint, through the
+ * journal, with the superblock noting the last LSN
+ * replayed, so a crash before the log is dropped
+ * leaves the file whole and nothing to replay twice.
+ */
+bool PagedBPlusTree::recover_log( const char * log_path )
+{
+    bpt_superblock * sb = file.GetSuperblock();
+    uint32_t * pages;
+    char * data;
+    bool ok;
+    int n;
+
+    pool->SetNoSteal(true);
+    ok = wal.Open(log_path, key_size) && wal.Replay(sb->checkpoint_lsn, replay_record, this);
+    if (ok && wal.GetLastLSN() > sb->checkpoint_lsn) {
+        sb->checkpoint_lsn = wal.GetLastLSN();
+        n = pool->BeginCheckpoint(&pages, &data);
+        ok = file.WriteCheckpoint(sb, pages, data, n);
+        pool->EndCheckpoint(pages, n, ok);
+        free(pages);
+        free(data);
+    }
+    ok = ok && wal.Reset();
+    wal.Close();
+    pool->SetNoSteal(false);
+    return ok;
+}
+
+void PagedBPlusTree::SetBufferPool( int nFrames, int nPolicy/* = BPTREE_EVICT_CLOCK*/ )
+{
+    pool_frames = nFrames;
+    pool_policy = nPolicy;
+}
+
+BPTreeBufferPool * PagedBPlusTree::GetBufferPool()
+{
+    return pool;
+}
+
+void PagedBPlusTree::SetWriteAheadLog( bool enable, int nCommitWindow/* = BPTREE_WAL_COMMIT_WINDOW*/ )
+{
+    use_log = enable;
+    commit_window = nCommitWindow;
+}
+
+void PagedBPlusTree::SetCheckpoint( int nDirtyPercent/* = BPTREE_CHECKPOINT_DIRTY_PERCENT*/, int nLogRecords/* = BPTREE_CHECKPOINT_LOG_RECORDS*/ )
+{
+    checkpoint_percent = nDirtyPercent < 1 ? 1 : nDirtyPercent > 100 ? 100 : nDirtyPercent;
+    checkpoint_records = nLogRecords < 1 ? 1 : nLogRecords;
+}
+
+BPTreeWAL * PagedBPlusTree::GetWriteAheadLog()
+{
+    return use_log && file.IsOpen() ? &wal : NULL;
+}
+
+void PagedBPlusTree::Close()
+{
+    if (!file.IsOpen())
+        return;
+    Flush();
+    close_tree();
+}
+
+/* Stops the checkpointer and releases the open
+ * tree without writing it, as when opening it
+ * failed.
+ */
+void PagedBPlusTree::close_tree()
+{
+    bpt_mutex_lock(&checkpoint_mutex);
+    checkpoint_stop = true;
+    bpt_cond_broadcast(&checkpoint_cond);
+    bpt_mutex_unlock(&checkpoint_mutex);
+    bpt_thread_join(&checkpointer);
+    checkpoint_stop = false;
+    checkpoint_wanted = false;
+
+    delete pool;
+    pool = NULL;
+    wal.Close();
+    file.Close();
+    free(split_keys);
+    free(split_children);
+    free(split_values);
+    free(promoted);
+    free(log_key);
+    split_keys = NULL;
+    split_children = NULL;
+    split_values = NULL;
+    promoted = NULL;
+    log_key = NULL;
+}
+
+bool PagedBPlusTree::Flush()
+{
+    if (!file.IsOpen())
+        return false;
+    return checkpoint();
+}
+
+bool PagedBPlusTree::Insert( char * key, int value )
+{
+    int64_t num;
+    return apply(BPTREE_WAL_INSERT, make_key(key, &num), value);
+}
+
+bool PagedBPlusTree::Insert( int key, int value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return apply(BPTREE_WAL_INSERT, (char *)&num, value);
+    }
+    char * key_str = format_key(key);
+    bool inserted = apply(BPTREE_WAL_INSERT, key_str, value);
+    free(key_str);
+    return inserted;
+}
+
+bool PagedBPlusTree::Delete( char * key )
+{
+    int64_t num;
+    return apply(BPTREE_WAL_DELETE, make_key(key, &num), 0);
+}
+
+bool PagedBPlusTree::Delete( int key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return apply(BPTREE_WAL_DELETE, (char *)&num, 0);
+    }
+    char * key_str = format_key(key);
+    bool deleted = apply(BPTREE_WAL_DELETE, key_str, 0);
+    free(key_str);
+    return deleted;
+}
+
+bool PagedBPlusTree::FindValue( char * key, int * value )
+{
+    int64_t num;
+    return find_value(make_key(key, &num), value);
+}
+
+bool PagedBPlusTree::FindValue( int key, int * value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return find_value((char *)&num, value);
+    }
+    char * key_str = format_key(key);
+    bool found = find_value(key_str, value);
+    free(key_str);
+    return found;
+}
+
+scan_result PagedBPlusTree::Scan( char * lo, char * hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    int64_t lo_num, hi_num;
+    return scan(make_key(lo, &lo_num), make_key(hi, &hi_num), fn, arg);
+}
+
+scan_result PagedBPlusTree::Scan( int lo, int hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t lo_num = lo, hi_num = hi;
+        return scan((char *)&lo_num, (char *)&hi_num, fn, arg);
+    }
+    char * lo_str = format_key(lo);
+    char * hi_str = format_key(hi);
+    scan_result result = scan(lo_str, hi_str, fn, arg);
+    free(lo_str);
+    free(hi_str);
+    return result;
+}
+
+int PagedBPlusTree::GetOrder()
+{
+    return order;
+}
+
+uint64_t PagedBPlusTree::GetKeyCount()
+{
+    uint64_t n;
+    bpt_latch_read_lock(&tree_latch);
+    n = file.GetSuperblock()->num_keys;
+    bpt_latch_read_unlock(&tree_latch);
+    return n;
+}
+
+uint32_t PagedBPlusTree::GetPageCount()
+{
+    uint32_t n;
+    bpt_latch_read_lock(&tree_latch);
+    n = file.GetSuperblock()->page_count;
+    bpt_latch_read_unlock(&tree_latch);
+    return n;
+}
+
+uint64_t PagedBPlusTree::GetCheckpointCount()
+{
+    uint64_t n;
+    bpt_mutex_lock(&checkpoint_mutex);
+    n = checkpoints;
+    bpt_mutex_unlock(&checkpoint_mutex);
+    return n;
+}
+
+/* Computes the layout of a node page of the given
+ * order: the header, the key slots, then the values
+ * of a leaf or the children of an internal node,
+ * which are one more.  Returns the bytes used.
+ */
+int PagedBPlusTree::page_layout( int nOrder, int * pointers_offset )
+{
+    int offset;
+
+    offset = sizeof(page_header) + (nOrder - 1) * key_size;
+    offset = (offset + sizeof(int64_t) - 1) / sizeof(int64_t) * sizeof(int64_t);
+    if (pointers_offset != NULL)
+        *pointers_offset = offset;
+    return offset + nOrder * sizeof(uint32_t);
+}
+
+/* Converts an integer key to its string form
+ * in string key mode, as BPlusTree does.
+ * The caller frees the returned string.
+ */
+char * PagedBPlusTree::format_key( int key )
+{
+    return bpt_key_format(key, key_length);
+}
+
+char * PagedBPlusTree::make_key( char * key, int64_t * num )
+{
+    return bpt_key_make(key, num, key_type);
+}
+
+int PagedBPlusTree::compare_keys( const char * a, const char * b )
+{
+    return bpt_key_compare(a, b, key_type, key_length);
+}
+
+void PagedBPlusTree::store_key( char * dest, const char * src )
+{
+    bpt_key_store(dest, src, key_type, key_length);
+}
+
+/* Stores the separator of two neighboring leaves,
+ * as BPlusTree::store_separator does.
+ */
+void PagedBPlusTree::store_separator( char * dest, const char * left, const char * right )
+{
+    bpt_key_separator(dest, left, right, key_type, key_length);
+}
+
+PagedBPlusTree::page_header * PagedBPlusTree::header( char * page )
+{
+    return (page_header *)page;
+}
+
+char * PagedBPlusTree::key_at( char * page, int index )
+{
+    return page + sizeof(page_header) + index * key_size;
+}
+
+int32_t * PagedBPlusTree::values( char * page )
+{
+    return (int32_t *)(page + pointers_offset);
+}
+
+uint32_t * PagedBPlusTree::children( char * page )
+{
+    return (uint32_t *)(page + pointers_offset);
+}
+
+/* Returns the index of the first key of a page
+ * not less than key.
+ */
+int PagedBPlusTree::lower_bound( char * page, const char * key )
+{
+    int lo = 0, hi = header(page)->num_keys, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (compare_keys(key_at(page, mid), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns the index of the first key of a page
+ * greater than key, which in an internal page is
+ * the child holding key.
+ */
+int PagedBPlusTree::upper_bound( char * page, const char * key )
+{
+    int lo = 0, hi = header(page)->num_keys, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (compare_keys(key_at(page, mid), key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int PagedBPlusTree::cut( int length )
+{
+    if (length % 2 == 0)
+        return length/2;
+    else
+        return length/2 + 1;
+}
+
+/* Pins a page in the buffer pool until
+ * release_page unpins it.
+ */
+char * PagedBPlusTree::fetch_page( uint32_t page )
+{
+    char * data = pool->Pin(page);
+    if (data == NULL) {
+        perror("Page read.");
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/* Unpins a page fetched, keeping internal
+ * pages resident in the pool.
+ */
+void PagedBPlusTree::release_page( uint32_t page, char * data, bool dirty )
+{
+    pool->Unpin(page, dirty, header(data)->type == BPTREE_PAGE_INTERNAL);
+}
+
+/* Takes a page off the free list, or adds one
+ * at the end of the file, and returns it empty.
+ * The caller releases it dirty.
+ */
+char * PagedBPlusTree::new_page( uint32_t * page, int type )
+{
+    bpt_superblock * sb = file.GetSuperblock();
+    char * data;
+
+    if (sb->free_list != BPTREE_PAGE_NULL) {
+        *page = sb->free_list;
+        data = fetch_page(*page);
+        sb->free_list = header(data)->next;
+    }
+    else {
+        *page = sb->page_count++;
+        data = fetch_page(*page);
+    }
+    memset(data, 0, page_size);
+    header(data)->type = type;
+    return data;
+}
+
+/* Puts a page removed from the tree on the
+ * free list, and releases it.
+ */
+void PagedBPlusTree::free_page( uint32_t page, char * data )
+{
+    bpt_superblock * sb = file.GetSuperblock();
+
+    memset(data, 0, page_size);
+    header(data)->type = BPTREE_PAGE_FREE;
+    header(data)->next = sb->free_list;
+    sb->free_list = page;
+    release_page(page, data, true);
+}
+
+/* Descends from the root to the leaf for a key,
+ * noting each internal page and the child taken
+ * in path.  A child is pinned before its parent
+ * is unpinned.  Returns the leaf, or
+ * BPTREE_PAGE_NULL if the tree is empty.
+ */
+uint32_t PagedBPlusTree::find_leaf( char * key, path_entry * path, int * depth )
+{
+    uint32_t page, child;
+    char * data, * child_data;
+    int i;
+
+    *depth = 0;
+    page = file.GetSuperblock()->root_page;
+    if (page == BPTREE_PAGE_NULL)
+        return BPTREE_PAGE_NULL;
+    data = fetch_page(page);
+    while (header(data)->type == BPTREE_PAGE_INTERNAL) {
+        i = upper_bound(data, key);
+        child = children(data)[i];
+        if (path != NULL) {
+            path[*depth].page = page;
+            path[*depth].index = i;
+        }
+        (*depth)++;
+        child_data = fetch_page(child);
+        release_page(page, data, false);
+        page = child;
+        data = child_data;
+    }
+    release_page(page, data, false);
+    return page;
+}
+
+/* Inserts a key into its leaf, splitting the
+ * leaf if it is full.
+ */
+bool PagedBPlusTree::insert_key( char * key, int value )
+{
+    path_entry path[BPTREE_MAX_HEIGHT];
+    bpt_superblock * sb = file.GetSuperblock();
+    uint32_t page;
+    char * data;
+    int depth, i, n;
+
+    page = find_leaf(key, path, &depth);
+    if (page == BPTREE_PAGE_NULL) {
+        data = new_page(&page, BPTREE_PAGE_LEAF);
+        store_key(key_at(data, 0), key);
+        values(data)[0] = value;
+        header(data)->num_keys = 1;
+        release_page(page, data, true);
+        sb->root_page = page;
+        sb->num_keys++;
+        return true;
+    }
+
+    data = fetch_page(page);
+    n = header(data)->num_keys;
+    i = lower_bound(data, key);
+    if (i < n && compare_keys(key_at(data, i), key) == 0) {
+        release_page(page, data, false);
+        return false;
+    }
+    sb->num_keys++;
+    if (n < order - 1) {
+        memmove(key_at(data, i + 1), key_at(data, i), (n - i) * key_size);
+        memmove(values(data) + i + 1, values(data) + i, (n - i) * sizeof(int32_t));
+        store_key(key_at(data, i), key);
+        values(data)[i] = value;
+        header(data)->num_keys++;
+        release_page(page, data, true);
+        return true;
+    }
+    split_leaf(path, depth, page, data, i, key, value);
+    return true;
+}
+
+/* Splits a full leaf while inserting a key at
+ * index: the leaf keeps the first half, a new
+ * leaf linked after it takes the rest, and its
+ * first key goes up to the parent.
+ */
+void PagedBPlusTree::split_leaf( path_entry * path, int depth, uint32_t page, char * data, int index, char * key, int value )
+{
+    uint32_t right, next;
+    char * right_data, * next_data;
+    int n, split;
+
+    n = header(data)->num_keys;
+    memcpy(split_keys, key_at(data, 0), index * key_size);
+    memcpy(split_values, values(data), index * sizeof(int32_t));
+    store_key(split_keys + index * key_size, key);
+    split_values[index] = value;
+    memcpy(split_keys + (index + 1) * key_size, key_at(data, index), (n - index) * key_size);
+    memcpy(split_values + index + 1, values(data) + index, (n - index) * sizeof(int32_t));
+
+    split = cut(order - 1);
+    right_data = new_page(&right, BPTREE_PAGE_LEAF);
+    memcpy(key_at(data, 0), split_keys, split * key_size);
+    memcpy(values(data), split_values, split * sizeof(int32_t));
+    header(data)->num_keys = split;
+    memcpy(key_at(right_data, 0), split_keys + split * key_size, (order - split) * key_size);
+    memcpy(values(right_data), split_values + split, (order - split) * sizeof(int32_t));
+    header(right_data)->num_keys = order - split;
+
+    next = header(data)->next;
+    header(right_data)->next = next;
+    header(right_data)->prev = page;
+    header(data)->next = right;
+    if (next != BPTREE_PAGE_NULL) {
+        next_data = fetch_page(next);
+        header(next_data)->prev = right;
+        release_page(next, next_data, true);
+    }
+    store_separator(promoted, key_at(data, split - 1), key_at(right_data, 0));
+    release_page(page, data, true);
+    release_page(right, right_data, true);
+    insert_into_parent(path, depth, page, promoted, right);
+}
+
+/* Inserts a key and the page right of it into
+ * the parent of left, splitting the parent if
+ * it is full, or makes a new root over left and
+ * right if left was the root.
+ */
+void PagedBPlusTree::insert_into_parent( path_entry * path, int depth, uint32_t left, char * key, uint32_t right )
+{
+    bpt_superblock * sb = file.GetSuperblock();
+    uint32_t page, new_right;
+    char * data, * right_data;
+    int i, n, split;
+
+    if (depth == 0) {
+        data = new_page(&page, BPTREE_PAGE_INTERNAL);
+        store_key(key_at(data, 0), key);
+        children(data)[0] = left;
+        children(data)[1] = right;
+        header(data)->num_keys = 1;
+        release_page(page, data, true);
+        sb->root_page = page;
+        return;
+    }
+
+    page = path[depth - 1].page;
+    i = path[depth - 1].index;
+    data = fetch_page(page);
+    n = header(data)->num_keys;
+    if (n < order - 1) {
+        memmove(key_at(data, i + 1), key_at(data, i), (n - i) * key_size);
+        memmove(children(data) + i + 2, children(data) + i + 1, (n - i) * sizeof(uint32_t));
+        store_key(key_at(data, i), key);
+        children(data)[i + 1] = right;
+        header(data)->num_keys++;
+        release_page(page, data, true);
+        return;
+    }
+
+    memcpy(split_keys, key_at(data, 0), i * key_size);
+    store_key(split_keys + i * key_size, key);
+    memcpy(split_keys + (i + 1) * key_size, key_at(data, i), (n - i) * key_size);
+    memcpy(split_children, children(data), (i + 1) * sizeof(uint32_t));
+    split_children[i + 1] = right;
+    memcpy(split_children + i + 2, children(data) + i + 1, (n - i) * sizeof(uint32_t));
+
+    split = cut(order);
+    right_data = new_page(&new_right, BPTREE_PAGE_INTERNAL);
+    memcpy(key_at(data, 0), split_keys, (split - 1) * key_size);
+    memcpy(children(data), split_children, split * sizeof(uint32_t));
+    header(data)->num_keys = split - 1;
+    memcpy(key_at(right_data, 0), split_keys + split * key_size, (order - split) * key_size);
+    memcpy(children(right_data), split_children + split, (order + 1 - split) * sizeof(uint32_t));
+    header(right_data)->num_keys = order - split;
+    store_key(promoted, split_keys + (split - 1) * key_size);
+    release_page(page, data, true);
+    release_page(new_right, right_data, true);
+    insert_into_parent(path, depth - 1, page, promoted, new_right);
+}
+
+/* Deletes a key from its leaf, and rebalances
+ * the leaf if it fell below the minimum.
+ */
+bool PagedBPlusTree::delete_key( char * key )
+{
+    path_entry path[BPTREE_MAX_HEIGHT];
+    uint32_t page;
+    char * data;
+    int depth, i, n;
+
+    page = find_leaf(key, path, &depth);
+    if (page == BPTREE_PAGE_NULL)
+        return false;
+    data = fetch_page(page);
+    n = header(data)->num_keys;
+    i = lower_bound(data, key);
+    if (i == n || compare_keys(key_at(data, i), key) != 0) {
+        release_page(page, data, false);
+        return false;
+    }
+    memmove(key_at(data, i), key_at(data, i + 1), (n - i - 1) * key_size);
+    memmove(values(data) + i, values(data) + i + 1, (n - i - 1) * sizeof(int32_t));
+    header(data)->num_keys--;
+    file.GetSuperblock()->num_keys--;
+    rebalance(path, depth, page, data);
+    return true;
+}
+
+/* Restores the minimum fill of a page after a
+ * deletion.  An empty root leaf empties the tree
+ * and a root with one child hands the root to
+ * it.  Otherwise a page below the minimum is
+ * merged with a neighbor if both fit in one page,
+ * the right into the left, freeing the right and
+ * removing it from the parent, which then is
+ * rebalanced in turn; if not, the page takes one
+ * key from the neighbor.  The neighbor is the
+ * left sibling, or the right for a first child.
+ */
+void PagedBPlusTree::rebalance( path_entry * path, int depth, uint32_t page, char * data )
+{
+    bpt_superblock * sb = file.GetSuperblock();
+    uint32_t parent, left, right, next;
+    char * parent_data, * left_data, * right_data, * next_data;
+    int n, ln, rn, min_keys, index, k;
+    bool is_leaf = header(data)->type == BPTREE_PAGE_LEAF;
+
+    n = header(data)->num_keys;
+    if (depth == 0) {
+        if (n > 0) {
+            release_page(page, data, true);
+            return;
+        }
+        sb->root_page = is_leaf ? BPTREE_PAGE_NULL : children(data)[0];
+        free_page(page, data);
+        return;
+    }
+    min_keys = is_leaf ? cut(order - 1) : cut(order) - 1;
+    if (n >= min_keys) {
+        release_page(page, data, true);
+        return;
+    }
+
+    parent = path[depth - 1].page;
+    index = path[depth - 1].index;
+    parent_data = fetch_page(parent);
+    if (index > 0) {
+        left = children(parent_data)[index - 1];
+        left_data = fetch_page(left);
+        right = page;
+        right_data = data;
+        k = index - 1;
+    }
+    else {
+        left = page;
+        left_data = data;
+        right = children(parent_data)[1];
+        right_data = fetch_page(right);
+        k = 0;
+    }
+    ln = header(left_data)->num_keys;
+    rn = header(right_data)->num_keys;
+
+    if (ln + rn + (is_leaf ? 0 : 1) <= order - 1) {
+        if (is_leaf) {
+            memcpy(key_at(left_data, ln), key_at(right_data, 0), rn * key_size);
+            memcpy(values(left_data) + ln, values(right_data), rn * sizeof(int32_t));
+            header(left_data)->num_keys = ln + rn;
+            next = header(right_data)->next;
+            header(left_data)->next = next;
+            if (next != BPTREE_PAGE_NULL) {
+                next_data = fetch_page(next);
+                header(next_data)->prev = left;
+                release_page(next, next_data, true);
+            }
+        }
+        else {
+            store_key(key_at(left_data, ln), key_at(parent_data, k));
+            memcpy(key_at(left_data, ln + 1), key_at(right_data, 0), rn * key_size);
+            memcpy(children(left_data) + ln + 1, children(right_data), (rn + 1) * sizeof(uint32_t));
+            header(left_data)->num_keys = ln + 1 + rn;
+        }
+        free_page(right, right_data);
+        release_page(left, left_data, true);
+
+        n = header(parent_data)->num_keys;
+        memmove(key_at(parent_data, k), key_at(parent_data, k + 1), (n - k - 1) * key_size);
+        memmove(children(parent_data) + k + 1, children(parent_data) + k + 2, (n - k - 1) * sizeof(uint32_t));
+        header(parent_data)->num_keys--;
+        rebalance(path, depth - 1, parent, parent_data);
+        return;
+    }
+
+    if (index > 0) {
+        /* Take the last key of the left neighbor.
+         */
+        memmove(key_at(right_data, 1), key_at(right_data, 0), rn * key_size);
+        if (is_leaf) {
+            memmove(values(right_data) + 1, values(right_data), rn * sizeof(int32_t));
+            store_key(key_at(right_data, 0), key_at(left_data, ln - 1));
+            values(right_data)[0] = values(left_data)[ln - 1];
+            store_key(key_at(parent_data, k), key_at(right_data, 0));
+        }
+        else {
+            memmove(children(right_data) + 1, children(right_data), (rn + 1) * sizeof(uint32_t));
+            store_key(key_at(right_data, 0), key_at(parent_data, k));
+            children(right_data)[0] = children(left_data)[ln];
+            store_key(key_at(parent_data, k), key_at(left_data, ln - 1));
+        }
+    }
+    else {
+        /* Take the first key of the right neighbor.
+         */
+        if (is_leaf) {
+            store_key(key_at(left_data, ln), key_at(right_data, 0));
+            values(left_data)[ln] = values(right_data)[0];
+            memmove(values(right_data), values(right_data) + 1, (rn - 1) * sizeof(int32_t));
+            memmove(key_at(right_data, 0), key_at(right_data, 1), (rn - 1) * key_size);
+            store_key(key_at(parent_data, k), key_at(right_data, 0));
+        }
+        else {
+            store_key(key_at(left_data, ln), key_at(parent_data, k));
+            children(left_data)[ln + 1] = children(right_data)[0];
+            store_key(key_at(parent_data, k), key_at(right_data, 0));
+            memmove(key_at(right_data, 0), key_at(right_data, 1), (rn - 1) * key_size);
+            memmove(children(right_data), children(right_data) + 1, rn * sizeof(uint32_t));
+        }
+    }
+    header(left_data)->num_keys = index > 0 ? ln - 1 : ln + 1;
+    header(right_data)->num_keys = index > 0 ? rn + 1 : rn - 1;
+    release_page(left, left_data, true);
+    release_page(right, right_data, true);
+    release_page(parent, parent_data, true);
+}
+
+bool PagedBPlusTree::find_value( char * key, int * value )
+{
+    uint32_t page;
+    char * data;
+    int depth, i;
+    bool found = false;
+
+    bpt_latch_read_lock(&tree_latch);
+    page = find_leaf(key, NULL, &depth);
+    if (page != BPTREE_PAGE_NULL) {
+        data = fetch_page(page);
+        i = lower_bound(data, key);
+        found = i < header(data)->num_keys && compare_keys(key_at(data, i), key) == 0;
+        if (found)
+            *value = values(data)[i];
+        release_page(page, data, false);
+    }
+    bpt_latch_read_unlock(&tree_latch);
+    return found;
+}
+
+/* Scans from the first key not less than lo along
+ * the leaf chain until a key greater than hi.
+ */
+scan_result PagedBPlusTree::scan( char * lo, char * hi, scan_callback fn, void * arg )
+{
+    scan_result result;
+    record r;
+    uint32_t page, next;
+    char * data;
+    int depth, i;
+
+    result.count = 0;
+    result.sum = 0;
+    result.min = 0;
+    result.max = 0;
+    if (compare_keys(lo, hi) > 0)
+        return result;
+    bpt_latch_read_lock(&tree_latch);
+    page = find_leaf(lo, NULL, &depth);
+    if (page == BPTREE_PAGE_NULL) {
+        bpt_latch_read_unlock(&tree_latch);
+        return result;
+    }
+    data = fetch_page(page);
+    i = lower_bound(data, lo);
+    for (;;) {
+        for (; i < header(data)->num_keys; i++) {
+            if (compare_keys(key_at(data, i), hi) > 0)
+                break;
+            r.value = values(data)[i];
+            if (result.count == 0 || r.value < result.min)
+                result.min = r.value;
+            if (result.count == 0 || r.value > result.max)
+                result.max = r.value;
+            result.count++;
+            result.sum += r.value;
+            if (fn != NULL)
+                fn(key_at(data, i), &r, arg);
+        }
+        next = i < header(data)->num_keys ? BPTREE_PAGE_NULL : header(data)->next;
+        release_page(page, data, false);
+        if (next == BPTREE_PAGE_NULL)
+            break;
+        page = next;
+        data = fetch_page(page);
+        i = 0;
+    }
+    bpt_latch_read_unlock(&tree_latch);
+    return result;
+}
+
+/* Makes a change under the exclusive latch and
+ * logs it, then commits the record with the latch
+ * released, so the commits of many threads join
+ * one group.  The checkpointer is woken once the
+ * share of the pool set is changed, or the log
+ * holds the records set past the beginning LSN of
+ * the last checkpoint.  A change waits first for
+ * a checkpoint while the pool has frames past its
+ * number, so the checkpointer is not kept from the
+ * latch while changes fill the pool.
+ */
+bool PagedBPlusTree::apply( int type, char * key, int value )
+{
+    uint64_t lsn = 0;
+    bool changed, log_full = false;
+
+    if (use_log && pool->GetOverflowCount() > 0)
+        wait_checkpoint();
+    bpt_latch_write_lock(&tree_latch);
+    changed = type == BPTREE_WAL_INSERT ? insert_key(key, value) : delete_key(key);
+    if (changed && use_log) {
+        store_key(log_key, key);
+        lsn = wal.Append(type, log_key, value);
+        log_full = lsn - file.GetSuperblock()->checkpoint_lsn > (uint64_t)checkpoint_records;
+    }
+    bpt_latch_write_unlock(&tree_latch);
+    if (lsn == 0)
+        return changed;
+
+    if (!wal.Commit(lsn)) {
+        perror("Log write.");
+        exit(EXIT_FAILURE);
+    }
+    if (log_full || pool->GetDirtyCount() > checkpoint_pages) {
+        bpt_mutex_lock(&checkpoint_mutex);
+        if (!checkpoint_wanted && !checkpoint_busy) {
+            checkpoint_wanted = true;
+            bpt_cond_broadcast(&checkpoint_cond);
+        }
+        bpt_mutex_unlock(&checkpoint_mutex);
+    }
+    return changed;
+}
+
+/* Wakes the checkpointer and waits for the end of
+ * the next checkpoint, or of one under way, which
+ * gives back the frames the pool took past its
+ * number.
+ */
+void PagedBPlusTree::wait_checkpoint()
+{
+    uint64_t taken;
+
+    bpt_mutex_lock(&checkpoint_mutex);
+    taken = checkpoints;
+    if (!checkpoint_wanted && !checkpoint_busy) {
+        checkpoint_wanted = true;
+        bpt_cond_broadcast(&checkpoint_cond);
+    }
+    while (checkpoints == taken && (checkpoint_wanted || checkpoint_busy) && !checkpoint_stop)
+        bpt_cond_wait(&checkpoint_cond, &checkpoint_mutex, -1);
+    bpt_mutex_unlock(&checkpoint_mutex);
+}
+
+/* Takes a checkpoint, one at a time, for Flush
+ * or the checkpointer.
+ */
+bool PagedBPlusTree::checkpoint()
+{
+    bool ok;
+
+    bpt_mutex_lock(&checkpoint_mutex);
+    while (checkpoint_busy)
+        bpt_cond_wait(&checkpoint_cond, &checkpoint_mutex, -1);
+    checkpoint_busy = true;
+    checkpoint_wanted = false;
+    bpt_mutex_unlock(&checkpoint_mutex);
+
+    ok = write_checkpoint();
+
+    bpt_mutex_lock(&checkpoint_mutex);
+    checkpoint_busy = false;
+    if (ok)
+        checkpoints++;
+    bpt_cond_broadcast(&checkpoint_cond);
+    bpt_mutex_unlock(&checkpoint_mutex);
+    return ok;
+}
+
+/* Without a log, writes back the pages changed
+ * and the superblock with the tree latched.  With
+ * one, latches the tree only to begin: copies the
+ * pages changed, and the superblock with the LSN
+ * of the last record, the beginning LSN, which the
+ * latch keeps the last change made, and rotates
+ * the log.  Changes go on while the copies are
+ * written, and the log is truncated up to the
+ * beginning LSN at the end.
+ */
+bool PagedBPlusTree::write_checkpoint()
+{
+    bpt_superblock sb;
+    uint32_t * pages;
+    char * data;
+    uint64_t lsn;
+    bool ok;
+    int n;
+
+    if (!use_log) {
+        bpt_latch_write_lock(&tree_latch);
+        ok = pool->FlushAll();
+        ok = file.WriteSuperblock() && file.Sync() && ok;
+        bpt_latch_write_unlock(&tree_latch);
+        return ok;
+    }
+    bpt_latch_write_lock(&tree_latch);
+    lsn = wal.GetLastLSN();
+    file.GetSuperblock()->checkpoint_lsn = lsn;
+    sb = *file.GetSuperblock();
+    n = pool->BeginCheckpoint(&pages, &data);
+    wal.Rotate();
+    bpt_latch_write_unlock(&tree_latch);
+
+    ok = file.WriteCheckpoint(&sb, pages, data, n);
+    pool->EndCheckpoint(pages, n, ok);
+    free(pages);
+    free(data);
+    return ok && wal.Truncate(lsn);
+}
+
+void PagedBPlusTree::checkpoint_task( void * arg, int /*index*/ )
+{
+    ((PagedBPlusTree *)arg)->run_checkpointer();
+}
+
+/* Waits to be woken by a change, and takes a
+ * checkpoint, until stopped.
+ */
+void PagedBPlusTree::run_checkpointer()
+{
+    bpt_mutex_lock(&checkpoint_mutex);
+    while (!checkpoint_stop) {
+        if (!checkpoint_wanted) {
+            bpt_cond_wait(&checkpoint_cond, &checkpoint_mutex, -1);
+            continue;
+        }
+        bpt_mutex_unlock(&checkpoint_mutex);
+        if (!checkpoint()) {
+            perror("Checkpoint.");
+            exit(EXIT_FAILURE);
+        }
+        bpt_mutex_lock(&checkpoint_mutex);
+    }
+    bpt_mutex_unlock(&checkpoint_mutex);
+}
+
+/* Replays a logged change while the tree is
+ * opened.
+ */
+void PagedBPlusTree::replay_record( void * arg, int type, char * key, int value )
+{
+    PagedBPlusTree * tree = (PagedBPlusTree *)arg;
+
+    if (type == BPTREE_WAL_INSERT)
+        tree->insert_key(key, value);
+    else if (type == BPTREE_WAL_DELETE)
+        tree->delete_key(key);
+}
@@ -0,0 +1,331 @@
+/******************************************************************************
+ *
+ *  @brief Paged B+ Tree
+ *
+ *  @file bplustree_paged.h
+ *
+ *  B+ tree stored in a page file, one node per page.  Children and
+ *  sibling leaves are named by page ID instead of pointer, and a leaf
+ *  holds the values of its keys inline, so the file is the whole tree:
+ *  opening it reads the superblock only, and nodes are read as lookups
+ *  reach them.  Pages freed by coalescing go to the free list of the
+ *  file and are reused before the file grows.  Keys are as in BPlusTree.
+ *
+ *  With a write-ahead log the tree is crash safe.  Insert and Delete log
+ *  their change and return once it is durable, and pages reach the file
+ *  only at checkpoints, written as one through the journal of the file,
+ *  so after a crash the file holds the last checkpoint whole and opening
+ *  the tree replays the log past it.
+ *
+ *  Checkpoints are fuzzy, taken by a checkpointer thread while changes go
+ *  on.  Only their beginning stops changes: the pages changed are copied
+ *  out of the pool, the superblock records the LSN of the last record as
+ *  the beginning LSN, and the log rotates to its other segment.  The
+ *  copies are then written and synced with the tree unlatched, and at the
+ *  end the log is truncated up to the beginning LSN.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_PAGED_HEADER
+#define _BPLUSTREE_PAGED_HEADER
+
+#include "bplustree.h"
+#include "bplustree_pagefile.h"
+#include "bplustree_bufferpool.h"
+#include "bplustree_wal.h"
+
+/**
+ * Types of page.
+ */
+#define BPTREE_PAGE_LEAF 1
+#define BPTREE_PAGE_INTERNAL 2
+#define BPTREE_PAGE_FREE 3
+
+/**
+ * Default checkpoint triggers: the percent of the
+ * frames of the pool changed, and the number of log
+ * records since the last checkpoint.
+ */
+#define BPTREE_CHECKPOINT_DIRTY_PERCENT 50
+#define BPTREE_CHECKPOINT_LOG_RECORDS 65536
+
+/**
+ * PagedBPlusTree class.
+ * Pages are cached in a buffer pool of a bounded number
+ * of frames, pinned while a lookup or change uses them,
+ * with the internal pages kept resident over the leaves.
+ * Changed pages are written back by the pool, and the
+ * superblock by Flush and Close.  Lookups, Insert and
+ * Delete may be called from many threads at once: the
+ * tree is latched, shared by lookups and exclusive by
+ * changes, and with a log a change waits for its record
+ * to be committed after the latch is released, so the
+ * records of many threads are synced together.
+ */
+class BPTREE_INTERFACE_API PagedBPlusTree
+{
+public:
+    PagedBPlusTree();
+
+    /**
+     * PagedBPlusTree destructor, closes the tree.
+     */
+    ~PagedBPlusTree();
+public:
+    /**
+     * Opens the tree in a page file, or creates the file with
+     * an empty tree.  An existing file keeps the order, key
+     * settings and page size it was created with, and the
+     * arguments are ignored.
+     * @param path          Path of the file
+     * @param nOrder        Order of a new tree(>=3 or BPTREE_ORDER_AUTO,Default:auto), lowered to fit a page
+     * @param nKeyLength    Length of key(Default:4), ignored in integer key mode
+     * @param nKeyType      Key type(BPTREE_KEY_TYPE_STRING or BPTREE_KEY_TYPE_INTEGER,Default:string)
+     * @param nPageSize     Page size of a new file, a power of two(Default:4096)
+     * @return      Return false if the file can not be opened, is not a page file, or a key does not fit a page.
+     */
+    bool Open( const char * path, int nOrder = BPTREE_ORDER_AUTO, int nKeyLength = BPTREE_DEFAULT_KEY_LENGTH, int nKeyType = BPTREE_KEY_TYPE_STRING, int nPageSize = BPTREE_PAGE_SIZE );
+
+    /**
+     * Sets the buffer pool of the tree, taking effect when
+     * the tree is next opened.
+     * @param nFrames   Number of pages cached(Default:BPTREE_POOL_DEFAULT_FRAMES)
+     * @param nPolicy   Eviction policy(BPTREE_EVICT_CLOCK, BPTREE_EVICT_LRU_K or BPTREE_EVICT_2Q,Default:clock)
+     */
+    void SetBufferPool( int nFrames, int nPolicy = BPTREE_EVICT_CLOCK );
+
+    /**
+     * Turns the write-ahead log on or off, taking effect when
+     * the tree is next opened.  The log is kept beside the
+     * file, and a checkpoint is taken in the background as
+     * set by SetCheckpoint, and by Flush and by Close.
+     * A tree opened without the log replays and drops a log
+     * left beside it by a logged session, or only drops it
+     * when the file is created.
+     * @param enable        Turns the log on
+     * @param nCommitWindow Microseconds a commit waits for others to join it(Default:BPTREE_WAL_COMMIT_WINDOW)
+     */
+    void SetWriteAheadLog( bool enable, int nCommitWindow = BPTREE_WAL_COMMIT_WINDOW );
+
+    /**
+     * Sets when the checkpointer takes a checkpoint with the
+     * log, taking effect when the tree is next opened: once
+     * a share of the pool is changed, or the log holds a
+     * number of records since the last checkpoint.  Pages
+     * changed stay in the pool until a checkpoint, so the
+     * share bounds how often a small pool is checkpointed,
+     * at about once per that many pages changed, and the
+     * records how long opening the tree replays the log.
+     * @param nDirtyPercent Percent of the frames changed(1-100,Default:BPTREE_CHECKPOINT_DIRTY_PERCENT)
+     * @param nLogRecords   Records in the log(>=1,Default:BPTREE_CHECKPOINT_LOG_RECORDS)
+     */
+    void SetCheckpoint( int nDirtyPercent = BPTREE_CHECKPOINT_DIRTY_PERCENT, int nLogRecords = BPTREE_CHECKPOINT_LOG_RECORDS );
+
+    /**
+     * Returns the log of the open tree, or NULL.
+     */
+    BPTreeWAL * GetWriteAheadLog();
+
+    /**
+     * Returns the buffer pool of the open tree, or NULL.
+     */
+    BPTreeBufferPool * GetBufferPool();
+
+    /**
+     * Flushes and closes the tree.
+     */
+    void Close();
+
+    /**
+     * Writes back the pages changed and the superblock, and
+     * flushes the file to the disk.  With a log, takes a
+     * checkpoint and empties the log.
+     * @return      Return false on an I/O error.
+     */
+    bool Flush();
+
+    /**
+     * Inserts a key and an associated value.  A key already
+     * in the tree is left as is.
+     * @param key       The key
+     * @param value     The value
+     * @return      Return true if the key was inserted.
+     */
+    bool Insert( char * key, int value );
+    bool Insert( int key, int value );
+
+    /**
+     * Deletes a key.
+     * @param key       The key
+     * @return      Return true if the key was in the tree.
+     */
+    bool Delete( char * key );
+    bool Delete( int key );
+
+    /**
+     * Finds the value under a key.
+     * @param key       The key
+     * @param value     Set to the value if found
+     * @return      Return true if the key was found.
+     */
+    bool FindValue( char * key, int * value );
+    bool FindValue( int key, int * value );
+
+    /**
+     * Scans the keys from lo to hi in order, as
+     * BPlusTree::ParallelScan does on one thread.
+     * @param lo        The smallest key
+     * @param hi        The largest key
+     * @param fn        Function called for each key, or NULL(Default:NULL)
+     * @param arg       Argument passed to fn(Default:NULL)
+     * @return      Return the count, sum, minimum and maximum of the values.
+     */
+    scan_result Scan( char * lo, char * hi, scan_callback fn = NULL, void * arg = NULL );
+    scan_result Scan( int lo, int hi, scan_callback fn = NULL, void * arg = NULL );
+
+    /**
+     * Returns the order of the tree.
+     */
+    int GetOrder();
+
+    /**
+     * Returns the number of keys in the tree.
+     */
+    uint64_t GetKeyCount();
+
+    /**
+     * Returns the number of pages in the file.
+     */
+    uint32_t GetPageCount();
+
+    /**
+     * Returns the number of checkpoints taken since the
+     * tree was opened.
+     */
+    uint64_t GetCheckpointCount();
+private:
+    /**
+     * Header at the start of a node page.  In a free
+     * page next links to the next free page.
+     */
+    typedef struct page_header {
+        uint16_t type;      /**< BPTREE_PAGE_LEAF, BPTREE_PAGE_INTERNAL or BPTREE_PAGE_FREE.*/
+        uint16_t num_keys;  /**< Number of valid keys.*/
+        uint32_t next;      /**< Next leaf, or next free page.*/
+        uint32_t prev;      /**< Previous leaf.*/
+        uint32_t reserved;
+    } page_header;
+
+    /**
+     * Step of a descent: a page and the index of
+     * the child taken from it.
+     */
+    typedef struct path_entry {
+        uint32_t page;
+        int index;
+    } path_entry;
+
+    int page_layout( int nOrder, int * pointers_offset );
+    char * format_key( int key );
+    char * make_key( char * key, int64_t * num );
+    int compare_keys( const char * a, const char * b );
+    void store_key( char * dest, const char * src );
+    void store_separator( char * dest, const char * left, const char * right );
+    page_header * header( char * page );
+    char * key_at( char * page, int index );
+    int32_t * values( char * page );
+    uint32_t * children( char * page );
+    int lower_bound( char * page, const char * key );
+    int upper_bound( char * page, const char * key );
+    int cut( int length );
+
+    char * fetch_page( uint32_t page );
+    void release_page( uint32_t page, char * data, bool dirty );
+    char * new_page( uint32_t * page, int type );
+    void free_page( uint32_t page, char * data );
+
+    uint32_t find_leaf( char * key, path_entry * path, int * depth );
+    bool insert_key( char * key, int value );
+    void split_leaf( path_entry * path, int depth, uint32_t page, char * data, int index, char * key, int value );
+    void insert_into_parent( path_entry * path, int depth, uint32_t left, char * key, uint32_t right );
+    bool delete_key( char * key );
+    void rebalance( path_entry * path, int depth, uint32_t page, char * data );
+    bool find_value( char * key, int * value );
+    scan_result scan( char * lo, char * hi, scan_callback fn, void * arg );
+    void close_tree();
+    bool recover_log( const char * log_path );
+    bool apply( int type, char * key, int value );
+    void wait_checkpoint();
+    bool checkpoint();
+    bool write_checkpoint();
+    void run_checkpointer();
+    static void checkpoint_task( void * arg, int index );
+    static void replay_record( void * arg, int type, char * key, int value );
+private:
+    /**
+     * The page file.
+     */
+    BPTreePageFile file;
+
+    /**
+     * The buffer pool while open, and its settings.
+     */
+    BPTreeBufferPool * pool;
+    int pool_frames;
+    int pool_policy;
+
+    /**
+     * The log, whether it is used, the commit window, the
+     * checkpoint triggers set and the dirty pages at which
+     * a checkpoint is taken, and the key slot of a record.
+     */
+    BPTreeWAL wal;
+    bool use_log;
+    int commit_window;
+    int checkpoint_percent;
+    int checkpoint_records;
+    int checkpoint_pages;
+    char * log_key;
+
+    /**
+     * The checkpointer thread, the mutex and condition of
+     * its state, whether a checkpoint is wanted or being
+     * taken, whether the thread is to stop, and the number
+     * of checkpoints taken.
+     */
+    bpt_thread checkpointer;
+    bpt_mutex checkpoint_mutex;
+    bpt_cond checkpoint_cond;
+    bool checkpoint_wanted;
+    bool checkpoint_busy;
+    bool checkpoint_stop;
+    uint64_t checkpoints;
+
+    /**
+     * Latch of the tree.
+     */
+    bpt_latch tree_latch;
+
+    /**
+     * Order, type, length and slot size of key, as in
+     * BPlusTree, page size and offset of the values or
+     * children in a page.
+     */
+    int order;
+    int key_type;
+    int key_length;
+    int key_size;
+    int page_size;
+    int pointers_offset;
+
+    /**
+     * Scratch space of a split: order keys, order + 1
+     * children or order values, and the key promoted
+     * to the parent.
+     */
+    char * split_keys;
+    uint32_t * split_children;
+    int32_t * split_values;
+    char * promoted;
+};
+
+#endif
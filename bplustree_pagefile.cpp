@@ -0,0 +1,396 @@
+#include "bplustree_pagefile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef BPTREE_OS_WINDOWS
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bpt_file bpt_file_open( const char * path, bool create, bool * created )
+{
+    bpt_file f;
+    bool is_new = false;
+
+#ifdef BPTREE_OS_WINDOWS
+    f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE && create && GetLastError() == ERROR_FILE_NOT_FOUND) {
+        f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                        CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        is_new = true;
+    }
+#else
+    f = open(path, O_RDWR);
+    if (f < 0 && create && errno == ENOENT) {
+        f = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        is_new = true;
+    }
+    if (f < 0)
+        f = BPTREE_FILE_NONE;
+#endif
+    if (created != NULL)
+        *created = is_new && f != BPTREE_FILE_NONE;
+    return f;
+}
+
+void bpt_file_close( bpt_file f )
+{
+    if (f == BPTREE_FILE_NONE)
+        return;
+#ifdef BPTREE_OS_WINDOWS
+    CloseHandle(f);
+#else
+    close(f);
+#endif
+}
+
+bool bpt_file_read( bpt_file f, uint64_t offset, void * buffer, size_t size )
+{
+    char * p = (char *)buffer;
+#ifdef BPTREE_OS_WINDOWS
+    OVERLAPPED overlapped;
+    DWORD done;
+
+    while (size > 0) {
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        if (!ReadFile(f, p, (DWORD)size, &done, &overlapped)) {
+            if (GetLastError() != ERROR_HANDLE_EOF)
+                return false;
+            done = 0;
+        }
+        if (done == 0)
+            break;
+        p += done;
+        offset += done;
+        size -= done;
+    }
+#else
+    ssize_t done;
+
+    while (size > 0) {
+        done = pread(f, p, size, (off_t)offset);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (done == 0)
+            break;
+        p += done;
+        offset += done;
+        size -= done;
+    }
+#endif
+    memset(p, 0, size);
+    return true;
+}
+
+bool bpt_file_write( bpt_file f, uint64_t offset, const void * buffer, size_t size )
+{
+    const char * p = (const char *)buffer;
+#ifdef BPTREE_OS_WINDOWS
+    OVERLAPPED overlapped;
+    DWORD done;
+
+    while (size > 0) {
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(f, p, (DWORD)size, &done, &overlapped))
+            return false;
+        p += done;
+        offset += done;
+        size -= done;
+    }
+#else
+    ssize_t done;
+
+    while (size > 0) {
+        done = pwrite(f, p, size, (off_t)offset);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += done;
+        offset += done;
+        size -= done;
+    }
+#endif
+    return true;
+}
+
+bool bpt_file_sync( bpt_file f )
+{
+#ifdef BPTREE_OS_WINDOWS
+    return FlushFileBuffers(f) != 0;
+#else
+    return fsync(f) == 0;
+#endif
+}
+
+bool bpt_file_size( bpt_file f, uint64_t * size )
+{
+#ifdef BPTREE_OS_WINDOWS
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(f, &file_size))
+        return false;
+    *size = (uint64_t)file_size.QuadPart;
+#else
+    struct stat st;
+    if (fstat(f, &st) != 0)
+        return false;
+    *size = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
+bool bpt_file_truncate( bpt_file f, uint64_t size )
+{
+#ifdef BPTREE_OS_WINDOWS
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)size;
+    return SetFilePointerEx(f, offset, NULL, FILE_BEGIN) && SetEndOfFile(f);
+#else
+    return ftruncate(f, (off_t)size) == 0;
+#endif
+}
+
+BPTreePageFile::BPTreePageFile()
+{
+    fd = BPTREE_FILE_NONE;
+    journal = BPTREE_FILE_NONE;
+    journal_path = NULL;
+    memset(&superblock, 0, sizeof(superblock));
+}
+
+BPTreePageFile::~BPTreePageFile()
+{
+    Close();
+}
+
+/* Opens an existing page file and checks its
+ * superblock, or creates the file with a fresh
+ * superblock holding only itself.
+ */
+bool BPTreePageFile::Open( const char * path, int nPageSize, bool * created )
+{
+    bool is_new;
+
+    Close();
+    fd = bpt_file_open(path, true, &is_new);
+    if (fd == BPTREE_FILE_NONE)
+        return false;
+    journal_path = (char *)malloc(strlen(path) + sizeof(BPTREE_JOURNAL_SUFFIX));
+    if (journal_path == NULL) {
+        perror("Page file.");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(journal_path, "%s%s", path, BPTREE_JOURNAL_SUFFIX);
+
+    if (is_new) {
+        if (nPageSize < BPTREE_MIN_PAGE_SIZE || nPageSize > BPTREE_MAX_PAGE_SIZE
+                || (nPageSize & (nPageSize - 1)) != 0)
+            nPageSize = BPTREE_PAGE_SIZE;
+        memset(&superblock, 0, sizeof(superblock));
+        memcpy(superblock.magic, BPTREE_PAGEFILE_MAGIC, sizeof(superblock.magic));
+        superblock.version = BPTREE_PAGEFILE_VERSION;
+        superblock.page_size = nPageSize;
+        superblock.root_page = BPTREE_PAGE_NULL;
+        superblock.page_count = 1;
+        superblock.free_list = BPTREE_PAGE_NULL;
+        if (!WriteSuperblock() || !Sync()) {
+            Close();
+            return false;
+        }
+    }
+    else if (!recover_journal()
+            || !bpt_file_read(fd, 0, &superblock, sizeof(superblock))
+            || memcmp(superblock.magic, BPTREE_PAGEFILE_MAGIC, sizeof(superblock.magic)) != 0
+            || superblock.version != BPTREE_PAGEFILE_VERSION
+            || superblock.page_size < BPTREE_MIN_PAGE_SIZE
+            || superblock.page_size > BPTREE_MAX_PAGE_SIZE) {
+        Close();
+        return false;
+    }
+    if (created != NULL)
+        *created = is_new;
+    return true;
+}
+
+void BPTreePageFile::Close()
+{
+    bpt_file_close(fd);
+    bpt_file_close(journal);
+    fd = BPTREE_FILE_NONE;
+    journal = BPTREE_FILE_NONE;
+    free(journal_path);
+    journal_path = NULL;
+}
+
+bool BPTreePageFile::IsOpen()
+{
+    return fd != BPTREE_FILE_NONE;
+}
+
+bool BPTreePageFile::ReadPage( uint32_t page, void * buffer )
+{
+    return bpt_file_read(fd, (uint64_t)page * superblock.page_size, buffer, superblock.page_size);
+}
+
+bool BPTreePageFile::WritePage( uint32_t page, const void * buffer )
+{
+    return bpt_file_write(fd, (uint64_t)page * superblock.page_size, buffer, superblock.page_size);
+}
+
+/* Writes the superblock padded with zeros
+ * to a whole page.
+ */
+bool BPTreePageFile::WriteSuperblock()
+{
+    char * buffer;
+    bool ok;
+
+    buffer = (char *)calloc(1, superblock.page_size);
+    if (buffer == NULL) {
+        perror("Superblock.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(buffer, &superblock, sizeof(superblock));
+    ok = WritePage(0, buffer);
+    free(buffer);
+    return ok;
+}
+
+bool BPTreePageFile::Sync()
+{
+    return bpt_file_sync(fd);
+}
+
+/* Writes the journal and flushes it, then the
+ * pages and superblock in place, and empties
+ * the journal once they are on the disk.
+ */
+bool BPTreePageFile::WriteCheckpoint( const bpt_superblock * sb, const uint32_t * pages, const char * data, int count )
+{
+    bpt_journal_header header;
+    uint64_t ids_size, offset;
+    char * sb_page;
+    bool ok;
+    int i;
+
+    if (!open_journal(true))
+        return false;
+    sb_page = (char *)calloc(1, superblock.page_size);
+    if (sb_page == NULL) {
+        perror("Checkpoint.");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sb_page, sb, sizeof(*sb));
+
+    ids_size = ((uint64_t)count * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BPTREE_JOURNAL_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.page_size = superblock.page_size;
+    header.checksum = bpt_fnv1a(pages, (size_t)count * sizeof(uint32_t), BPTREE_FNV_BASIS);
+    header.checksum = bpt_fnv1a(sb_page, superblock.page_size, header.checksum);
+    header.checksum = bpt_fnv1a(data, (size_t)count * superblock.page_size, header.checksum);
+
+    offset = sizeof(header);
+    ok = bpt_file_write(journal, offset, pages, (size_t)count * sizeof(uint32_t));
+    offset += ids_size;
+    ok = ok && bpt_file_write(journal, offset, sb_page, superblock.page_size);
+    offset += superblock.page_size;
+    ok = ok && bpt_file_write(journal, offset, data, (size_t)count * superblock.page_size);
+    ok = ok && bpt_file_write(journal, 0, &header, sizeof(header));
+    ok = ok && bpt_file_sync(journal);
+
+    for (i = 0; i < count && ok; i++)
+        ok = WritePage(pages[i], data + (size_t)i * superblock.page_size);
+    ok = ok && WritePage(0, sb_page) && Sync();
+    ok = ok && clear_journal();
+    free(sb_page);
+    return ok;
+}
+
+bpt_superblock * BPTreePageFile::GetSuperblock()
+{
+    return &superblock;
+}
+
+int BPTreePageFile::GetPageSize()
+{
+    return superblock.page_size;
+}
+
+/* Writes again the checkpoint in the journal if
+ * it is whole.  A journal cut short is from a
+ * checkpoint that never reached the file, and
+ * is dropped.
+ */
+bool BPTreePageFile::recover_journal()
+{
+    bpt_journal_header header;
+    uint64_t size, ids_size, expected;
+    uint32_t * pages;
+    char * data;
+    uint32_t checksum;
+    bool ok = true;
+    uint32_t i;
+
+    if (!open_journal(false))
+        return true;
+    if (!bpt_file_size(journal, &size))
+        return false;
+    if (size < sizeof(header) || !bpt_file_read(journal, 0, &header, sizeof(header))
+            || memcmp(header.magic, BPTREE_JOURNAL_MAGIC, sizeof(header.magic)) != 0
+            || header.page_size < BPTREE_MIN_PAGE_SIZE || header.page_size > BPTREE_MAX_PAGE_SIZE)
+        return clear_journal();
+    ids_size = ((uint64_t)header.count * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    expected = sizeof(header) + ids_size + (uint64_t)(header.count + 1) * header.page_size;
+    if (size < expected)
+        return clear_journal();
+
+    pages = (uint32_t *)malloc(ids_size > 0 ? ids_size : 1);
+    data = (char *)malloc((size_t)(header.count + 1) * header.page_size);
+    if (pages == NULL || data == NULL) {
+        perror("Journal recovery.");
+        exit(EXIT_FAILURE);
+    }
+    ok = bpt_file_read(journal, sizeof(header), pages, (size_t)header.count * sizeof(uint32_t))
+        && bpt_file_read(journal, sizeof(header) + ids_size, data, (size_t)(header.count + 1) * header.page_size);
+    if (ok) {
+        checksum = bpt_fnv1a(pages, (size_t)header.count * sizeof(uint32_t), BPTREE_FNV_BASIS);
+        checksum = bpt_fnv1a(data, (size_t)(header.count + 1) * header.page_size, checksum);
+        if (checksum == header.checksum) {
+            ok = bpt_file_write(fd, 0, data, header.page_size);
+            for (i = 0; i < header.count && ok; i++)
+                ok = bpt_file_write(fd, (uint64_t)pages[i] * header.page_size,
+                                    data + (size_t)(i + 1) * header.page_size, header.page_size);
+            ok = ok && Sync();
+        }
+    }
+    free(pages);
+    free(data);
+    return ok && clear_journal();
+}
+
+bool BPTreePageFile::open_journal( bool create )
+{
+    if (journal == BPTREE_FILE_NONE)
+        journal = bpt_file_open(journal_path, create, NULL);
+    return journal != BPTREE_FILE_NONE;
+}
+
+bool BPTreePageFile::clear_journal()
+{
+    return bpt_file_truncate(journal, 0) && bpt_file_sync(journal);
+}
@@ -0,0 +1,233 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Page File
+ *
+ *  @file bplustree_pagefile.h
+ *
+ *  File of fixed-size pages holding a paged B+ tree.  Page 0 is the
+ *  superblock, which records the page size, the order and key settings
+ *  of the tree, its root page, the number of pages and the head of the
+ *  list of free pages.  Pages are named by their number, the page ID,
+ *  and page ID 0 doubles as the null page ID since the superblock is
+ *  never a node.  Opening a file only reads the superblock.
+ *
+ *  A checkpoint writes a set of pages and the superblock as one: they go
+ *  to a journal file beside the page file first, then in place, and the
+ *  journal is emptied once they are on the disk.  Opening a file whose
+ *  journal holds a whole checkpoint, cut short by a crash, writes the
+ *  checkpoint again, so the file is always at one checkpoint or the next.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_PAGEFILE_HEADER
+#define _BPLUSTREE_PAGEFILE_HEADER
+
+#include <stdint.h>
+#include "bplustree.h"
+
+/**
+ * Null page ID.
+ */
+#define BPTREE_PAGE_NULL 0
+
+/**
+ * Page size limits.  The page size is a power
+ * of two between these.
+ */
+#define BPTREE_MIN_PAGE_SIZE 512
+#define BPTREE_MAX_PAGE_SIZE (64 * 1024)
+
+/**
+ * Magic and version of the page file format.
+ */
+#define BPTREE_PAGEFILE_MAGIC "BPTPAGES"
+#define BPTREE_PAGEFILE_VERSION 2
+
+/**
+ * Magic of the journal, and the suffix of its path.
+ */
+#define BPTREE_JOURNAL_MAGIC "BPTJOURN"
+#define BPTREE_JOURNAL_SUFFIX "-journal"
+
+/**
+ * Superblock, stored at the start of page 0.
+ */
+typedef struct bpt_superblock {
+    char magic[8];          /**< BPTREE_PAGEFILE_MAGIC.*/
+    uint32_t version;       /**< BPTREE_PAGEFILE_VERSION.*/
+    uint32_t page_size;     /**< Size of a page in bytes.*/
+    int32_t order;          /**< Order of the tree.*/
+    int32_t key_length;     /**< Length of key, as given to the tree.*/
+    int32_t key_type;       /**< Type of key.*/
+    uint32_t root_page;     /**< Root page, BPTREE_PAGE_NULL if empty.*/
+    uint32_t page_count;    /**< Pages in the file, the superblock included.*/
+    uint32_t free_list;     /**< First free page, BPTREE_PAGE_NULL if none.*/
+    uint64_t num_keys;      /**< Keys in the tree.*/
+    uint64_t checkpoint_lsn; /**< Last log record in the file, 0 if none.*/
+} bpt_superblock;
+
+/**
+ * Header of the journal, followed by the page IDs, the
+ * superblock page and the pages.  The checksum covers
+ * all that follows the header.
+ */
+typedef struct bpt_journal_header {
+    char magic[8];          /**< BPTREE_JOURNAL_MAGIC.*/
+    uint32_t count;         /**< Pages, the superblock not included.*/
+    uint32_t page_size;     /**< Size of a page in bytes.*/
+    uint32_t checksum;      /**< FNV-1a of the rest of the journal.*/
+    uint32_t reserved;
+} bpt_journal_header;
+
+/**
+ * FNV-1a hash of a block, continuing from hash,
+ * which starts at BPTREE_FNV_BASIS.
+ */
+#define BPTREE_FNV_BASIS 2166136261u
+
+static inline uint32_t bpt_fnv1a( const void * p, size_t size, uint32_t hash )
+{
+    const unsigned char * c = (const unsigned char *)p;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ c[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Open file of the platform, and the value of none.
+ */
+#ifdef BPTREE_OS_WINDOWS
+typedef void * bpt_file;
+#define BPTREE_FILE_NONE ((void *)(intptr_t)-1)
+#else
+typedef int bpt_file;
+#define BPTREE_FILE_NONE (-1)
+#endif
+
+/**
+ * Opens a file for reading and writing, creating it if it
+ * does not exist and create is true.  Sets created, if not
+ * NULL, to whether it was created.  Returns BPTREE_FILE_NONE
+ * if the file can not be opened.
+ */
+BPTREE_INTERFACE_API bpt_file bpt_file_open( const char * path, bool create, bool * created );
+BPTREE_INTERFACE_API void bpt_file_close( bpt_file f );
+
+/**
+ * Reads size bytes at an offset; bytes past the end of
+ * the file read as zeros.
+ */
+BPTREE_INTERFACE_API bool bpt_file_read( bpt_file f, uint64_t offset, void * buffer, size_t size );
+BPTREE_INTERFACE_API bool bpt_file_write( bpt_file f, uint64_t offset, const void * buffer, size_t size );
+BPTREE_INTERFACE_API bool bpt_file_sync( bpt_file f );
+BPTREE_INTERFACE_API bool bpt_file_size( bpt_file f, uint64_t * size );
+BPTREE_INTERFACE_API bool bpt_file_truncate( bpt_file f, uint64_t size );
+
+/**
+ * BPTreePageFile class.
+ * Reads and writes whole pages at their offset in the
+ * file.  Reading a page past the end of the file gives
+ * a page of zeros.
+ */
+class BPTREE_INTERFACE_API BPTreePageFile
+{
+public:
+    BPTreePageFile();
+
+    /**
+     * BPTreePageFile destructor, closes the file.
+     */
+    ~BPTreePageFile();
+public:
+    /**
+     * Opens a page file, creating it if it does not exist, and
+     * writes again a checkpoint left whole in its journal.
+     * @param path      Path of the file
+     * @param nPageSize Page size of a new file; an existing file keeps its own
+     * @param created   Set to true if the file was created, or NULL
+     * @return      Return false if the file can not be opened or is not a page file.
+     */
+    bool Open( const char * path, int nPageSize, bool * created );
+
+    /**
+     * Closes the file, without writing the superblock.
+     */
+    void Close();
+
+    /**
+     * Returns true if a file is open.
+     */
+    bool IsOpen();
+
+    /**
+     * Reads a page.
+     * @param page      The page ID
+     * @param buffer    Buffer of the page size
+     * @return      Return false on an I/O error.
+     */
+    bool ReadPage( uint32_t page, void * buffer );
+
+    /**
+     * Writes a page.
+     * @param page      The page ID
+     * @param buffer    Buffer of the page size
+     * @return      Return false on an I/O error.
+     */
+    bool WritePage( uint32_t page, const void * buffer );
+
+    /**
+     * Writes the superblock to page 0.
+     * @return      Return false on an I/O error.
+     */
+    bool WriteSuperblock();
+
+    /**
+     * Flushes the file to the disk.
+     * @return      Return false on an I/O error.
+     */
+    bool Sync();
+
+    /**
+     * Writes pages and a superblock as one checkpoint,
+     * through the journal, and flushes them to the disk.
+     * The superblock is given, as taken with the pages,
+     * since the tree goes on changing its own meanwhile.
+     * @param sb        The superblock
+     * @param pages     The page IDs
+     * @param data      The pages, one after another
+     * @param count     The number of pages
+     * @return      Return false on an I/O error.
+     */
+    bool WriteCheckpoint( const bpt_superblock * sb, const uint32_t * pages, const char * data, int count );
+
+    /**
+     * Returns the superblock, which the tree updates and
+     * WriteSuperblock stores.
+     */
+    bpt_superblock * GetSuperblock();
+
+    /**
+     * Returns the page size.
+     */
+    int GetPageSize();
+private:
+    bool recover_journal();
+    bool open_journal( bool create );
+    bool clear_journal();
+private:
+    /**
+     * The file and its journal, BPTREE_FILE_NONE if not
+     * open, and the path of the journal.
+     */
+    bpt_file fd;
+    bpt_file journal;
+    char * journal_path;
+
+    /**
+     * The superblock as read or last updated.
+     */
+    bpt_superblock superblock;
+};
+
+#endif
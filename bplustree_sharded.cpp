@@ -0,0 +1,292 @@
+#include "bplustree_sharded.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+ShardedBPlusTree::ShardedBPlusTree( int nShards/* = BPTREE_DEFAULT_SHARDS*/, int nOrder/* = BPTREE_DEFAULT_ORDER*/, int nKeyLength/* = BPTREE_DEFAULT_KEY_LENGTH*/, int nKeyType/* = BPTREE_KEY_TYPE_STRING*/, bool bUseArena/* = true*/ )
+{
+    int i;
+
+    if (nShards < 1)
+        nShards = 1;
+    num_shards = nShards;
+    key_type = nKeyType;
+    key_length = nKeyLength + 1;
+    if (key_length < 0)
+        key_length = BPTREE_DEFAULT_KEY_LENGTH + 1;
+    shards = (shard *)malloc(num_shards * sizeof(shard));
+    if (shards == NULL) {
+        perror("Shard creation.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < num_shards; i++) {
+        shards[i].tree = new BPlusTree(nOrder, nKeyLength, nKeyType);
+        shards[i].arena = bUseArena ? new BPTreeArena() : NULL;
+        shards[i].tree->SetAllocator(shards[i].arena);
+        bpt_latch_init(&shards[i].latch);
+    }
+}
+
+ShardedBPlusTree::~ShardedBPlusTree()
+{
+    int i;
+
+    for (i = 0; i < num_shards; i++) {
+        delete shards[i].tree;
+        delete shards[i].arena;
+    }
+    free(shards);
+}
+
+void ShardedBPlusTree::Insert( char * key, int value )
+{
+    shard * s = shard_of(key);
+    bpt_latch_write_lock(&s->latch);
+    s->tree->Insert(key, value);
+    bpt_latch_write_unlock(&s->latch);
+}
+
+void ShardedBPlusTree::Insert( int key, int value )
+{
+    shard * s = shard_of(key);
+    bpt_latch_write_lock(&s->latch);
+    s->tree->Insert(key, value);
+    bpt_latch_write_unlock(&s->latch);
+}
+
+void ShardedBPlusTree::Delete( char * key )
+{
+    shard * s = shard_of(key);
+    bpt_latch_write_lock(&s->latch);
+    s->tree->Delete(key);
+    bpt_latch_write_unlock(&s->latch);
+}
+
+void ShardedBPlusTree::Delete( int key )
+{
+    shard * s = shard_of(key);
+    bpt_latch_write_lock(&s->latch);
+    s->tree->Delete(key);
+    bpt_latch_write_unlock(&s->latch);
+}
+
+record * ShardedBPlusTree::Find( char * key )
+{
+    shard * s = shard_of(key);
+    bpt_latch_read_lock(&s->latch);
+    record * r = s->tree->Find(key, false);
+    bpt_latch_read_unlock(&s->latch);
+    return r;
+}
+
+record * ShardedBPlusTree::Find( int key )
+{
+    shard * s = shard_of(key);
+    bpt_latch_read_lock(&s->latch);
+    record * r = s->tree->Find(key, false);
+    bpt_latch_read_unlock(&s->latch);
+    return r;
+}
+
+bool ShardedBPlusTree::FindValue( char * key, int * value )
+{
+    shard * s = shard_of(key);
+    bpt_latch_read_lock(&s->latch);
+    bool found = s->tree->FindValue(key, value);
+    bpt_latch_read_unlock(&s->latch);
+    return found;
+}
+
+bool ShardedBPlusTree::FindValue( int key, int * value )
+{
+    shard * s = shard_of(key);
+    bpt_latch_read_lock(&s->latch);
+    bool found = s->tree->FindValue(key, value);
+    bpt_latch_read_unlock(&s->latch);
+    return found;
+}
+
+void ShardedBPlusTree::DestroyBPTree()
+{
+    int i;
+
+    for (i = 0; i < num_shards; i++) {
+        bpt_latch_write_lock(&shards[i].latch);
+        shards[i].tree->DestroyBPTree();
+        bpt_latch_write_unlock(&shards[i].latch);
+    }
+}
+
+int ShardedBPlusTree::GetShardCount()
+{
+    return num_shards;
+}
+
+BPlusTree * ShardedBPlusTree::GetShard( int nShard )
+{
+    if (nShard < 0 || nShard >= num_shards)
+        return NULL;
+    return shards[nShard].tree;
+}
+
+ShardedBPlusTree::iterator ShardedBPlusTree::Begin()
+{
+    std::vector<BPlusTree::iterator> positions;
+    int i;
+
+    for (i = 0; i < num_shards; i++)
+        positions.push_back(shards[i].tree->Begin());
+    return iterator(this, positions);
+}
+
+ShardedBPlusTree::iterator ShardedBPlusTree::End()
+{
+    return iterator();
+}
+
+ShardedBPlusTree::iterator ShardedBPlusTree::LowerBound( char * key )
+{
+    std::vector<BPlusTree::iterator> positions;
+    int i;
+
+    for (i = 0; i < num_shards; i++)
+        positions.push_back(shards[i].tree->LowerBound(key));
+    return iterator(this, positions);
+}
+
+ShardedBPlusTree::iterator ShardedBPlusTree::LowerBound( int key )
+{
+    std::vector<BPlusTree::iterator> positions;
+    int i;
+
+    for (i = 0; i < num_shards; i++)
+        positions.push_back(shards[i].tree->LowerBound(key));
+    return iterator(this, positions);
+}
+
+/* Returns the shard a key hashes to.  The key is
+ * hashed in the form the shards store it, so a key
+ * given as a string and as an integer goes to the
+ * same shard.
+ */
+ShardedBPlusTree::shard * ShardedBPlusTree::shard_of( char * key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER)
+        return &shards[hash_integer(strtoll(key, NULL, 10)) % num_shards];
+    return &shards[hash_key(key) % num_shards];
+}
+
+ShardedBPlusTree::shard * ShardedBPlusTree::shard_of( int key )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER)
+        return &shards[hash_integer(key) % num_shards];
+    char * key_str = shards[0].tree->format_key(key);
+    shard * s = &shards[hash_key(key_str) % num_shards];
+    free(key_str);
+    return s;
+}
+
+/* FNV-1a hash of a string key, over the part of
+ * it the tree compares.
+ */
+uint64_t ShardedBPlusTree::hash_key( const char * key )
+{
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < key_length - 1 && key[i] != '\0'; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Mixes the bits of an integer key, so keys in
+ * sequence spread over all shards.
+ */
+uint64_t ShardedBPlusTree::hash_integer( int64_t key )
+{
+    uint64_t h = (uint64_t)key;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+ShardedBPlusTree::iterator::iterator( ShardedBPlusTree * pOwner, const std::vector<BPlusTree::iterator> & positions )
+    : owner(pOwner), heads(positions)
+{
+    size_t i;
+
+    for (i = 0; i < heads.size(); i++) {
+        if (heads[i] != BPlusTree::iterator()) {
+            heap.push_back((int)i);
+            sift_up(heap.size() - 1);
+        }
+    }
+}
+
+/* Advances the shard at the top of the heap, and
+ * drops it from the heap once it is at its end.
+ */
+ShardedBPlusTree::iterator & ShardedBPlusTree::iterator::operator++()
+{
+    ++heads[heap[0]];
+    if (heads[heap[0]] == BPlusTree::iterator()) {
+        heap[0] = heap.back();
+        heap.pop_back();
+    }
+    if (!heap.empty())
+        sift_down(0);
+    return *this;
+}
+
+bool ShardedBPlusTree::iterator::operator==( const iterator & other ) const
+{
+    if (heap.empty() || other.heap.empty())
+        return heap.empty() && other.heap.empty();
+    return heap[0] == other.heap[0] && heads[heap[0]] == other.heads[heap[0]];
+}
+
+/* Orders two shards by the key each is at.  A key
+ * is in one shard only, but ties are broken by the
+ * shard to keep the order strict.
+ */
+bool ShardedBPlusTree::iterator::heap_less( int a, int b ) const
+{
+    int c = owner->shards[0].tree->compare_keys(heads[a].GetKey(), heads[b].GetKey());
+    return c < 0 || (c == 0 && a < b);
+}
+
+void ShardedBPlusTree::iterator::sift_down( size_t i )
+{
+    size_t child;
+    int s = heap[i];
+
+    while ((child = 2 * i + 1) < heap.size()) {
+        if (child + 1 < heap.size() && heap_less(heap[child + 1], heap[child]))
+            child++;
+        if (!heap_less(heap[child], s))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = s;
+}
+
+void ShardedBPlusTree::iterator::sift_up( size_t i )
+{
+    size_t parent;
+    int s = heap[i];
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!heap_less(s, heap[parent]))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = s;
+}
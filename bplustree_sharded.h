@@ -0,0 +1,215 @@
+/******************************************************************************
+ *
+ *  @brief Sharded B+ Tree
+ *
+ *  @file bplustree_sharded.h
+ *
+ *  Front-end spreading the keys over independent B+ trees by a hash of
+ *  the key.  Each shard is a BPlusTree with its own latch and its own
+ *  slab arena, so writers to different shards share nothing and point
+ *  operations scale with the number of shards.  An ordered scan merges
+ *  the shards, keeping the next record of each in a heap.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_SHARDED_HEADER
+#define _BPLUSTREE_SHARDED_HEADER
+
+#include <vector>
+#include "bplustree.h"
+#include "bplustree_arena.h"
+
+/**
+ * Default number of shards is 16.
+ */
+#define BPTREE_DEFAULT_SHARDS 16
+
+/**
+ * ShardedBPlusTree class.
+ * Insert, Delete, Find and FindValue can be called from
+ * many threads at once: each latches the one shard its key
+ * hashes to, readers shared and writers exclusive.
+ */
+class BPTREE_INTERFACE_API ShardedBPlusTree
+{
+public:
+    /**
+     * ShardedBPlusTree constructor.
+     * @param nShards       Number of shards(>=1,Default:16)
+     * @param nOrder        Order of each B+ tree(>=3 or BPTREE_ORDER_AUTO,Default:4)
+     * @param nKeyLength    Length of key(Default:4), ignored in integer key mode
+     * @param nKeyType      Key type(BPTREE_KEY_TYPE_STRING or BPTREE_KEY_TYPE_INTEGER,Default:string)
+     * @param bUseArena     Takes the nodes and records of each shard from a slab arena of its own(Default:true)
+     */
+    ShardedBPlusTree( int nShards = BPTREE_DEFAULT_SHARDS, int nOrder = BPTREE_DEFAULT_ORDER, int nKeyLength = BPTREE_DEFAULT_KEY_LENGTH, int nKeyType = BPTREE_KEY_TYPE_STRING, bool bUseArena = true );
+
+    /**
+     * ShardedBPlusTree destructor.
+     */
+    ~ShardedBPlusTree();
+public:
+    /**
+     * Iterator over the records of all shards in key order.
+     * It holds an iterator in each shard and a heap of the
+     * shards ordered by the key each is at, and advances the
+     * shard at the top of the heap.  The shards are not
+     * latched, so iterators are invalidated by Insert, Delete
+     * and DestroyBPTree as BPlusTree iterators are.
+     */
+    class iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef record value_type;
+        typedef ptrdiff_t difference_type;
+        typedef record * pointer;
+        typedef record & reference;
+
+        iterator() : owner(NULL) {}
+
+        record & operator*() const { return *heads[heap[0]]; }
+        record * operator->() const { return heads[heap[0]].GetRecord(); }
+
+        /**
+         * Returns the key, as BPlusTree::iterator does.
+         */
+        const char * GetKey() const { return heads[heap[0]].GetKey(); }
+
+        /**
+         * Returns the key in integer key mode.
+         */
+        int64_t GetIntegerKey() const { return heads[heap[0]].GetIntegerKey(); }
+
+        /**
+         * Returns the record.
+         */
+        record * GetRecord() const { return heads[heap[0]].GetRecord(); }
+
+        /**
+         * Returns the shard the record is in.
+         */
+        int GetShard() const { return heap[0]; }
+
+        iterator & operator++();
+
+        iterator operator++(int)
+        {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator==( const iterator & other ) const;
+        bool operator!=( const iterator & other ) const { return !(*this == other); }
+    private:
+        friend class ShardedBPlusTree;
+        iterator( ShardedBPlusTree * pOwner, const std::vector<BPlusTree::iterator> & positions );
+
+        bool heap_less( int a, int b ) const;
+        void sift_down( size_t i );
+        void sift_up( size_t i );
+
+        ShardedBPlusTree * owner;   /**< Tree iterated, NULL for End.*/
+        std::vector<BPlusTree::iterator> heads; /**< Position in each shard.*/
+        std::vector<int> heap;      /**< Shards not at their end, smallest key first.*/
+    };
+
+    /**
+     * Inserts a key and an associated value into
+     * the shard the key hashes to.
+     * @param key       The key
+     * @param value     The value
+     */
+    void Insert( char * key, int value );
+    void Insert( int key, int value );
+
+    /**
+     * Deletes a key from the shard it hashes to.
+     * @param key       The key
+     */
+    void Delete( char * key );
+    void Delete( int key );
+
+    /**
+     * Finds the record under a key.  The record may be
+     * freed by a concurrent Delete of the key; use
+     * FindValue alongside writers.
+     * @param key       The key
+     * @return      Return the record or NULL if not found.
+     */
+    record * Find( char * key );
+    record * Find( int key );
+
+    /**
+     * Copies out the value under a key, while its
+     * shard is latched.
+     * @param key       The key
+     * @param value     Set to the value if found
+     * @return      Return true if the key was found.
+     */
+    bool FindValue( char * key, int * value );
+    bool FindValue( int key, int * value );
+
+    /**
+     * Destroys the B+ trees of all shards.
+     */
+    void DestroyBPTree();
+
+    /**
+     * Returns the number of shards.
+     */
+    int GetShardCount();
+
+    /**
+     * Returns the B+ tree of a shard.
+     */
+    BPlusTree * GetShard( int nShard );
+
+    /**
+     * Returns an iterator to the record of the smallest key
+     * over all shards.
+     */
+    iterator Begin();
+
+    /**
+     * Returns the iterator past the last record.
+     */
+    iterator End();
+
+    /**
+     * Returns an iterator to the record of the smallest key
+     * not less than key over all shards.
+     */
+    iterator LowerBound( char * key );
+    iterator LowerBound( int key );
+private:
+    /**
+     * A shard, padded so the latches of two shards
+     * are not on one cache line.
+     */
+    typedef struct shard {
+        BPlusTree * tree;       /**< The B+ tree.*/
+        BPTreeArena * arena;    /**< Its arena, NULL for the heap.*/
+        bpt_latch latch;        /**< Latch guarding the tree.*/
+        char padding[BPTREE_CACHE_LINE_SIZE];
+    } shard;
+
+    shard * shard_of( char * key );
+    shard * shard_of( int key );
+    uint64_t hash_key( const char * key );
+    uint64_t hash_integer( int64_t key );
+private:
+    /**
+     * The shards, and their number.
+     */
+    shard * shards;
+    int num_shards;
+
+    /**
+     * Type and length of key, as in each shard: the
+     * length given plus one for the terminator.
+     */
+    int key_type;
+    int key_length;
+};
+
+#endif
@@ -0,0 +1,350 @@
+#include "bplustree_snapshot.h"
+#include "bplustree_key.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef BPTREE_OS_WINDOWS
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+BPTreeSnapshot::BPTreeSnapshot()
+{
+    base = NULL;
+    header = NULL;
+    size = 0;
+#ifdef BPTREE_OS_WINDOWS
+    mapping = NULL;
+#endif
+    key_type = BPTREE_KEY_TYPE_STRING;
+    key_length = 0;
+    key_size = 0;
+}
+
+BPTreeSnapshot::~BPTreeSnapshot()
+{
+    Close();
+}
+
+/* Maps the whole file and checks its header.
+ * Nothing else is read until a lookup.
+ */
+bool BPTreeSnapshot::Open( const char * path )
+{
+    Close();
+#ifdef BPTREE_OS_WINDOWS
+    HANDLE file;
+    LARGE_INTEGER file_size;
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(bpt_snapshot_header)) {
+        CloseHandle(file);
+        return false;
+    }
+    size = (size_t)file_size.QuadPart;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return false;
+    base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (base == NULL) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return false;
+    }
+#else
+    struct stat st;
+    void * p;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(bpt_snapshot_header)) {
+        close(fd);
+        return false;
+    }
+    size = (size_t)st.st_size;
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    base = (const char *)p;
+#endif
+
+    header = (const bpt_snapshot_header *)base;
+    if (memcmp(header->magic, BPTREE_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+            || header->version != BPTREE_SNAPSHOT_VERSION
+            || header->file_size != size
+            || header->root >= size || header->first_leaf >= size
+            || (header->key_type == BPTREE_KEY_TYPE_INTEGER ? header->key_size != (int32_t)sizeof(int64_t)
+                                                            : header->key_size != header->key_length + 1)) {
+        Close();
+        return false;
+    }
+    key_type = header->key_type;
+    key_length = header->key_length + 1;
+    key_size = header->key_size;
+    return true;
+}
+
+void BPTreeSnapshot::Close()
+{
+    if (base == NULL)
+        return;
+#ifdef BPTREE_OS_WINDOWS
+    UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    mapping = NULL;
+#else
+    munmap((void *)base, size);
+#endif
+    base = NULL;
+    header = NULL;
+    size = 0;
+}
+
+bool BPTreeSnapshot::FindValue( char * key, int * value )
+{
+    int64_t num;
+    return find_value(make_key(key, &num), value);
+}
+
+bool BPTreeSnapshot::FindValue( int key, int * value )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t num = key;
+        return find_value((char *)&num, value);
+    }
+    char * key_str = format_key(key);
+    bool found = find_value(key_str, value);
+    free(key_str);
+    return found;
+}
+
+scan_result BPTreeSnapshot::Scan( char * lo, char * hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    int64_t lo_num, hi_num;
+    return scan(make_key(lo, &lo_num), make_key(hi, &hi_num), fn, arg);
+}
+
+scan_result BPTreeSnapshot::Scan( int lo, int hi, scan_callback fn/* = NULL*/, void * arg/* = NULL*/ )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER) {
+        int64_t lo_num = lo, hi_num = hi;
+        return scan((char *)&lo_num, (char *)&hi_num, fn, arg);
+    }
+    char * lo_str = format_key(lo);
+    char * hi_str = format_key(hi);
+    scan_result result = scan(lo_str, hi_str, fn, arg);
+    free(lo_str);
+    free(hi_str);
+    return result;
+}
+
+int BPTreeSnapshot::GetOrder()
+{
+    return header != NULL ? header->order : 0;
+}
+
+uint64_t BPTreeSnapshot::GetKeyCount()
+{
+    return header != NULL ? header->num_keys : 0;
+}
+
+/* Converts an integer key to its string form
+ * in string key mode, as BPlusTree does.
+ * The caller frees the returned string.
+ */
+char * BPTreeSnapshot::format_key( int key )
+{
+    return bpt_key_format(key, key_length);
+}
+
+char * BPTreeSnapshot::make_key( char * key, int64_t * num )
+{
+    return bpt_key_make(key, num, key_type);
+}
+
+int BPTreeSnapshot::compare_keys( const char * a, const char * b )
+{
+    return bpt_key_compare(a, b, key_type, key_length);
+}
+
+/* Compares a key with the prefix of a node, the
+ * first prefix_length bytes of each of its keys:
+ * below 0 if the key sorts before every key of
+ * the node, above 0 after, 0 if it has the prefix.
+ */
+int BPTreeSnapshot::compare_prefix( const bpt_snapshot_node * n, const char * key )
+{
+    if (n->prefix_length == 0)
+        return 0;
+    return strncmp(key, (const char *)(n + 1), n->prefix_length);
+}
+
+/* Compares keys past a prefix both have.
+ */
+int BPTreeSnapshot::compare_suffixes( const char * a, const char * b, int prefix_length )
+{
+    if (key_type == BPTREE_KEY_TYPE_INTEGER)
+        return compare_keys(a, b);
+    return strncmp(a, b, key_length - 1 - prefix_length);
+}
+
+const bpt_snapshot_node * BPTreeSnapshot::node_at( uint64_t offset )
+{
+    return (const bpt_snapshot_node *)(base + offset);
+}
+
+/* Returns the key at index past the prefix of
+ * the node.
+ */
+const char * BPTreeSnapshot::key_at( const bpt_snapshot_node * n, int index )
+{
+    return (const char *)(n + 1) + n->prefix_length + index * (key_size - n->prefix_length);
+}
+
+const void * BPTreeSnapshot::pointers( const bpt_snapshot_node * n )
+{
+    uint64_t node_size;
+    return (const char *)n + bpt_snapshot_layout(n->num_keys, key_size, n->prefix_length, n->is_leaf != 0, &node_size);
+}
+
+/* Returns the index of the first key of a node
+ * not less than key.  The prefix is checked once,
+ * and only the suffixes are searched.
+ */
+int BPTreeSnapshot::lower_bound( const bpt_snapshot_node * n, const char * key )
+{
+    int lo = 0, hi = n->num_keys, mid, c;
+
+    c = compare_prefix(n, key);
+    if (c != 0)
+        return c < 0 ? 0 : hi;
+    key += n->prefix_length;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (compare_suffixes(key_at(n, mid), key, n->prefix_length) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns the index of the first key of a node
+ * greater than key, which in an internal node is
+ * the child holding key, as in BPlusTree::find_leaf.
+ */
+int BPTreeSnapshot::upper_bound( const bpt_snapshot_node * n, const char * key )
+{
+    int lo = 0, hi = n->num_keys, mid, c;
+
+    c = compare_prefix(n, key);
+    if (c != 0)
+        return c < 0 ? 0 : hi;
+    key += n->prefix_length;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (compare_suffixes(key_at(n, mid), key, n->prefix_length) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+const bpt_snapshot_node * BPTreeSnapshot::find_leaf( const char * key )
+{
+    const bpt_snapshot_node * n;
+
+    if (header == NULL || header->root == 0)
+        return NULL;
+    n = node_at(header->root);
+    while (!n->is_leaf)
+        n = node_at(((const uint64_t *)pointers(n))[upper_bound(n, key)]);
+    return n;
+}
+
+bool BPTreeSnapshot::find_value( char * key, int * value )
+{
+    const bpt_snapshot_node * leaf;
+    int i;
+
+    leaf = find_leaf(key);
+    if (leaf == NULL)
+        return false;
+    i = lower_bound(leaf, key);
+    if (i == (int)leaf->num_keys || compare_prefix(leaf, key) != 0
+            || compare_suffixes(key_at(leaf, i), key + leaf->prefix_length, leaf->prefix_length) != 0)
+        return false;
+    *value = ((const int32_t *)pointers(leaf))[i];
+    return true;
+}
+
+/* Scans from the first key not less than lo along
+ * the leaves until a key greater than hi.  The end
+ * of the range in a leaf is found by a search, so
+ * keys are not compared one by one, and a key is
+ * put back together from the prefix of its leaf
+ * only to be passed to fn.
+ */
+scan_result BPTreeSnapshot::scan( char * lo, char * hi, scan_callback fn, void * arg )
+{
+    const bpt_snapshot_node * leaf;
+    const int32_t * values;
+    scan_result result;
+    record r;
+    char * key = NULL;
+    int i, end;
+
+    result.count = 0;
+    result.sum = 0;
+    result.min = 0;
+    result.max = 0;
+    if (compare_keys(lo, hi) > 0)
+        return result;
+    leaf = find_leaf(lo);
+    if (leaf == NULL)
+        return result;
+    if (fn != NULL) {
+        key = (char *)malloc(key_size);
+        if (key == NULL) {
+            perror("Snapshot scan.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    i = lower_bound(leaf, lo);
+    for (;;) {
+        values = (const int32_t *)pointers(leaf);
+        end = upper_bound(leaf, hi);
+        if (key != NULL)
+            memcpy(key, leaf + 1, leaf->prefix_length);
+        for (; i < end; i++) {
+            r.value = values[i];
+            if (result.count == 0 || r.value < result.min)
+                result.min = r.value;
+            if (result.count == 0 || r.value > result.max)
+                result.max = r.value;
+            result.count++;
+            result.sum += r.value;
+            if (key != NULL) {
+                memcpy(key + leaf->prefix_length, key_at(leaf, i), key_size - leaf->prefix_length);
+                fn(key, &r, arg);
+            }
+        }
+        if (end < (int)leaf->num_keys || leaf->next == 0)
+            break;
+        leaf = node_at(leaf->next);
+        i = 0;
+    }
+    free(key);
+    return result;
+}
@@ -0,0 +1,180 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Snapshot
+ *
+ *  @file bplustree_snapshot.h
+ *
+ *  Read-only snapshot of a B+ tree, written by BPlusTree::SaveSnapshot
+ *  and mapped into memory by BPTreeSnapshot.  The file holds no pointers:
+ *  a header, then the leaves packed full in key order, then each internal
+ *  level over the level below, every node at an 8-byte aligned offset
+ *  and naming its children and next leaf by offset.  Mapping a snapshot
+ *  reads nothing up front, lookups descend the mapped file directly, and
+ *  processes mapping the same snapshot share its pages in the page cache.
+ *
+ *  Leaves of string keys are prefix compressed: the prefix the keys of a
+ *  leaf share is stored once, and each key only past it, in a slot that
+ *  much narrower.  A search checks the prefix once per leaf, then
+ *  compares the suffixes.
+ *
+ *  Numbers are stored in the byte order of the machine that wrote the
+ *  snapshot, so a snapshot is read on machines of the same byte order.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_SNAPSHOT_HEADER
+#define _BPLUSTREE_SNAPSHOT_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bplustree.h"
+
+/**
+ * Magic and version of the snapshot format.
+ */
+#define BPTREE_SNAPSHOT_MAGIC "BPTSNAPS"
+#define BPTREE_SNAPSHOT_VERSION 2
+
+/**
+ * Header at offset 0 of a snapshot.
+ */
+typedef struct bpt_snapshot_header {
+    char magic[8];          /**< BPTREE_SNAPSHOT_MAGIC.*/
+    uint32_t version;       /**< BPTREE_SNAPSHOT_VERSION.*/
+    int32_t order;          /**< Order of the nodes.*/
+    int32_t key_length;     /**< Length of key, as given to the tree.*/
+    int32_t key_type;       /**< Type of key.*/
+    int32_t key_size;       /**< Size of a key slot.*/
+    int32_t height;         /**< Levels of nodes, 0 if empty.*/
+    uint64_t num_keys;      /**< Keys in the snapshot.*/
+    uint64_t root;          /**< Offset of the root, 0 if empty.*/
+    uint64_t first_leaf;    /**< Offset of the first leaf, 0 if empty.*/
+    uint64_t file_size;     /**< Size of the snapshot in bytes.*/
+} bpt_snapshot_header;
+
+/**
+ * Node of a snapshot.  The prefix shared by its keys
+ * follows the node, then the slots of the keys past
+ * the prefix, key_size - prefix_length bytes each,
+ * then at the next 8-byte boundary the offsets of the
+ * num_keys + 1 children of an internal node, or the
+ * num_keys values of a leaf.
+ */
+typedef struct bpt_snapshot_node {
+    uint16_t is_leaf;       /**< 1 in a leaf.*/
+    uint16_t prefix_length; /**< Length of the shared prefix, 0 in an internal node.*/
+    uint32_t num_keys;      /**< Number of keys.*/
+    uint64_t next;          /**< Offset of the next leaf, 0 if last or internal.*/
+} bpt_snapshot_node;
+
+/**
+ * Rounds a snapshot offset up to the 8-byte boundary.
+ */
+static inline uint64_t bpt_snapshot_align( uint64_t offset )
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/**
+ * Returns the offset, from the start of a node, of its
+ * children or values, and sets size to the size of the
+ * node in bytes.
+ */
+static inline uint64_t bpt_snapshot_layout( int num_keys, int key_size, int prefix_length, bool is_leaf, uint64_t * size )
+{
+    uint64_t pointers = bpt_snapshot_align(sizeof(bpt_snapshot_node) + prefix_length + (uint64_t)num_keys * (key_size - prefix_length));
+    *size = bpt_snapshot_align(pointers + (is_leaf ? num_keys * sizeof(int32_t) : (num_keys + 1) * sizeof(uint64_t)));
+    return pointers;
+}
+
+/**
+ * BPTreeSnapshot class.
+ * Lookups only read the mapping, so any number of threads
+ * can use an open snapshot at once.
+ */
+class BPTREE_INTERFACE_API BPTreeSnapshot
+{
+public:
+    BPTreeSnapshot();
+
+    /**
+     * BPTreeSnapshot destructor, closes the snapshot.
+     */
+    ~BPTreeSnapshot();
+public:
+    /**
+     * Maps a snapshot into memory, read only.
+     * @param path      Path of the snapshot
+     * @return      Return false if the file can not be mapped or is not a snapshot.
+     */
+    bool Open( const char * path );
+
+    /**
+     * Unmaps the snapshot.
+     */
+    void Close();
+
+    /**
+     * Finds the value under a key.
+     * @param key       The key
+     * @param value     Set to the value if found
+     * @return      Return true if the key was found.
+     */
+    bool FindValue( char * key, int * value );
+    bool FindValue( int key, int * value );
+
+    /**
+     * Scans the keys from lo to hi in order, as
+     * BPlusTree::ParallelScan does on one thread.
+     * @param lo        The smallest key
+     * @param hi        The largest key
+     * @param fn        Function called for each key, or NULL(Default:NULL)
+     * @param arg       Argument passed to fn(Default:NULL)
+     * @return      Return the count, sum, minimum and maximum of the values.
+     */
+    scan_result Scan( char * lo, char * hi, scan_callback fn = NULL, void * arg = NULL );
+    scan_result Scan( int lo, int hi, scan_callback fn = NULL, void * arg = NULL );
+
+    /**
+     * Returns the order of the snapshot.
+     */
+    int GetOrder();
+
+    /**
+     * Returns the number of keys in the snapshot.
+     */
+    uint64_t GetKeyCount();
+private:
+    char * format_key( int key );
+    char * make_key( char * key, int64_t * num );
+    int compare_keys( const char * a, const char * b );
+    const bpt_snapshot_node * node_at( uint64_t offset );
+    int compare_prefix( const bpt_snapshot_node * n, const char * key );
+    int compare_suffixes( const char * a, const char * b, int prefix_length );
+    const char * key_at( const bpt_snapshot_node * n, int index );
+    const void * pointers( const bpt_snapshot_node * n );
+    int lower_bound( const bpt_snapshot_node * n, const char * key );
+    int upper_bound( const bpt_snapshot_node * n, const char * key );
+    const bpt_snapshot_node * find_leaf( const char * key );
+    bool find_value( char * key, int * value );
+    scan_result scan( char * lo, char * hi, scan_callback fn, void * arg );
+private:
+    /**
+     * The mapping, its header, and the mapping object
+     * on Windows.
+     */
+    const char * base;
+    const bpt_snapshot_header * header;
+    size_t size;
+#ifdef BPTREE_OS_WINDOWS
+    void * mapping;
+#endif
+
+    /**
+     * Type, length and slot size of key, as in BPlusTree.
+     */
+    int key_type;
+    int key_length;
+    int key_size;
+};
+
+#endif
@@ -0,0 +1,683 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Class Template
+ *
+ *  @file bplustree_template.h
+ *
+ *  B+ tree templated on key type, value type, key comparator and order.
+ *  Keys and values are stored by value inside the nodes, so no key or
+ *  record is allocated separately, and key comparisons are made through
+ *  the comparator object which the compiler can inline.
+ *  Key and Value must be default constructible and copy assignable.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_TEMPLATE_HEADER
+#define _BPLUSTREE_TEMPLATE_HEADER
+
+#include <stddef.h>
+#include <functional>
+#include <algorithm>
+#include "bplustree.h"
+
+namespace bptree {
+
+/**
+ * BPlusTree class template.
+ * @tparam Key      Key type
+ * @tparam Value    Value type
+ * @tparam Compare  Strict weak ordering of keys(Default:std::less<Key>)
+ * @tparam Order    Order of B+ tree(>=3,Default:4)
+ */
+template <typename Key, typename Value, typename Compare = std::less<Key>, int Order = BPTREE_DEFAULT_ORDER>
+class BPlusTree
+{
+    typedef char order_check[(Order >= BPTREE_MIN_ORDER) ? 1 : -1];
+public:
+    /**
+     * BPlusTree constructor.
+     * @param comp      The key comparator
+     */
+    BPlusTree( const Compare & comp = Compare() );
+
+    /**
+     * BPlusTree destructor.
+     */
+    ~BPlusTree();
+public:
+    /**
+     * Inserts a key and an associated value into
+     * the B+ tree, causing the tree to be adjusted
+     * however necessary to maintain the B+ tree
+     * properties.  Duplicates are ignored.
+     * @param key       The key
+     * @param value     The value
+     * @return      Return true if the key was inserted.
+     */
+    bool Insert( const Key & key, const Value & value );
+
+    /**
+     * Delete entry from B+ tree which key value is key.
+     * @param key       The key
+     * @return      Return true if the key was found and deleted.
+     */
+    bool Delete( const Key & key );
+
+    /**
+     * Finds and returns the value to which a key refers.
+     * The pointer is valid until the tree is next modified.
+     * @param key       The key
+     * @return      Return the value pointer or NULL if not found.
+     */
+    Value * Find( const Key & key );
+
+    /**
+     * Destroy the B+ tree.
+     */
+    void DestroyBPTree();
+
+    /**
+     * Number of keys in the B+ tree.
+     */
+    size_t Size() const { return num_entries; }
+private:
+    struct inner_node;
+
+    /**
+     * Common part of leaf and internal nodes.  Keys
+     * have one spare slot which holds the extra key
+     * of an overfull node until it is split.
+     */
+    struct node {
+        bool is_leaf;   /**< Leaf node.*/
+        int num_keys;   /**< Number of valid keys.*/
+        inner_node * parent;    /**< Pointer of parent node.*/
+        Key keys[Order];    /**< Array of keys.*/
+    };
+
+    /**
+     * Leaf node.  The value at index i belongs
+     * to the key at index i.
+     */
+    struct leaf_node : public node {
+        Value values[Order];    /**< Array of values.*/
+        leaf_node * next;   /**< Leaf to the right.*/
+    };
+
+    /**
+     * Internal node.  The child at index i + 1
+     * holds keys greater than or equal to the
+     * key at index i.
+     */
+    struct inner_node : public node {
+        node * pointers[Order + 1]; /**< Array of children.*/
+    };
+
+    BPlusTree( const BPlusTree & );
+    BPlusTree & operator=( const BPlusTree & );
+
+    static int cut( int length );
+    int lower_bound( const node * n, const Key & key ) const;
+    int upper_bound( const node * n, const Key & key ) const;
+    leaf_node * find_leaf( const Key & key ) const;
+
+    leaf_node * make_leaf( void );
+    inner_node * make_node( void );
+    int get_left_index( inner_node * parent, node * left );
+    void insert_into_leaf( leaf_node * leaf, int insertion_point, const Key & key, const Value & value );
+    void split_leaf( leaf_node * leaf );
+    void insert_into_node( inner_node * n, int left_index, const Key & key, node * right );
+    void split_node( inner_node * old_node );
+    void insert_into_parent( node * left, const Key & key, node * right );
+    void insert_into_new_root( node * left, const Key & key, node * right );
+
+    void remove_entry_from_node( node * n, int index );
+    void adjust_root( void );
+    void coalesce_nodes( node * n, node * neighbor, int neighbor_index, int k_prime_index );
+    void redistribute_nodes( node * n, node * neighbor, int neighbor_index, int k_prime_index );
+    void delete_entry( node * n, int index );
+
+    void free_node( node * n );
+    void destroy_tree_nodes( node * n );
+private:
+    /**
+     * Key comparator.
+     */
+    Compare comp;
+
+    /**
+     * The root node of B+ tree.
+     */
+    node * root_node;
+
+    /**
+     * Number of keys in the B+ tree.
+     */
+    size_t num_entries;
+};
+
+template <typename Key, typename Value, typename Compare, int Order>
+BPlusTree<Key, Value, Compare, Order>::BPlusTree( const Compare & comp/* = Compare()*/ )
+    : comp(comp), root_node(NULL), num_entries(0)
+{
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+BPlusTree<Key, Value, Compare, Order>::~BPlusTree()
+{
+    DestroyBPTree();
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+bool BPlusTree<Key, Value, Compare, Order>::Insert( const Key & key, const Value & value )
+{
+    leaf_node * leaf;
+    int insertion_point;
+
+    /* Case: the tree does not exist yet.
+     * Start a new tree.
+     */
+    if (root_node == NULL) {
+        leaf = make_leaf();
+        leaf->keys[0] = key;
+        leaf->values[0] = value;
+        leaf->num_keys = 1;
+        root_node = leaf;
+        num_entries = 1;
+        return true;
+    }
+
+    /* The current implementation ignores
+     * duplicates.
+     */
+    leaf = find_leaf(key);
+    insertion_point = lower_bound(leaf, key);
+    if (insertion_point < leaf->num_keys && !comp(key, leaf->keys[insertion_point]))
+        return false;
+
+    insert_into_leaf(leaf, insertion_point, key, value);
+    num_entries++;
+
+    /* Case:  leaf must be split.
+     */
+    if (leaf->num_keys == Order)
+        split_leaf(leaf);
+    return true;
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+bool BPlusTree<Key, Value, Compare, Order>::Delete( const Key & key )
+{
+    leaf_node * leaf;
+    int i;
+
+    if (root_node == NULL)
+        return false;
+    leaf = find_leaf(key);
+    i = lower_bound(leaf, key);
+    if (i == leaf->num_keys || comp(key, leaf->keys[i]))
+        return false;
+    delete_entry(leaf, i);
+    num_entries--;
+    return true;
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+Value * BPlusTree<Key, Value, Compare, Order>::Find( const Key & key )
+{
+    leaf_node * leaf;
+    int i;
+
+    if (root_node == NULL)
+        return NULL;
+    leaf = find_leaf(key);
+    i = lower_bound(leaf, key);
+    if (i == leaf->num_keys || comp(key, leaf->keys[i]))
+        return NULL;
+    return &leaf->values[i];
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::DestroyBPTree()
+{
+    if (root_node != NULL)
+        destroy_tree_nodes(root_node);
+    root_node = NULL;
+    num_entries = 0;
+}
+
+/* Finds the appropriate place to
+ * split a node that is too big into two.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+int BPlusTree<Key, Value, Compare, Order>::cut( int length )
+{
+    if (length % 2 == 0)
+        return length/2;
+    else
+        return length/2 + 1;
+}
+
+/* Index of the first key in a node which
+ * is not less than key.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+int BPlusTree<Key, Value, Compare, Order>::lower_bound( const node * n, const Key & key ) const
+{
+    return (int)(std::lower_bound(n->keys, n->keys + n->num_keys, key, comp) - n->keys);
+}
+
+/* Index of the first key in a node which
+ * is greater than key.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+int BPlusTree<Key, Value, Compare, Order>::upper_bound( const node * n, const Key & key ) const
+{
+    return (int)(std::upper_bound(n->keys, n->keys + n->num_keys, key, comp) - n->keys);
+}
+
+/* Traces the path from the root to a leaf, searching
+ * by key.  Returns the leaf which may contain the key.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+typename BPlusTree<Key, Value, Compare, Order>::leaf_node *
+BPlusTree<Key, Value, Compare, Order>::find_leaf( const Key & key ) const
+{
+    node * c = root_node;
+    while (!c->is_leaf)
+        c = static_cast<inner_node *>(c)->pointers[upper_bound(c, key)];
+    return static_cast<leaf_node *>(c);
+}
+
+/* Creates a new leaf.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+typename BPlusTree<Key, Value, Compare, Order>::leaf_node *
+BPlusTree<Key, Value, Compare, Order>::make_leaf( void )
+{
+    leaf_node * leaf = new leaf_node;
+    leaf->is_leaf = true;
+    leaf->num_keys = 0;
+    leaf->parent = NULL;
+    leaf->next = NULL;
+    return leaf;
+}
+
+/* Creates a new internal node.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+typename BPlusTree<Key, Value, Compare, Order>::inner_node *
+BPlusTree<Key, Value, Compare, Order>::make_node( void )
+{
+    inner_node * n = new inner_node;
+    n->is_leaf = false;
+    n->num_keys = 0;
+    n->parent = NULL;
+    return n;
+}
+
+/* Helper function used in insert_into_parent
+ * to find the index of the parent's pointer to
+ * the node to the left of the key to be inserted.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+int BPlusTree<Key, Value, Compare, Order>::get_left_index( inner_node * parent, node * left )
+{
+    int left_index = 0;
+    while (left_index <= parent->num_keys &&
+            parent->pointers[left_index] != left)
+        left_index++;
+    return left_index;
+}
+
+/* Inserts a key and its value into a leaf
+ * at the given position.  The leaf may
+ * become overfull by one key.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::insert_into_leaf( leaf_node * leaf, int insertion_point, const Key & key, const Value & value )
+{
+    std::copy_backward(leaf->keys + insertion_point, leaf->keys + leaf->num_keys,
+            leaf->keys + leaf->num_keys + 1);
+    std::copy_backward(leaf->values + insertion_point, leaf->values + leaf->num_keys,
+            leaf->values + leaf->num_keys + 1);
+    leaf->keys[insertion_point] = key;
+    leaf->values[insertion_point] = value;
+    leaf->num_keys++;
+}
+
+/* Splits an overfull leaf in half and
+ * inserts the first key of the new right
+ * leaf into the parent.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::split_leaf( leaf_node * leaf )
+{
+    leaf_node * new_leaf = make_leaf();
+    int split = cut(Order - 1);
+
+    std::copy(leaf->keys + split, leaf->keys + leaf->num_keys, new_leaf->keys);
+    std::copy(leaf->values + split, leaf->values + leaf->num_keys, new_leaf->values);
+    new_leaf->num_keys = leaf->num_keys - split;
+    leaf->num_keys = split;
+
+    new_leaf->next = leaf->next;
+    leaf->next = new_leaf;
+    new_leaf->parent = leaf->parent;
+
+    insert_into_parent(leaf, new_leaf->keys[0], new_leaf);
+}
+
+/* Inserts a new key and pointer to a node
+ * into a node.  The node may become overfull
+ * by one key.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::insert_into_node( inner_node * n, int left_index, const Key & key, node * right )
+{
+    std::copy_backward(n->pointers + left_index + 1, n->pointers + n->num_keys + 1,
+            n->pointers + n->num_keys + 2);
+    std::copy_backward(n->keys + left_index, n->keys + n->num_keys,
+            n->keys + n->num_keys + 1);
+    n->pointers[left_index + 1] = right;
+    n->keys[left_index] = key;
+    n->num_keys++;
+}
+
+/* Splits an overfull internal node in two.
+ * The middle key moves up into the parent.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::split_node( inner_node * old_node )
+{
+    inner_node * new_node = make_node();
+    int split = cut(Order);
+    int i;
+    Key k_prime = old_node->keys[split - 1];
+
+    std::copy(old_node->keys + split, old_node->keys + old_node->num_keys, new_node->keys);
+    std::copy(old_node->pointers + split, old_node->pointers + old_node->num_keys + 1,
+            new_node->pointers);
+    new_node->num_keys = old_node->num_keys - split;
+    old_node->num_keys = split - 1;
+    new_node->parent = old_node->parent;
+    for (i = 0; i <= new_node->num_keys; i++)
+        new_node->pointers[i]->parent = new_node;
+
+    insert_into_parent(old_node, k_prime, new_node);
+}
+
+/* Inserts a new node (leaf or internal node) into the B+ tree.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::insert_into_parent( node * left, const Key & key, node * right )
+{
+    inner_node * parent = left->parent;
+
+    /* Case: new root. */
+
+    if (parent == NULL) {
+        insert_into_new_root(left, key, right);
+        return;
+    }
+
+    insert_into_node(parent, get_left_index(parent, left), key, right);
+
+    /* Harder case:  split a node in order
+     * to preserve the B+ tree properties.
+     */
+    if (parent->num_keys == Order)
+        split_node(parent);
+}
+
+/* Creates a new root for two subtrees
+ * and inserts the appropriate key into
+ * the new root.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::insert_into_new_root( node * left, const Key & key, node * right )
+{
+    inner_node * root = make_node();
+    root->keys[0] = key;
+    root->pointers[0] = left;
+    root->pointers[1] = right;
+    root->num_keys = 1;
+    left->parent = root;
+    right->parent = root;
+    root_node = root;
+}
+
+/* Removes the key at index from a node,
+ * together with the value at index in a
+ * leaf or the child at index + 1 in an
+ * internal node.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::remove_entry_from_node( node * n, int index )
+{
+    std::copy(n->keys + index + 1, n->keys + n->num_keys, n->keys + index);
+    if (n->is_leaf) {
+        leaf_node * leaf = static_cast<leaf_node *>(n);
+        std::copy(leaf->values + index + 1, leaf->values + n->num_keys, leaf->values + index);
+    }
+    else {
+        inner_node * inner = static_cast<inner_node *>(n);
+        std::copy(inner->pointers + index + 2, inner->pointers + n->num_keys + 1,
+                inner->pointers + index + 1);
+    }
+    n->num_keys--;
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::adjust_root( void )
+{
+    node * root = root_node;
+
+    /* Case: nonempty root.
+     */
+    if (root->num_keys > 0)
+        return;
+
+    /* Case: empty root.  If it has a child,
+     * promote the only child as the new root,
+     * otherwise the whole tree is empty.
+     */
+    if (!root->is_leaf) {
+        root_node = static_cast<inner_node *>(root)->pointers[0];
+        root_node->parent = NULL;
+    }
+    else
+        root_node = NULL;
+    free_node(root);
+}
+
+/* Coalesces a node that has become
+ * too small after deletion
+ * with a neighboring node that
+ * can accept the additional entries
+ * without exceeding the maximum.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::coalesce_nodes( node * n, node * neighbor, int neighbor_index, int k_prime_index )
+{
+    inner_node * parent = n->parent;
+    int i, neighbor_insertion_index;
+
+    /* Swap neighbor with node if node is on the
+     * extreme left and neighbor is to its right.
+     */
+    if (neighbor_index == -1)
+        std::swap(n, neighbor);
+
+    neighbor_insertion_index = neighbor->num_keys;
+
+    if (!n->is_leaf) {
+        inner_node * left = static_cast<inner_node *>(neighbor);
+        inner_node * right = static_cast<inner_node *>(n);
+
+        /* Append k_prime, then all keys
+         * and pointers of n.
+         */
+        left->keys[neighbor_insertion_index] = parent->keys[k_prime_index];
+        std::copy(right->keys, right->keys + right->num_keys,
+                left->keys + neighbor_insertion_index + 1);
+        std::copy(right->pointers, right->pointers + right->num_keys + 1,
+                left->pointers + neighbor_insertion_index + 1);
+        left->num_keys += right->num_keys + 1;
+        for (i = neighbor_insertion_index + 1; i <= left->num_keys; i++)
+            left->pointers[i]->parent = left;
+    }
+    else {
+        leaf_node * left = static_cast<leaf_node *>(neighbor);
+        leaf_node * right = static_cast<leaf_node *>(n);
+
+        std::copy(right->keys, right->keys + right->num_keys,
+                left->keys + neighbor_insertion_index);
+        std::copy(right->values, right->values + right->num_keys,
+                left->values + neighbor_insertion_index);
+        left->num_keys += right->num_keys;
+        left->next = right->next;
+    }
+
+    free_node(n);
+    delete_entry(parent, k_prime_index);
+}
+
+/* Redistributes entries between two nodes when
+ * one has become too small after deletion
+ * but its neighbor is too big to append the
+ * small node's entries without exceeding the
+ * maximum
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::redistribute_nodes( node * n, node * neighbor, int neighbor_index, int k_prime_index )
+{
+    inner_node * parent = n->parent;
+
+    /* Case: n has a neighbor to the left.
+     * Pull the neighbor's last key-pointer pair over
+     * from the neighbor's right end to n's left end.
+     */
+    if (neighbor_index != -1) {
+        std::copy_backward(n->keys, n->keys + n->num_keys, n->keys + n->num_keys + 1);
+        if (!n->is_leaf) {
+            inner_node * right = static_cast<inner_node *>(n);
+            inner_node * left = static_cast<inner_node *>(neighbor);
+            std::copy_backward(right->pointers, right->pointers + right->num_keys + 1,
+                    right->pointers + right->num_keys + 2);
+            right->pointers[0] = left->pointers[left->num_keys];
+            right->pointers[0]->parent = right;
+            right->keys[0] = parent->keys[k_prime_index];
+            parent->keys[k_prime_index] = left->keys[left->num_keys - 1];
+        }
+        else {
+            leaf_node * right = static_cast<leaf_node *>(n);
+            leaf_node * left = static_cast<leaf_node *>(neighbor);
+            std::copy_backward(right->values, right->values + right->num_keys,
+                    right->values + right->num_keys + 1);
+            right->keys[0] = left->keys[left->num_keys - 1];
+            right->values[0] = left->values[left->num_keys - 1];
+            parent->keys[k_prime_index] = right->keys[0];
+        }
+    }
+
+    /* Case: n is the leftmost child.
+     * Take a key-pointer pair from the neighbor to the right.
+     * Move the neighbor's leftmost key-pointer pair
+     * to n's rightmost position.
+     */
+    else {
+        if (n->is_leaf) {
+            leaf_node * left = static_cast<leaf_node *>(n);
+            leaf_node * right = static_cast<leaf_node *>(neighbor);
+            left->keys[left->num_keys] = right->keys[0];
+            left->values[left->num_keys] = right->values[0];
+            std::copy(right->values + 1, right->values + right->num_keys, right->values);
+            parent->keys[k_prime_index] = right->keys[1];
+        }
+        else {
+            inner_node * left = static_cast<inner_node *>(n);
+            inner_node * right = static_cast<inner_node *>(neighbor);
+            left->keys[left->num_keys] = parent->keys[k_prime_index];
+            left->pointers[left->num_keys + 1] = right->pointers[0];
+            left->pointers[left->num_keys + 1]->parent = left;
+            parent->keys[k_prime_index] = right->keys[0];
+            std::copy(right->pointers + 1, right->pointers + right->num_keys + 1, right->pointers);
+        }
+        std::copy(neighbor->keys + 1, neighbor->keys + neighbor->num_keys, neighbor->keys);
+    }
+
+    /* n now has one more key and one more pointer;
+     * the neighbor has one fewer of each.
+     */
+    n->num_keys++;
+    neighbor->num_keys--;
+}
+
+/* Deletes an entry from the B+ tree.
+ * Removes the key at index and its value or
+ * child from the node, and then makes all
+ * appropriate changes to preserve the B+
+ * tree properties.
+ */
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::delete_entry( node * n, int index )
+{
+    node * neighbor;
+    int min_keys, neighbor_index, k_prime_index, capacity, i;
+
+    remove_entry_from_node(n, index);
+
+    /* Case:  deletion from the root.
+     */
+    if (n == root_node) {
+        adjust_root();
+        return;
+    }
+
+    /* Case:  node stays at or above minimum.
+     */
+    min_keys = n->is_leaf ? cut(Order - 1) : cut(Order) - 1;
+    if (n->num_keys >= min_keys)
+        return;
+
+    /* Case:  node falls below minimum.
+     * Find the neighbor to the left if one
+     * exists, otherwise the one to the right,
+     * and the key in the parent between them.
+     */
+    for (i = 0; n->parent->pointers[i] != n; i++)
+        ;
+    neighbor_index = i - 1;
+    k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
+    neighbor = n->parent->pointers[neighbor_index == -1 ? 1 : neighbor_index];
+
+    capacity = n->is_leaf ? Order : Order - 1;
+
+    if (neighbor->num_keys + n->num_keys < capacity)
+        coalesce_nodes(n, neighbor, neighbor_index, k_prime_index);
+    else
+        redistribute_nodes(n, neighbor, neighbor_index, k_prime_index);
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::free_node( node * n )
+{
+    if (n->is_leaf)
+        delete static_cast<leaf_node *>(n);
+    else
+        delete static_cast<inner_node *>(n);
+}
+
+template <typename Key, typename Value, typename Compare, int Order>
+void BPlusTree<Key, Value, Compare, Order>::destroy_tree_nodes( node * n )
+{
+    int i;
+    if (!n->is_leaf)
+        for (i = 0; i <= n->num_keys; i++)
+            destroy_tree_nodes(static_cast<inner_node *>(n)->pointers[i]);
+    free_node(n);
+}
+
+}
+
+#endif
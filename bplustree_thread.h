@@ -0,0 +1,280 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Worker Threads
+ *
+ *  @file bplustree_thread.h
+ *
+ *  Runs the tasks of a parallel operation on a B+ tree, such as a
+ *  parallel bulk load, each on a thread of its own, and waits for all
+ *  of them.  The calling thread runs the first task itself.  Also the
+ *  mutexes, conditions and long-running threads of the background work
+ *  of a paged tree, such as writing back pages and committing the log.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_THREAD_HEADER
+#define _BPLUSTREE_THREAD_HEADER
+
+#include <stdlib.h>
+
+#ifdef _MSC_VER
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <windows.h>
+#else
+#   include <pthread.h>
+#   include <time.h>
+#   include <unistd.h>
+#endif
+
+/**
+ * Maximum number of tasks run at once.
+ */
+#define BPTREE_MAX_THREADS 256
+
+/**
+ * Task of a parallel operation, given the shared
+ * argument and the index of the task.
+ */
+typedef void (*bpt_task)( void * arg, int index );
+
+/**
+ * A task to run on a thread.
+ */
+typedef struct bpt_task_call {
+    bpt_task task;
+    void * arg;
+    int index;
+} bpt_task_call;
+
+#ifdef _MSC_VER
+static DWORD WINAPI bpt_task_thread( LPVOID p )
+{
+    bpt_task_call * call = (bpt_task_call *)p;
+    call->task(call->arg, call->index);
+    return 0;
+}
+#else
+static void * bpt_task_thread( void * p )
+{
+    bpt_task_call * call = (bpt_task_call *)p;
+    call->task(call->arg, call->index);
+    return NULL;
+}
+#endif
+
+/* Returns the number of processors online.
+ */
+static inline int bpt_cpu_count( void )
+{
+#ifdef _MSC_VER
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* Runs tasks 0 to num_tasks - 1 at once and waits
+ * for all of them.  A task whose thread can not be
+ * created is run by the calling thread instead.
+ */
+static inline void bpt_run_tasks( bpt_task task, void * arg, int num_tasks )
+{
+    bpt_task_call calls[BPTREE_MAX_THREADS];
+#ifdef _MSC_VER
+    HANDLE threads[BPTREE_MAX_THREADS];
+#else
+    pthread_t threads[BPTREE_MAX_THREADS];
+#endif
+    bool started[BPTREE_MAX_THREADS];
+    int i;
+
+    if (num_tasks > BPTREE_MAX_THREADS)
+        num_tasks = BPTREE_MAX_THREADS;
+    for (i = 1; i < num_tasks; i++) {
+        calls[i].task = task;
+        calls[i].arg = arg;
+        calls[i].index = i;
+#ifdef _MSC_VER
+        threads[i] = CreateThread(NULL, 0, bpt_task_thread, &calls[i], 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, bpt_task_thread, &calls[i]) == 0;
+#endif
+    }
+    if (num_tasks > 0)
+        task(arg, 0);
+    for (i = 1; i < num_tasks; i++) {
+        if (!started[i]) {
+            task(arg, i);
+            continue;
+        }
+#ifdef _MSC_VER
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+}
+
+/**
+ * Mutex, condition, and a thread running one task
+ * until it returns.
+ */
+#ifdef _MSC_VER
+typedef CRITICAL_SECTION bpt_mutex;
+typedef CONDITION_VARIABLE bpt_cond;
+#else
+typedef pthread_mutex_t bpt_mutex;
+typedef pthread_cond_t bpt_cond;
+#endif
+
+typedef struct bpt_thread {
+#ifdef _MSC_VER
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    bpt_task_call call;
+    bool started;
+} bpt_thread;
+
+static inline void bpt_mutex_init( bpt_mutex * m )
+{
+#ifdef _MSC_VER
+    InitializeCriticalSection(m);
+#else
+    pthread_mutex_init(m, NULL);
+#endif
+}
+
+static inline void bpt_mutex_destroy( bpt_mutex * m )
+{
+#ifdef _MSC_VER
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+static inline void bpt_mutex_lock( bpt_mutex * m )
+{
+#ifdef _MSC_VER
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+static inline void bpt_mutex_unlock( bpt_mutex * m )
+{
+#ifdef _MSC_VER
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+static inline void bpt_cond_init( bpt_cond * c )
+{
+#ifdef _MSC_VER
+    InitializeConditionVariable(c);
+#else
+    pthread_cond_init(c, NULL);
+#endif
+}
+
+static inline void bpt_cond_destroy( bpt_cond * c )
+{
+#ifdef _MSC_VER
+    (void)c;
+#else
+    pthread_cond_destroy(c);
+#endif
+}
+
+/* Waits on a condition with the mutex held, at
+ * most ms milliseconds unless ms is negative.
+ */
+static inline void bpt_cond_wait( bpt_cond * c, bpt_mutex * m, int ms )
+{
+#ifdef _MSC_VER
+    SleepConditionVariableCS(c, m, ms < 0 ? INFINITE : (DWORD)ms);
+#else
+    struct timespec until;
+
+    if (ms < 0) {
+        pthread_cond_wait(c, m);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(c, m, &until);
+#endif
+}
+
+static inline void bpt_cond_broadcast( bpt_cond * c )
+{
+#ifdef _MSC_VER
+    WakeAllConditionVariable(c);
+#else
+    pthread_cond_broadcast(c);
+#endif
+}
+
+/* Sleeps at least us microseconds.
+ */
+static inline void bpt_sleep_us( int us )
+{
+#ifdef _MSC_VER
+    Sleep((DWORD)((us + 999) / 1000));
+#else
+    usleep((useconds_t)us);
+#endif
+}
+
+/* Starts a thread running task, given arg and index 0.
+ * Returns false if the thread can not be created.
+ */
+static inline bool bpt_thread_start( bpt_thread * t, bpt_task task, void * arg )
+{
+    t->call.task = task;
+    t->call.arg = arg;
+    t->call.index = 0;
+#ifdef _MSC_VER
+    t->handle = CreateThread(NULL, 0, bpt_task_thread, &t->call, 0, NULL);
+    t->started = t->handle != NULL;
+#else
+    t->started = pthread_create(&t->handle, NULL, bpt_task_thread, &t->call) == 0;
+#endif
+    return t->started;
+}
+
+/* Waits for a thread started to return.
+ */
+static inline void bpt_thread_join( bpt_thread * t )
+{
+    if (!t->started)
+        return;
+#ifdef _MSC_VER
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, NULL);
+#endif
+    t->started = false;
+}
+
+#endif
@@ -0,0 +1,403 @@
+#include "bplustree_wal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+BPTreeWAL::BPTreeWAL()
+{
+    int i;
+
+    for (i = 0; i < BPTREE_WAL_SEGMENTS; i++) {
+        segments[i] = BPTREE_FILE_NONE;
+        segment_sizes[i] = 0;
+    }
+    active = 0;
+    key_size = 0;
+    buffer = NULL;
+    buffer_used = 0;
+    buffer_capacity = 0;
+    spare = NULL;
+    spare_capacity = 0;
+    last_lsn = 0;
+    durable_lsn = 0;
+    flushing = false;
+    failed = false;
+    commit_window = BPTREE_WAL_COMMIT_WINDOW;
+    syncs = 0;
+    bpt_mutex_init(&mutex);
+    bpt_cond_init(&flushed);
+}
+
+BPTreeWAL::~BPTreeWAL()
+{
+    Close();
+    bpt_cond_destroy(&flushed);
+    bpt_mutex_destroy(&mutex);
+}
+
+bool BPTreeWAL::Open( const char * path, int nKeySize )
+{
+    char * segment_path;
+    int i;
+
+    Close();
+    segment_path = (char *)malloc(strlen(path) + 16);
+    if (segment_path == NULL) {
+        perror("Log creation.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < BPTREE_WAL_SEGMENTS; i++) {
+        sprintf(segment_path, "%s.%d", path, i);
+        segments[i] = bpt_file_open(segment_path, true, NULL);
+        if (segments[i] == BPTREE_FILE_NONE || !bpt_file_size(segments[i], &segment_sizes[i])) {
+            free(segment_path);
+            Close();
+            return false;
+        }
+    }
+    free(segment_path);
+    active = 0;
+    key_size = nKeySize;
+    last_lsn = 0;
+    durable_lsn = 0;
+    failed = false;
+    return true;
+}
+
+void BPTreeWAL::Close()
+{
+    int i;
+
+    for (i = 0; i < BPTREE_WAL_SEGMENTS; i++) {
+        bpt_file_close(segments[i]);
+        segments[i] = BPTREE_FILE_NONE;
+        segment_sizes[i] = 0;
+    }
+    free(buffer);
+    free(spare);
+    buffer = NULL;
+    buffer_used = 0;
+    buffer_capacity = 0;
+    spare = NULL;
+    spare_capacity = 0;
+}
+
+bool BPTreeWAL::Exists( const char * path )
+{
+    char * segment_path;
+    bpt_file segment;
+    bool found = false;
+    int i;
+
+    segment_path = (char *)malloc(strlen(path) + 16);
+    if (segment_path == NULL) {
+        perror("Log creation.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < BPTREE_WAL_SEGMENTS && !found; i++) {
+        sprintf(segment_path, "%s.%d", path, i);
+        segment = bpt_file_open(segment_path, false, NULL);
+        found = segment != BPTREE_FILE_NONE;
+        bpt_file_close(segment);
+    }
+    free(segment_path);
+    return found;
+}
+
+/* Reads each segment whole, the one with the
+ * older records first, and replays each record
+ * past lsn, up to the end of the segment or the
+ * first record whose size or checksum is wrong,
+ * where the segment is cut.  The segment with
+ * the newer records is written on.
+ */
+bool BPTreeWAL::Replay( uint64_t lsn, bpt_wal_apply fn, void * arg )
+{
+    char * logs[BPTREE_WAL_SEGMENTS];
+    uint64_t first[BPTREE_WAL_SEGMENTS];
+    uint64_t offset, newest;
+    bpt_wal_record * r;
+    int size = record_size();
+    bool ok = true;
+    int i, s, older;
+
+    for (s = 0; s < BPTREE_WAL_SEGMENTS; s++) {
+        logs[s] = (char *)malloc(segment_sizes[s] > 0 ? (size_t)segment_sizes[s] : 1);
+        if (logs[s] == NULL) {
+            perror("Log replay.");
+            exit(EXIT_FAILURE);
+        }
+        ok = ok && bpt_file_read(segments[s], 0, logs[s], (size_t)segment_sizes[s]);
+        first[s] = ok && valid_record(logs[s], 0, segment_sizes[s]) ? ((bpt_wal_record *)logs[s])->lsn : 0;
+    }
+    older = 0;
+    for (s = 1; s < BPTREE_WAL_SEGMENTS; s++) {
+        if (first[s] != 0 && (first[older] == 0 || first[s] < first[older]))
+            older = s;
+    }
+
+    last_lsn = lsn;
+    active = older;
+    for (i = 0; i < BPTREE_WAL_SEGMENTS && ok; i++) {
+        s = (older + i) % BPTREE_WAL_SEGMENTS;
+        offset = 0;
+        newest = 0;
+        while (valid_record(logs[s], offset, segment_sizes[s])) {
+            r = (bpt_wal_record *)(logs[s] + offset);
+            if (r->lsn > lsn) {
+                fn(arg, r->type, logs[s] + offset + sizeof(bpt_wal_record), r->value);
+                last_lsn = r->lsn;
+            }
+            newest = r->lsn;
+            offset += size;
+        }
+        if (newest <= lsn)
+            offset = 0;
+        if (offset < segment_sizes[s]) {
+            segment_sizes[s] = offset;
+            ok = bpt_file_truncate(segments[s], offset) && bpt_file_sync(segments[s]);
+        }
+        if (offset > 0)
+            active = s;
+    }
+    for (s = 0; s < BPTREE_WAL_SEGMENTS; s++)
+        free(logs[s]);
+    durable_lsn = last_lsn;
+    return ok;
+}
+
+bool BPTreeWAL::Reset()
+{
+    bool ok = true;
+    int s;
+
+    bpt_mutex_lock(&mutex);
+    while (flushing)
+        bpt_cond_wait(&flushed, &mutex, -1);
+    for (s = 0; s < BPTREE_WAL_SEGMENTS; s++)
+        ok = clear_segment(s) && ok;
+    active = 0;
+    buffer_used = 0;
+    last_lsn = 0;
+    durable_lsn = 0;
+    bpt_mutex_unlock(&mutex);
+    return ok;
+}
+
+/* Waits for a leader writing to the segment, so
+ * no record appended before the rotation goes
+ * to the next one.
+ */
+void BPTreeWAL::Rotate()
+{
+    int next;
+
+    bpt_mutex_lock(&mutex);
+    while (flushing)
+        bpt_cond_wait(&flushed, &mutex, -1);
+    next = (active + 1) % BPTREE_WAL_SEGMENTS;
+    if (segment_sizes[next] == 0)
+        active = next;
+    bpt_mutex_unlock(&mutex);
+}
+
+uint64_t BPTreeWAL::Append( int type, const char * key, int value )
+{
+    bpt_wal_record * r;
+    uint64_t lsn;
+    int size = record_size();
+
+    bpt_mutex_lock(&mutex);
+    if (!reserve(buffer_used + size)) {
+        perror("Log buffer.");
+        exit(EXIT_FAILURE);
+    }
+    r = (bpt_wal_record *)(buffer + buffer_used);
+    memset(r, 0, size);
+    lsn = ++last_lsn;
+    r->size = size;
+    r->lsn = lsn;
+    r->type = type;
+    r->value = value;
+    memcpy(buffer + buffer_used + sizeof(bpt_wal_record), key, key_size);
+    r->checksum = bpt_fnv1a(buffer + buffer_used + sizeof(uint32_t), size - sizeof(uint32_t), BPTREE_FNV_BASIS);
+    buffer_used += size;
+    bpt_mutex_unlock(&mutex);
+    return lsn;
+}
+
+/* The leader swaps the buffer for the spare, so
+ * records are appended while it writes, and
+ * writes and syncs the group without the mutex.
+ */
+bool BPTreeWAL::Commit( uint64_t lsn )
+{
+    char * group;
+    size_t group_size, group_capacity;
+    uint64_t group_lsn, offset;
+    bpt_file segment;
+    bool ok;
+
+    bpt_mutex_lock(&mutex);
+    while (durable_lsn < lsn && !failed) {
+        if (flushing) {
+            bpt_cond_wait(&flushed, &mutex, -1);
+            continue;
+        }
+        flushing = true;
+        if (commit_window > 0) {
+            bpt_mutex_unlock(&mutex);
+            bpt_sleep_us(commit_window);
+            bpt_mutex_lock(&mutex);
+        }
+        group = buffer;
+        group_size = buffer_used;
+        group_capacity = buffer_capacity;
+        group_lsn = last_lsn;
+        buffer = spare;
+        buffer_used = 0;
+        buffer_capacity = spare_capacity;
+        segment = segments[active];
+        offset = segment_sizes[active];
+        segment_sizes[active] += group_size;
+        bpt_mutex_unlock(&mutex);
+
+        ok = bpt_file_write(segment, offset, group, group_size) && bpt_file_sync(segment);
+
+        bpt_mutex_lock(&mutex);
+        spare = group;
+        spare_capacity = group_capacity;
+        if (ok)
+            durable_lsn = group_lsn;
+        else
+            failed = true;
+        syncs++;
+        flushing = false;
+        bpt_cond_broadcast(&flushed);
+    }
+    ok = !failed;
+    bpt_mutex_unlock(&mutex);
+    return ok;
+}
+
+/* Drops the buffered records up to lsn, the
+ * segments other than the one written, whose
+ * records all came before the rotation at the
+ * beginning of the checkpoint, and that one too
+ * once every record in it is up to lsn.  Records
+ * waiting to be committed up to lsn are durable
+ * in the checkpoint, and their waiters are
+ * released.
+ */
+bool BPTreeWAL::Truncate( uint64_t lsn )
+{
+    bpt_wal_record * r;
+    size_t offset = 0;
+    bool ok = true;
+    int s;
+
+    bpt_mutex_lock(&mutex);
+    while (flushing)
+        bpt_cond_wait(&flushed, &mutex, -1);
+    while (offset < buffer_used) {
+        r = (bpt_wal_record *)(buffer + offset);
+        if (r->lsn > lsn)
+            break;
+        offset += r->size;
+    }
+    if (offset > 0) {
+        memmove(buffer, buffer + offset, buffer_used - offset);
+        buffer_used -= offset;
+    }
+    for (s = 0; s < BPTREE_WAL_SEGMENTS; s++) {
+        if (s != active)
+            ok = clear_segment(s) && ok;
+    }
+    if (durable_lsn <= lsn) {
+        ok = clear_segment(active) && ok;
+        durable_lsn = lsn;
+        bpt_cond_broadcast(&flushed);
+    }
+    bpt_mutex_unlock(&mutex);
+    return ok;
+}
+
+void BPTreeWAL::SetCommitWindow( int nMicroseconds )
+{
+    commit_window = nMicroseconds > 0 ? nMicroseconds : 0;
+}
+
+uint64_t BPTreeWAL::GetLastLSN()
+{
+    uint64_t lsn;
+    bpt_mutex_lock(&mutex);
+    lsn = last_lsn;
+    bpt_mutex_unlock(&mutex);
+    return lsn;
+}
+
+uint64_t BPTreeWAL::GetDurableLSN()
+{
+    uint64_t lsn;
+    bpt_mutex_lock(&mutex);
+    lsn = durable_lsn;
+    bpt_mutex_unlock(&mutex);
+    return lsn;
+}
+
+uint64_t BPTreeWAL::GetSyncCount()
+{
+    uint64_t n;
+    bpt_mutex_lock(&mutex);
+    n = syncs;
+    bpt_mutex_unlock(&mutex);
+    return n;
+}
+
+int BPTreeWAL::record_size()
+{
+    return (int)((sizeof(bpt_wal_record) + key_size + 7) & ~(size_t)7);
+}
+
+/* Returns true if a whole record with the right
+ * size and checksum is at offset in a segment
+ * read into log.
+ */
+bool BPTreeWAL::valid_record( const char * log, uint64_t offset, uint64_t size )
+{
+    const bpt_wal_record * r = (const bpt_wal_record *)(log + offset);
+    int n = record_size();
+
+    return offset + n <= size && r->size == (uint32_t)n
+        && r->checksum == bpt_fnv1a(log + offset + sizeof(uint32_t), n - sizeof(uint32_t), BPTREE_FNV_BASIS);
+}
+
+bool BPTreeWAL::clear_segment( int segment )
+{
+    if (segment_sizes[segment] == 0)
+        return true;
+    if (!bpt_file_truncate(segments[segment], 0) || !bpt_file_sync(segments[segment]))
+        return false;
+    segment_sizes[segment] = 0;
+    return true;
+}
+
+/* Grows the buffer to hold size bytes.
+ */
+bool BPTreeWAL::reserve( size_t size )
+{
+    char * grown;
+    size_t capacity;
+
+    if (size <= buffer_capacity)
+        return true;
+    capacity = buffer_capacity > 0 ? buffer_capacity * 2 : 4096;
+    while (capacity < size)
+        capacity *= 2;
+    grown = (char *)realloc(buffer, capacity);
+    if (grown == NULL)
+        return false;
+    buffer = grown;
+    buffer_capacity = capacity;
+    return true;
+}
@@ -0,0 +1,215 @@
+/******************************************************************************
+ *
+ *  @brief B+ Tree Write-Ahead Log
+ *
+ *  @file bplustree_wal.h
+ *
+ *  Log of the changes made to a paged B+ tree since its last checkpoint.
+ *  Each Insert and Delete appends a logical record, the key and value
+ *  rather than the pages changed, numbered by a log sequence number, the
+ *  LSN.  A change is durable once its record is on the disk, and the
+ *  tree replays the records past the checkpoint when it is opened.
+ *
+ *  Records are written by group commit: a thread committing its record
+ *  while none is writing becomes the leader, waits out the commit window
+ *  for others to append, and writes and syncs every record appended so
+ *  far at once; the others wait for the leader, or lead the next group.
+ *  One sync thus makes many changes durable.  A record is checked by its
+ *  checksum, so replay stops at a record torn by a crash.
+ *
+ *  The log is kept in two segment files.  A checkpoint begins by rotating
+ *  to the empty segment, so the records after its beginning go there,
+ *  and once written drops the other segment whole: the log shrinks while
+ *  changes go on, without copying the records past the checkpoint.
+ *
+ *****************************************************************************/
+#ifndef _BPLUSTREE_WAL_HEADER
+#define _BPLUSTREE_WAL_HEADER
+
+#include <stdint.h>
+#include "bplustree_pagefile.h"
+#include "bplustree_thread.h"
+
+/**
+ * Types of log record.
+ */
+#define BPTREE_WAL_INSERT 1
+#define BPTREE_WAL_DELETE 2
+
+/**
+ * Default commit window in microseconds, the suffix
+ * of the path of the log, and the number of segments,
+ * each at the path of the log followed by its number.
+ */
+#define BPTREE_WAL_COMMIT_WINDOW 0
+#define BPTREE_WAL_SUFFIX "-wal"
+#define BPTREE_WAL_SEGMENTS 2
+
+/**
+ * Log record, followed by the key slot and padded
+ * to 8 bytes.  The checksum covers the rest of the
+ * record.
+ */
+typedef struct bpt_wal_record {
+    uint32_t checksum;      /**< FNV-1a of the record after this field.*/
+    uint32_t size;          /**< Size of the record, padding included.*/
+    uint64_t lsn;           /**< Log sequence number.*/
+    int32_t type;           /**< BPTREE_WAL_INSERT or BPTREE_WAL_DELETE.*/
+    int32_t value;          /**< Value inserted.*/
+} bpt_wal_record;
+
+/**
+ * Function replaying a record.
+ */
+typedef void (*bpt_wal_apply)( void * arg, int type, char * key, int value );
+
+/**
+ * BPTreeWAL class.
+ * Append and Commit may be called from many threads at once.
+ */
+class BPTREE_INTERFACE_API BPTreeWAL
+{
+public:
+    BPTreeWAL();
+
+    /**
+     * BPTreeWAL destructor, closes the log.
+     */
+    ~BPTreeWAL();
+public:
+    /**
+     * Opens the segments of a log, creating them if they
+     * do not exist.
+     * @param path      Path of the log
+     * @param nKeySize  Size of the key slot in a record
+     * @return      Return false if the log can not be opened.
+     */
+    bool Open( const char * path, int nKeySize );
+
+    /**
+     * Closes the log, dropping records not committed.
+     */
+    void Close();
+
+    /**
+     * Returns true if a segment of a log exists.
+     * @param path      Path of the log
+     */
+    static bool Exists( const char * path );
+
+    /**
+     * Replays the records past an LSN in order, drops the
+     * records after the first torn one and the segments
+     * holding none past the LSN, and numbers new records
+     * from the last.
+     * @param lsn       LSN of the last change already in the tree
+     * @param fn        Function replaying a record
+     * @param arg       Argument passed to fn
+     * @return      Return false on an I/O error.
+     */
+    bool Replay( uint64_t lsn, bpt_wal_apply fn, void * arg );
+
+    /**
+     * Appends a record to the log buffer.  Records must be
+     * appended in the order their changes were made.
+     * @param type      BPTREE_WAL_INSERT or BPTREE_WAL_DELETE
+     * @param key       The key slot
+     * @param value     The value inserted
+     * @return      Return the LSN of the record.
+     */
+    uint64_t Append( int type, const char * key, int value );
+
+    /**
+     * Waits until the records up to an LSN are on the disk,
+     * writing them as the leader of a group if none is.
+     * @param lsn       The LSN
+     * @return      Return false if the log could not be written.
+     */
+    bool Commit( uint64_t lsn );
+
+    /**
+     * Drops every record, as for a new tree.
+     * @return      Return false on an I/O error.
+     */
+    bool Reset();
+
+    /**
+     * Writes the records appended from now on to the other
+     * segment, if it is empty, as a checkpoint begins.
+     */
+    void Rotate();
+
+    /**
+     * Drops the records up to an LSN, once a checkpoint has
+     * put their changes in the tree file: the segment rotated
+     * from, and the current one if it holds none past the LSN.
+     * Records appended past it are kept.
+     * @param lsn       LSN of the checkpoint
+     * @return      Return false on an I/O error.
+     */
+    bool Truncate( uint64_t lsn );
+
+    /**
+     * Sets the time a leader waits for more records
+     * before writing its group.
+     * @param nMicroseconds     The commit window(Default:BPTREE_WAL_COMMIT_WINDOW)
+     */
+    void SetCommitWindow( int nMicroseconds );
+
+    /**
+     * Returns the LSN of the last record appended, and
+     * of the last record on the disk.
+     */
+    uint64_t GetLastLSN();
+    uint64_t GetDurableLSN();
+
+    /**
+     * Returns the number of syncs of the log.
+     */
+    uint64_t GetSyncCount();
+private:
+    int record_size();
+    bool reserve( size_t size );
+    bool valid_record( const char * log, uint64_t offset, uint64_t size );
+    bool clear_segment( int segment );
+private:
+    /**
+     * The segment files, their sizes, the segment written,
+     * and the size of a key slot.
+     */
+    bpt_file segments[BPTREE_WAL_SEGMENTS];
+    uint64_t segment_sizes[BPTREE_WAL_SEGMENTS];
+    int active;
+    int key_size;
+
+    /**
+     * Records appended and not written, and the buffer
+     * swapped in while a leader writes them.
+     */
+    char * buffer;
+    size_t buffer_used;
+    size_t buffer_capacity;
+    char * spare;
+    size_t spare_capacity;
+
+    /**
+     * LSNs of the last record appended and the last on
+     * the disk, whether a leader is writing, whether a
+     * write failed, the commit window and sync count.
+     */
+    uint64_t last_lsn;
+    uint64_t durable_lsn;
+    bool flushing;
+    bool failed;
+    int commit_window;
+    uint64_t syncs;
+
+    /**
+     * Mutex of the log, and the condition of a group
+     * written.
+     */
+    bpt_mutex mutex;
+    bpt_cond flushed;
+};
+
+#endif
@@ -10,7 +10,8 @@ void usage_1( void )
 {
 	printf("To build a B+ tree of a different order, start again and enter the order\n");
 	printf("as an integer argument:  simpletest <order>  ");
-	printf("(%d <= order <= %d).\n", BPTREE_MIN_ORDER, BPTREE_MAX_ORDER);
+	printf("(order >= %d, or %d to fit a %d byte node).\n", BPTREE_MIN_ORDER,
+			BPTREE_ORDER_AUTO, BPTREE_DEFAULT_NODE_SIZE);
 	printf("the order followed by the key length:\n"
 			"simpletest <order> <key_length> .\n");
 }
@@ -23,6 +24,8 @@ void usage_2( void )
 	printf("\ti <k> <v>  -- Insert <k> (an integer) as key and <v> (an integer) as value).\n");
 	printf("\tf <k>  -- Find the value under key <k>.\n");
 	printf("\tp <k> -- Print the path from the root to key k and its associated value.\n");
+	printf("\tr <k1> <k2> -- Print the keys and values found in the range "
+			"[<k1>, <k2>].\n");
 	printf("\td <k>  -- Delete key <k> and its associated value.\n");
 	printf("\tx -- Destroy the whole tree.  Start again with an empty tree of the same order.\n");
 	printf("\tt -- Print the B+ tree.\n");
@@ -37,19 +40,20 @@ void usage_2( void )
 void usage_3( void )
 {
 	printf("Usage: ./simpletest [<order>]\n");
-	printf("\twhere %d <= order <= %d .\n", BPTREE_MIN_ORDER, BPTREE_MAX_ORDER);
+	printf("\twhere order >= %d, or %d to fit a %d byte node.\n", BPTREE_MIN_ORDER,
+			BPTREE_ORDER_AUTO, BPTREE_DEFAULT_NODE_SIZE);
 }
 
 int main(int argc, char ** argv)
 {
 	char instruction;
-	int input, value;
+	int input, input_2, value;
 	int order = BPTREE_DEFAULT_ORDER, key_length = BPTREE_DEFAULT_KEY_LENGTH;
 	bool verbose_output = false;
 	
 	if (argc > 1) {
 		order = atoi(argv[1]);
-		if (order < BPTREE_MIN_ORDER || order > BPTREE_MAX_ORDER) {
+		if (order < BPTREE_MIN_ORDER && order != BPTREE_ORDER_AUTO) {
 			fprintf(stderr, "Invalid order: %d .\n\n", order);
 			usage_3();
 			exit(EXIT_FAILURE);
@@ -86,6 +90,17 @@ int main(int argc, char ** argv)
 		case 'l':
 			bptree.PrintBPTreeLeaves();
 			break;
+		case 'r':
+			scanf("%d %d", &input, &input_2);
+			{
+				BPlusTree::range r = bptree.Range(input, input_2);
+				BPlusTree::iterator it;
+				if (r.begin() == r.end())
+					printf("None found.\n");
+				for (it = r.begin(); it != r.end(); ++it)
+					printf("Key: %s  Value: %d\n", it.GetKey(), it->value);
+			}
+			break;
 		case 'q':
 			while (getchar() != (int)'\n');
 			return EXIT_SUCCESS;
@@ -7,12 +7,20 @@ TEMPLATE = app
 TARGET = simpletest
 DESTDIR = bin
 INCLUDEPATH += ../
+unix:LIBS += -lpthread
 
 MOC_DIR	= temp/$$TARGET/moc
 UI_DIR = temp/$$TARGET/ui
 OBJECTS_DIR = temp/$$TARGET/obj
 
 SOURCES +=	simpletest.cpp \
-			../bplustree.cpp 
+			../bplustree.cpp \
+			../bplustree_arena.cpp \
+			../bplustree_sharded.cpp \
+			../bplustree_pagefile.cpp \
+			../bplustree_paged.cpp \
+			../bplustree_bufferpool.cpp \
+			../bplustree_snapshot.cpp \
+			../bplustree_wal.cpp 
 
 
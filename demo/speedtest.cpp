@@ -1,20 +1,30 @@
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <vector>
+#include <utility>
 #include "bplustree.h"
+#include "bplustree_template.h"
+#include "bplustree_arena.h"
+#include "bplustree_sharded.h"
+#include "bplustree_paged.h"
+#include "bplustree_snapshot.h"
+#include "bplustree_thread.h"
 
 #define BPTREE_ORDER 4
 #define BPTREE_KEY_LENGTH 8
 #define TOTAL_RECORD_NUM 500000
 
-int main(int argc, char ** argv)
+void speed_test(const char * name, int key_type, int order, BPTreeAllocator * allocator = NULL)
 {
-	BPlusTree bptree(BPTREE_ORDER, BPTREE_KEY_LENGTH);
+	BPlusTree bptree(order, BPTREE_KEY_LENGTH, key_type);
+	bptree.SetAllocator(allocator);
 
 	struct timeval start;
 	struct timeval end;
 
-	printf("Total record number: %d\n", TOTAL_RECORD_NUM);
+	printf("[%s, order %d%s]\n", name, bptree.GetOrder(), allocator != NULL ? ", arena" : "");
 	int i = 0;
 	gettimeofday(&start, NULL);
 	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
@@ -25,11 +35,12 @@ int main(int argc, char ** argv)
 	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
 	printf("Insert time: %ldus\n", costtime);
 
+	srand(1);
 	gettimeofday(&start, NULL);
 	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
 	{
 		//int key = i+1;
-		int key = rand()%TOTAL_RECORD_NUM;
+		int key = rand()%TOTAL_RECORD_NUM + 1;
 		record * rcd = bptree.Find(key, false);
 		if(rcd != NULL)
 		{
@@ -47,14 +58,463 @@ int main(int argc, char ** argv)
     gettimeofday(&start, NULL);
     for(i = 1; i <= TOTAL_RECORD_NUM; i++)
     {
-        int key = rand()%TOTAL_RECORD_NUM;
+        int key = rand()%TOTAL_RECORD_NUM + 1;
         bptree.Delete(key);
     }
     gettimeofday(&end, NULL);
 	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
     printf("Delete time: %ldus\n", costtime);
 
-	return 0;
+    gettimeofday(&start, NULL);
+    bptree.DestroyBPTree();
+    gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+    printf("Destroy time: %ldus\n", costtime);
+}
+
+void bulk_load_test(const char * name, int key_type, int order, bool parallel = false)
+{
+	BPlusTree bptree(order, BPTREE_KEY_LENGTH, key_type);
+	std::vector<std::pair<int, int> > pairs;
+
+	struct timeval start;
+	struct timeval end;
+
+	printf("[%s, order %d, %s]\n", name, bptree.GetOrder(), parallel ? "parallel bulk load" : "bulk load");
+	int i = 0;
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		pairs.push_back(std::make_pair(i, i));
+	}
+	gettimeofday(&start, NULL);
+	if(parallel)
+		bptree.ParallelBulkLoad(pairs.begin(), pairs.end());
+	else
+		bptree.BulkLoad(pairs.begin(), pairs.end());
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Bulk load time: %ldus\n", costtime);
+
+	srand(1);
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		if(bptree.Find(key, false) == NULL)
+		{
+			printf("key: %d not found\n", key);
+		}
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Select time: %ldus\n", costtime);
+
+	long sum = 0;
+	gettimeofday(&start, NULL);
+	for(BPlusTree::iterator it = bptree.Begin(); it != bptree.End(); ++it)
+	{
+		sum += it->value;
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Scan time: %ldus (sum %ld)\n", costtime, sum);
+
+	gettimeofday(&start, NULL);
+	scan_result result = bptree.ParallelScan(1, TOTAL_RECORD_NUM);
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Parallel scan time: %ldus (sum %ld)\n", costtime, (long)result.sum);
+}
+
+void sharded_speed_test(const char * name, int key_type, int shards)
+{
+	ShardedBPlusTree bptree(shards, BPTREE_ORDER, BPTREE_KEY_LENGTH, key_type);
+
+	struct timeval start;
+	struct timeval end;
+
+	printf("[%s, order %d, %d shards]\n", name, BPTREE_ORDER, bptree.GetShardCount());
+	int i = 0;
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Insert time: %ldus\n", costtime);
+
+	srand(1);
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		int value;
+		if(!bptree.FindValue(key, &value))
+		{
+			printf("key: %d not found\n", key);
+		}
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Select time: %ldus\n", costtime);
+
+	long sum = 0;
+	gettimeofday(&start, NULL);
+	for(ShardedBPlusTree::iterator it = bptree.Begin(); it != bptree.End(); ++it)
+	{
+		sum += it->value;
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Merged scan time: %ldus (sum %ld)\n", costtime, sum);
+
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		bptree.Delete(key);
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Delete time: %ldus\n", costtime);
+}
+
+void template_speed_test(const char * name)
+{
+	bptree::BPlusTree<int, int, std::less<int>, BPTREE_ORDER> bptree;
+
+	struct timeval start;
+	struct timeval end;
+
+	printf("[%s]\n", name);
+	int i = 0;
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Insert time: %ldus\n", costtime);
+
+	srand(1);
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		if(bptree.Find(key) == NULL)
+		{
+			printf("key: %d not found\n", key);
+		}
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Select time: %ldus\n", costtime);
+
+    gettimeofday(&start, NULL);
+    for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+    {
+        int key = rand()%TOTAL_RECORD_NUM + 1;
+        bptree.Delete(key);
+    }
+    gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+    printf("Delete time: %ldus\n", costtime);
+}
+
+void paged_speed_test(const char * name, int key_type, int frames, int policy)
+{
+	const char * path = "speedtest.bpt";
+	const char * policies[] = { "clock", "lru-k", "2q" };
+	PagedBPlusTree bptree;
+	bptree.SetBufferPool(frames, policy);
+
+	struct timeval start;
+	struct timeval end;
+
+	remove(path);
+	if(!bptree.Open(path, BPTREE_ORDER_AUTO, BPTREE_KEY_LENGTH, key_type))
+	{
+		printf("can not open %s\n", path);
+		return;
+	}
+	printf("[%s, paged, order %d, %d frames, %s]\n", name, bptree.GetOrder(), frames, policies[policy]);
+	int i = 0;
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Insert time: %ldus\n", costtime);
+
+	/* Reopened, the tree is read back
+	 * from the file as lookups reach it.
+	 */
+	bptree.Close();
+	bptree.Open(path);
+	srand(1);
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		int value = 0;
+		if(!bptree.FindValue(key, &value) || value != key)
+		{
+			printf("key: %d not found\n", key);
+		}
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Select time: %ldus\n", costtime);
+
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		bptree.Delete(key);
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Delete time: %ldus, %u pages\n", costtime, bptree.GetPageCount());
+	printf("Pool hits: %llu, misses: %llu\n", (unsigned long long)bptree.GetBufferPool()->GetHitCount(),
+		(unsigned long long)bptree.GetBufferPool()->GetMissCount());
+
+	bptree.Close();
+	remove(path);
+}
+
+#define WAL_THREADS 8
+#define WAL_RECORD_NUM 20000
+#define WAL_FRAMES 64
+
+void wal_insert_task(void * arg, int index)
+{
+	PagedBPlusTree * bptree = (PagedBPlusTree *)arg;
+	for(int i = index; i < WAL_RECORD_NUM; i += WAL_THREADS)
+	{
+		bptree->Insert(i + 1, i + 1);
+	}
+}
+
+void wal_speed_test(const char * name, int key_type, int commit_window)
+{
+	const char * path = "speedtest.bpt";
+	PagedBPlusTree bptree;
+	bptree.SetBufferPool(WAL_FRAMES);
+	bptree.SetWriteAheadLog(true, commit_window);
+
+	struct timeval start;
+	struct timeval end;
+
+	remove(path);
+	if(!bptree.Open(path, BPTREE_ORDER_AUTO, BPTREE_KEY_LENGTH, key_type))
+	{
+		printf("can not open %s\n", path);
+		return;
+	}
+	printf("[%s, paged, log, %d threads, %dus window, %d frames]\n", name, WAL_THREADS, commit_window, WAL_FRAMES);
+	gettimeofday(&start, NULL);
+	bpt_run_tasks(wal_insert_task, &bptree, WAL_THREADS);
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	unsigned long long syncs = bptree.GetWriteAheadLog()->GetSyncCount();
+	unsigned long long checkpoints = bptree.GetCheckpointCount();
+	printf("Insert time: %ldus, %d inserts, %llu syncs, %llu checkpoints\n", costtime, WAL_RECORD_NUM, syncs, checkpoints);
+
+	bptree.Close();
+	remove(path);
+	remove("speedtest.bpt" BPTREE_JOURNAL_SUFFIX);
+	remove("speedtest.bpt" BPTREE_WAL_SUFFIX ".0");
+	remove("speedtest.bpt" BPTREE_WAL_SUFFIX ".1");
+}
+
+void snapshot_speed_test(const char * name, int key_type)
+{
+	const char * path = "speedtest.snap";
+	BPlusTree bptree(BPTREE_ORDER_AUTO, BPTREE_KEY_LENGTH, key_type);
+	BPTreeSnapshot snapshot;
+
+	struct timeval start;
+	struct timeval end;
+
+	int i = 0;
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	printf("[%s, snapshot, order %d]\n", name, bptree.GetOrder());
+	gettimeofday(&start, NULL);
+	bool saved = bptree.SaveSnapshot(path);
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	long file_size = 0;
+	FILE * fp = fopen(path, "rb");
+	if(fp != NULL)
+	{
+		fseek(fp, 0, SEEK_END);
+		file_size = ftell(fp);
+		fclose(fp);
+	}
+	printf("Save time: %ldus, %ld bytes\n", costtime, file_size);
+
+	gettimeofday(&start, NULL);
+	if(!saved || !snapshot.Open(path))
+	{
+		printf("can not map %s\n", path);
+		return;
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Open time: %ldus\n", costtime);
+
+	srand(1);
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int key = rand()%TOTAL_RECORD_NUM + 1;
+		int value = 0;
+		if(!snapshot.FindValue(key, &value) || value != key)
+		{
+			printf("key: %d not found\n", key);
+		}
+	}
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Select time: %ldus\n", costtime);
+
+	snapshot.Close();
+	remove(path);
 }
 
+#define COW_THREADS 4
+#define COW_RECORD_NUM 100000
+#define COW_SCANS 20
 
+void cow_task(void * arg, int index)
+{
+	BPlusTree * bptree = (BPlusTree *)arg;
+	int i = 0;
+	if(index == 0)
+	{
+		for(i = 1; i <= COW_RECORD_NUM; i++)
+		{
+			bptree->Delete(i);
+			bptree->Insert(COW_RECORD_NUM + i, i);
+		}
+		return;
+	}
+	for(i = 0; i < COW_SCANS; i++)
+	{
+		tree_snapshot snapshot = bptree->TakeSnapshot();
+		scan_result first = bptree->Scan(&snapshot, 1, 2 * COW_RECORD_NUM);
+		scan_result second = bptree->Scan(&snapshot, 1, 2 * COW_RECORD_NUM);
+		if(first.count != second.count || first.sum != second.sum)
+		{
+			printf("snapshot changed: %lld, %lld keys\n", (long long)first.count, (long long)second.count);
+		}
+		bptree->ReleaseSnapshot(&snapshot);
+	}
+}
+
+void cow_speed_test(const char * name, int key_type)
+{
+	BPlusTree bptree(BPTREE_ORDER_AUTO, BPTREE_KEY_LENGTH, key_type);
+	bptree.SetConcurrency(BPTREE_CONCURRENCY_COPY_ON_WRITE);
+
+	struct timeval start;
+	struct timeval end;
+
+	printf("[%s, copy-on-write, order %d, %d threads]\n", name, bptree.GetOrder(), COW_THREADS);
+	int i = 0;
+	gettimeofday(&start, NULL);
+	for(i = 1; i <= COW_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	gettimeofday(&end, NULL);
+	long costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Insert time: %ldus\n", costtime);
+
+	gettimeofday(&start, NULL);
+	bpt_run_tasks(cow_task, &bptree, COW_THREADS);
+	gettimeofday(&end, NULL);
+	costtime = 1000000*(end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+	printf("Update and scan time: %ldus, %d updates, %d snapshot scans\n", costtime, COW_RECORD_NUM, (COW_THREADS - 1) * COW_SCANS * 2);
+}
+
+int main(int argc, char ** argv)
+{
+	int i = 0;
+	printf("Total record number: %d\n", TOTAL_RECORD_NUM);
+
+	speed_test("string keys", BPTREE_KEY_TYPE_STRING, BPTREE_ORDER);
+	speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, BPTREE_ORDER);
+	template_speed_test("template int keys");
+
+	/* Nodes and records taken from a slab
+	 * arena, released in bulk on destroy.
+	 */
+	BPTreeArena arena;
+	speed_test("string keys", BPTREE_KEY_TYPE_STRING, BPTREE_ORDER, &arena);
+	speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, BPTREE_ORDER, &arena);
+
+	/* Sorted keys loaded bottom-up into
+	 * packed leaves.
+	 */
+	bulk_load_test("string keys", BPTREE_KEY_TYPE_STRING, BPTREE_ORDER);
+	bulk_load_test("integer keys", BPTREE_KEY_TYPE_INTEGER, BPTREE_ORDER);
+	bulk_load_test("string keys", BPTREE_KEY_TYPE_STRING, BPTREE_ORDER, true);
+	bulk_load_test("integer keys", BPTREE_KEY_TYPE_INTEGER, BPTREE_ORDER, true);
+
+	/* Keys hashed over independent trees,
+	 * each latched and with an arena.
+	 */
+	sharded_speed_test("string keys", BPTREE_KEY_TYPE_STRING, 16);
+	sharded_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, 16);
+
+	/* One node per page of a file, cached in
+	 * a buffer pool, then in a pool of a small
+	 * part of the tree under each policy.
+	 */
+	paged_speed_test("string keys", BPTREE_KEY_TYPE_STRING, BPTREE_POOL_DEFAULT_FRAMES * 4, BPTREE_EVICT_CLOCK);
+	paged_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, BPTREE_POOL_DEFAULT_FRAMES * 4, BPTREE_EVICT_CLOCK);
+	int policies[] = { BPTREE_EVICT_CLOCK, BPTREE_EVICT_LRU_K, BPTREE_EVICT_2Q };
+	for(i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+	{
+		paged_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, 256, policies[i]);
+	}
+
+	/* Durable inserts from many threads,
+	 * each log sync committing a group, and
+	 * checkpoints taken in the background.
+	 */
+	wal_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, 0);
+	wal_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, 100);
+
+	/* A snapshot mapped read only, queried
+	 * with nothing read up front.
+	 */
+	snapshot_speed_test("string keys", BPTREE_KEY_TYPE_STRING);
+	snapshot_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER);
+
+	/* Snapshots scanned whole while a
+	 * writer copies the paths it changes.
+	 */
+	cow_speed_test("string keys", BPTREE_KEY_TYPE_STRING);
+	cow_speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER);
+
+	/* Large orders, where the search within
+	 * a node dominates.
+	 */
+	int orders[] = { 32, 128, 256 };
+	for(i = 0; i < (int)(sizeof(orders) / sizeof(orders[0])); i++)
+	{
+		speed_test("string keys", BPTREE_KEY_TYPE_STRING, orders[i]);
+		speed_test("integer keys", BPTREE_KEY_TYPE_INTEGER, orders[i]);
+	}
+
+	return 0;
+}
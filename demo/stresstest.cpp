@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "bplustree.h"
+
+#define BPTREE_ORDER 8
+#define BPTREE_KEY_LENGTH 8
+#define TOTAL_RECORD_NUM 100000
+#define READER_NUM 4
+#define DELETER_NUM 4
+#define RUN_SECONDS 5
+
+/* Readers look keys up while deleters delete and
+ * insert them again, so nodes are merged and split
+ * and records freed under the readers.  Every key
+ * maps to itself, so a reader that reads a freed
+ * record or node sees a wrong value.
+ */
+struct stress_state
+{
+	BPlusTree * bptree;
+	volatile int stop;
+	int deleters;
+};
+
+struct stress_thread
+{
+	stress_state * state;
+	int id;
+	pthread_t thread;
+	long ops;
+	long errors;
+};
+
+void * reader(void * arg)
+{
+	stress_thread * t = (stress_thread *)arg;
+	unsigned int seed = t->id + 1;
+	while(!t->state->stop)
+	{
+		int key = rand_r(&seed)%TOTAL_RECORD_NUM + 1;
+		int value;
+		if(t->state->bptree->FindValue(key, &value) && value != key)
+		{
+			t->errors++;
+		}
+		t->ops++;
+	}
+	return NULL;
+}
+
+void * deleter(void * arg)
+{
+	stress_thread * t = (stress_thread *)arg;
+	unsigned int seed = t->id + 1;
+	int stripe = TOTAL_RECORD_NUM / t->state->deleters;
+	while(!t->state->stop)
+	{
+		/* Delete a run of keys of its own stripe,
+		 * emptying leaves, then insert them again.
+		 */
+		int first = t->id * stripe + rand_r(&seed)%stripe + 1;
+		int last = first + 64 < (t->id + 1) * stripe ? first + 64 : (t->id + 1) * stripe;
+		int key;
+		for(key = first; key <= last; key++)
+		{
+			t->state->bptree->Delete(key);
+		}
+		for(key = first; key <= last; key++)
+		{
+			t->state->bptree->Insert(key, key);
+		}
+		t->ops += 2 * (last - first + 1);
+	}
+	return NULL;
+}
+
+int stress_test(const char * name, int mode, int readers, int deleters, int seconds)
+{
+	BPlusTree bptree(BPTREE_ORDER, BPTREE_KEY_LENGTH, BPTREE_KEY_TYPE_INTEGER);
+	stress_state state;
+	stress_thread threads[READER_NUM + DELETER_NUM];
+	int i = 0;
+
+	printf("[%s, %d readers, %d deleters, %ds]\n", name, readers, deleters, seconds);
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		bptree.Insert(i, i);
+	}
+	bptree.SetConcurrency(mode);
+
+	state.bptree = &bptree;
+	state.stop = 0;
+	state.deleters = deleters;
+	for(i = 0; i < readers + deleters; i++)
+	{
+		threads[i].state = &state;
+		threads[i].id = i < readers ? i : i - readers;
+		threads[i].ops = 0;
+		threads[i].errors = 0;
+		pthread_create(&threads[i].thread, NULL, i < readers ? reader : deleter, &threads[i]);
+	}
+	sleep(seconds);
+	state.stop = 1;
+
+	long reads = 0, writes = 0, errors = 0;
+	for(i = 0; i < readers + deleters; i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		if(i < readers)
+			reads += threads[i].ops;
+		else
+			writes += threads[i].ops;
+		errors += threads[i].errors;
+	}
+	bptree.SetConcurrency(BPTREE_CONCURRENCY_NONE);
+
+	/* All keys are back once the deleters stopped.
+	 */
+	for(i = 1; i <= TOTAL_RECORD_NUM; i++)
+	{
+		int value;
+		if(!bptree.FindValue(i, &value) || value != i)
+		{
+			errors++;
+		}
+	}
+	printf("Reads: %ld, writes: %ld, errors: %ld\n", reads, writes, errors);
+	return errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char ** argv)
+{
+	int readers = argc > 1 ? atoi(argv[1]) : READER_NUM;
+	int deleters = argc > 2 ? atoi(argv[2]) : DELETER_NUM;
+	int seconds = argc > 3 ? atoi(argv[3]) : RUN_SECONDS;
+	int failed = 0;
+
+	if(readers < 1 || readers > READER_NUM || deleters < 1 || deleters > DELETER_NUM)
+	{
+		printf("usage: stresstest [readers (1-%d)] [deleters (1-%d)] [seconds]\n", READER_NUM, DELETER_NUM);
+		return 1;
+	}
+
+	failed |= stress_test("latched", BPTREE_CONCURRENCY_LATCH, readers, deleters, seconds);
+	failed |= stress_test("optimistic", BPTREE_CONCURRENCY_OPTIMISTIC, readers, deleters, seconds);
+
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
@@ -0,0 +1,21 @@
+CONFIG +=	warn_on \
+			debug \
+			thread
+CONFIG -=	qt
+QT -= gui core
+
+TEMPLATE = app
+TARGET = stresstest
+DESTDIR = bin
+INCLUDEPATH += ../
+unix:LIBS += -lpthread
+
+MOC_DIR	= temp/$$TARGET/moc
+UI_DIR = temp/$$TARGET/ui
+OBJECTS_DIR = temp/$$TARGET/obj
+
+SOURCES +=	stresstest.cpp \
+			../bplustree.cpp 
+
+
+